@@ -0,0 +1,235 @@
+// ============================================================================
+// lemon-frontend-bench: compiler throughput micro-benchmarks.
+// ============================================================================
+// Feeds synthetic Lemon sources of growing size through the Lexer, Parser 
+// and LemonAST::codegen() and reports tokens/sec, AST nodes/sec and IR 
+// instructions/sec. Output format follows Google Benchmark's console output.
+//
+// Usage: lemon-frontend-bench [--filter=<substring>] [--min-time=<sec>] [--max-size=<n>]
+
+#include "../include/Lexer.h"
+#include "../include/Parser.h"
+#include "../include/AST.h"
+#include "../include/CompilerSession.h"
+
+#include <chrono>
+#include <cstring>
+#include <functional>
+
+static ExitOnError ExitOnErr;
+
+// ============================================================================
+//                            Synthetic sources
+// ============================================================================
+
+// n statements, split into functions of at most 1000 statements each so 
+// every size has the same per-function shape.
+std::string genStatements(int n) {
+    std::string src;
+    int funcs = (n + 999) / 1000;
+    for (int f = 0; f < funcs; ++f) {
+        int count = std::min(1000, n - f * 1000);
+        src += "func body" + std::to_string(f) + "(a, b) {\n";
+        src += "    var x = a;\n";
+        for (int i = 1; i < count - 1; ++i) {
+            switch (i % 4) {
+            case 0: src += "    x = x * 3 + b;\n"; break;
+            case 1: src += "    x = (x - a) / 2;\n"; break;
+            case 2: src += "    var t" + std::to_string(i) + " = x * b - 1;\n"; break;
+            case 3: src += "    x = x + t" + std::to_string(i - 1) + " * 0.5;\n"; break;
+            }
+        }
+        src += "    return x;\n}\n";
+    }
+    src += "body0(1, 2);\n";
+    return src;
+}
+
+// One expression nested `depth` levels deep: (((a + 1) * 2) - 3) ...
+std::string genNesting(int depth) {
+    static const char *ops[] = {" + ", " * ", " - ", " / "};
+    std::string expr = "a";
+    for (int i = 0; i < depth; ++i)
+        expr = "(" + expr + ops[i % 4] + std::to_string(i % 7 + 1) + ")";
+    return "func nested(a) {\n    return " + expr + ";\n}\nnested(1);\n";
+}
+
+// Nested to the right and through unary ops: -(1 - !(2 * -(3 < ...)))
+// Every level recurses through ParseUnary and ParseExpression.
+std::string genRightNesting(int depth) {
+    static const char *ops[] = {" - ", " * ", " != ", " / "};
+    static const char *unary[] = {"-", "!", "", "- -"};
+    std::string expr = "a";
+    for (int i = depth - 1; i >= 0; --i)
+        expr = std::string(unary[i % 4]) + "(" + std::to_string(i % 7 + 1) + ops[i % 4] + expr + ")";
+    return "func rnested(a) {\n    return " + expr + ";\n}\nrnested(1);\n";
+}
+
+// Long flat operator chain: a + 1 * 2 - 3 / 4 + ... (operator precedence)
+std::string genChain(int length) {
+    static const char *ops[] = {" + ", " * ", " - ", " / ", " < "};
+    std::string expr = "a";
+    for (int i = 0; i < length; ++i)
+        expr += ops[i % 5] + std::to_string(i % 7 + 1);
+    return "func chain(a) {\n    return " + expr + ";\n}\nchain(1);\n";
+}
+
+// n small functions, each calling the previous one.
+std::string genFunctions(int n) {
+    std::string src = "func f0(x) {\n    return x + 1;\n}\n";
+    for (int i = 1; i < n; ++i)
+        src += "func f" + std::to_string(i) + "(x) {\n    return f" + 
+               std::to_string(i - 1) + "(x) * 2 + " + std::to_string(i) + ";\n}\n";
+    src += "f" + std::to_string(n - 1) + "(1);\n";
+    return src;
+}
+
+// ============================================================================
+//                               Benchmarks
+// ============================================================================
+
+struct Result {
+    double itemsPerIter;    // tokens, AST nodes or IR instructions
+    const char *unit;
+};
+
+double MIN_TIME = 0.5;      // --min-time, seconds per benchmark
+
+void lexOnly(const std::string &src, Result &r) {
+    Lexer Lex;
+    Lex.setSource(src.data(), src.data() + src.size());
+    uint64_t tokens = 0;
+    while (Lex.getNextToken() != tok_eof)
+        tokens++;
+    r = {(double)tokens, "tokens"};
+}
+
+void parseOnly(CompilerSession &S, const std::string &src, Result &r) {
+    S.Lex.setSource(src.data(), src.data() + src.size());
+    uint64_t before = NumASTNodes;
+    S.Lex.getNextToken();
+    auto ast = Parser(S).Parse();
+    r = {(double)(NumASTNodes - before), "nodes"};
+}
+
+// Parsing is not timed here, only IR generation (+ per-function passes).
+double codegenOnly(CompilerSession &S, const std::string &src, Result &r) {
+    S.Lex.setSource(src.data(), src.data() + src.size());
+    S.Lex.getNextToken();
+    auto ast = Parser(S).Parse();
+
+    S.InitializeModule();
+    auto start = std::chrono::steady_clock::now();
+
+    FunctionType *FT = FunctionType::get(Type::getDoubleTy(*S.TheContext), false);
+    Function *F = Function::Create(FT, Function::ExternalLinkage, "lemon_main", S.TheModule.get());
+    S.MainBuilder->SetInsertPoint(BasicBlock::Create(*S.TheContext, "entry", F));
+    ast->codegen(S);
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    r = {(double)S.TheModule->getInstructionCount(), "IR instrs"};
+
+    // Module has to go before InitializeModule() replaces its context.
+    S.TheModule.reset();
+    return elapsed.count();
+}
+
+std::string humanRate(double perSec) {
+    char buf[64];
+    if (perSec >= 1e9)      snprintf(buf, sizeof(buf), "%.2fG", perSec / 1e9);
+    else if (perSec >= 1e6) snprintf(buf, sizeof(buf), "%.2fM", perSec / 1e6);
+    else if (perSec >= 1e3) snprintf(buf, sizeof(buf), "%.2fk", perSec / 1e3);
+    else                    snprintf(buf, sizeof(buf), "%.2f", perSec);
+    return buf;
+}
+
+// Runs body until MIN_TIME has passed (at least once), body returns the 
+// seconds it wants counted or a negative value to time the whole call.
+void runBenchmark(const std::string &name, const std::string &src,
+                  std::function<double(const std::string &, Result &)> body) {
+    double total = 0;
+    int iterations = 0;
+    Result r = {0, ""};
+
+    while (total < MIN_TIME || iterations == 0) {
+        auto start = std::chrono::steady_clock::now();
+        double counted = body(src, r);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        total += (counted >= 0) ? counted : elapsed.count();
+        iterations++;
+    }
+
+    double perIter = total / iterations;
+    printf("%-36s %12.3f ms %10d %14s %s/s\n", name.c_str(), perIter * 1e3, iterations,
+           humanRate(r.itemsPerIter / perIter).c_str(), r.unit);
+    fflush(stdout);
+}
+
+int main(int argc, char **argv) {
+    std::string filter;
+    int maxSize = 1000000;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg.rfind("--filter=", 0) == 0)
+            filter = arg.substr(strlen("--filter="));
+        else if (arg.rfind("--min-time=", 0) == 0)
+            MIN_TIME = atof(arg.c_str() + strlen("--min-time="));
+        else if (arg.rfind("--max-size=", 0) == 0)
+            maxSize = atoi(arg.c_str() + strlen("--max-size="));
+        else {
+            fprintf(stderr, "🍋 Unknown option: %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    InitializeNativeTarget();
+    InitializeNativeTargetAsmPrinter();
+    InitializeNativeTargetAsmParser();
+    auto JIT = ExitOnErr(LemonJIT::Create());
+    auto S = ExitOnErr(CompilerSession::Create(*JIT));
+
+    struct Input {
+        std::string name;
+        int size;
+        std::function<std::string(int)> gen;
+    };
+    std::vector<Input> inputs;
+    for (int n : {1000, 10000, 100000, 1000000})
+        inputs.push_back({"statements/" + std::to_string(n), n, genStatements});
+    for (int n : {100, 1000, 10000})
+        inputs.push_back({"nesting/" + std::to_string(n), n, genNesting});
+    for (int n : {100, 1000, 10000})
+        inputs.push_back({"rnesting/" + std::to_string(n), n, genRightNesting});
+    for (int n : {1000, 10000, 100000})
+        inputs.push_back({"chain/" + std::to_string(n), n, genChain});
+    for (int n : {100, 1000, 10000})
+        inputs.push_back({"functions/" + std::to_string(n), n, genFunctions});
+
+    printf("%-36s %15s %10s %16s\n", "Benchmark", "Time", "Iterations", "Throughput");
+    printf("%s\n", std::string(80, '-').c_str());
+
+    for (auto &input : inputs) {
+        if (input.size > maxSize)
+            continue;
+
+        std::string src = input.gen(input.size);
+
+        auto lex = [](const std::string &s, Result &r) { lexOnly(s, r); return -1.0; };
+        auto parse = [&](const std::string &s, Result &r) { parseOnly(*S, s, r); return -1.0; };
+        auto codegen = [&](const std::string &s, Result &r) { return codegenOnly(*S, s, r); };
+
+        std::vector<std::pair<std::string, std::function<double(const std::string &, Result &)>>> stages = {
+            {"lex/", lex}, {"parse/", parse}, {"codegen/", codegen}
+        };
+
+        for (auto &stage : stages) {
+            std::string name = stage.first + input.name;
+            if (!filter.empty() && name.find(filter) == std::string::npos)
+                continue;
+            runBenchmark(name, src, stage.second);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,158 @@
+// ============================================================================
+// lemon-bench: runs every bench/*.lem program several times through
+// `lemon --time` and reports per-phase median and variance as JSON.
+// ============================================================================
+//
+// Usage: lemon-bench [--runs=N] [--lemon=<path>] [--flags="<lemon flags>"] [file.lem ...]
+// With no files, runs every .lem file in LEMON_BENCH_DIR.
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <map>
+#include <string>
+#include <vector>
+
+#ifndef LEMON_BENCH_DIR
+#define LEMON_BENCH_DIR "."
+#endif
+
+#ifndef LEMON_EXECUTABLE
+#define LEMON_EXECUTABLE "lemon"
+#endif
+
+struct PhaseTimes {
+    double parseMs, codegenMs, jitMs, execMs;
+};
+
+struct Stats {
+    double median, mean, variance, min, max;
+};
+
+Stats computeStats(std::vector<double> samples) {
+    Stats s = {0, 0, 0, 0, 0};
+    if (samples.empty())
+        return s;
+
+    std::sort(samples.begin(), samples.end());
+    size_t n = samples.size();
+
+    s.median = (n % 2) ? samples[n/2] : (samples[n/2 - 1] + samples[n/2]) / 2;
+    s.min = samples.front();
+    s.max = samples.back();
+
+    for (double x : samples) 
+        s.mean += x;
+    s.mean /= n;
+
+    // Sample variance
+    for (double x : samples) 
+        s.variance += (x - s.mean) * (x - s.mean);
+    s.variance = (n > 1) ? s.variance / (n - 1) : 0;
+
+    return s;
+}
+
+// Runs lemon once, program output (stderr) is thrown away. Always through
+// the JIT, so the numbers compare across commits (--flags=--interp overrides).
+bool runOnce(const std::string &lemon, const std::string &flags, 
+             const std::string &file, PhaseTimes &times) {
+    std::string cmd = "\"" + lemon + "\" --time --no-interp " + flags + " < \"" + file + "\" 2>/dev/null";
+    FILE *pipe = popen(cmd.c_str(), "r");
+    if (!pipe)
+        return false;
+
+    char line[512];
+    bool found = false;
+    while (fgets(line, sizeof(line), pipe)) {
+        if (sscanf(line, "{\"parse_ms\": %lf, \"codegen_ms\": %lf, \"jit_ms\": %lf, \"exec_ms\": %lf}",
+                   &times.parseMs, &times.codegenMs, &times.jitMs, &times.execMs) == 4)
+            found = true;
+    }
+
+    return pclose(pipe) == 0 && found;
+}
+
+std::vector<std::string> findBenchmarks(const std::string &dir) {
+    std::vector<std::string> files;
+    DIR *d = opendir(dir.c_str());
+    if (!d)
+        return files;
+
+    while (dirent *entry = readdir(d)) {
+        std::string name = entry->d_name;
+        if (name.size() > 4 && name.compare(name.size() - 4, 4, ".lem") == 0)
+            files.push_back(dir + "/" + name);
+    }
+    closedir(d);
+
+    std::sort(files.begin(), files.end());
+    return files;
+}
+
+std::string benchName(const std::string &file) {
+    std::string name = file.substr(file.find_last_of('/') + 1);
+    return name.substr(0, name.size() - 4);
+}
+
+void printStats(const char *key, const Stats &s, bool last = false) {
+    printf("      \"%s\": {\"median\": %.4f, \"mean\": %.4f, \"variance\": %.6f, \"min\": %.4f, \"max\": %.4f}%s\n",
+           key, s.median, s.mean, s.variance, s.min, s.max, last ? "" : ",");
+}
+
+int main(int argc, char **argv) {
+    int runs = 10;
+    std::string lemon = LEMON_EXECUTABLE;
+    std::string flags;
+    std::vector<std::string> files;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+
+        if (arg.rfind("--runs=", 0) == 0)
+            runs = std::max(1, atoi(arg.c_str() + strlen("--runs=")));
+        else if (arg.rfind("--lemon=", 0) == 0)
+            lemon = arg.substr(strlen("--lemon="));
+        else if (arg.rfind("--flags=", 0) == 0)
+            flags = arg.substr(strlen("--flags="));
+        else
+            files.push_back(arg);
+    }
+
+    if (files.empty())
+        files = findBenchmarks(LEMON_BENCH_DIR);
+
+    printf("{\n  \"runs\": %d,\n  \"flags\": \"%s\",\n  \"benchmarks\": [\n", runs, flags.c_str());
+
+    for (size_t f = 0; f < files.size(); ++f) {
+        std::vector<double> compile, jit, exec, total;
+        int failures = 0;
+
+        for (int r = 0; r < runs; ++r) {
+            PhaseTimes t;
+            if (!runOnce(lemon, flags, files[f], t)) {
+                failures++;
+                continue;
+            }
+            compile.push_back(t.parseMs + t.codegenMs);
+            jit.push_back(t.jitMs);
+            exec.push_back(t.execMs);
+            total.push_back(t.parseMs + t.codegenMs + t.jitMs + t.execMs);
+        }
+
+        fprintf(stderr, "🍋 %s: %d/%d runs ok\n", benchName(files[f]).c_str(), runs - failures, runs);
+
+        printf("    {\n      \"name\": \"%s\",\n      \"failures\": %d,\n", 
+               benchName(files[f]).c_str(), failures);
+        printStats("compile_ms", computeStats(compile));
+        printStats("jit_ms", computeStats(jit));
+        printStats("exec_ms", computeStats(exec));
+        printStats("total_ms", computeStats(total), true);
+        printf("    }%s\n", (f + 1 < files.size()) ? "," : "");
+    }
+
+    printf("  ]\n}\n");
+
+    return 0;
+}
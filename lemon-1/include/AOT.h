@@ -0,0 +1,20 @@
+// ============================================================================
+// AOT compilation (--emit-obj)
+// ============================================================================
+#include "llvm/IR/Module.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <string>
+
+using namespace llvm;
+
+#pragma once
+
+// Adds a C `int main()` that runs lemon_main, so the object can be linked 
+// into an executable against liblemonrt.
+void addMainWrapper(Module &M);
+
+// Writes M as a native object file. Returns false on error.
+bool emitObject(Module &M, TargetMachine &TM, raw_pwrite_stream &out);
+bool emitObjectFile(Module &M, TargetMachine &TM, const std::string &path);
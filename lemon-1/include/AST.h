@@ -6,6 +6,7 @@
 #include "llvm/IR/Module.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Verifier.h"
+#include "llvm/IR/DIBuilder.h"
 #include "llvm/Passes/StandardInstrumentations.h"
 #include "llvm/Passes/PassBuilder.h"
 #include "llvm/ADT/StringRef.h"
@@ -14,20 +15,31 @@
 #include <llvm/Transforms/Scalar/Reassociate.h>
 #include <llvm/Transforms/Scalar/GVN.h>
 #include <llvm/Transforms/Scalar/SimplifyCFG.h>
-#include "llvm/Transforms/Utils/Mem2Reg.h"
 #include "llvm/Transforms/Scalar/ADCE.h"
 #include "llvm/Transforms/Scalar/DeadStoreElimination.h"
 #include "llvm/Transforms/Scalar/DCE.h"
+#include "llvm/Transforms/IPO/Internalize.h"
+#include "llvm/Transforms/IPO/GlobalOpt.h"
+#include "llvm/Transforms/IPO/GlobalDCE.h"
+#include "llvm/Transforms/IPO/SCCP.h"
+#include "llvm/Transforms/Vectorize/LoopVectorize.h"
+#include "llvm/Transforms/Vectorize/SLPVectorizer.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/Support/DynamicLibrary.h"
 #include <llvm/Support/TargetSelect.h>
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/MD5.h"
 
 #include "./LemonJIT.h"
+#include "./Lexer.h"
 
 #include <string>
 #include <vector>
 #include <memory>
 #include <map>
+#include <set>
 #include <stack>
 
 using namespace llvm;
@@ -35,20 +47,74 @@ using namespace llvm::orc;
 
 #pragma once
 
+class CompilerSession;
+class ASTBinWriter;      // ASTBinary.h
+class BytecodeCompiler;  // Interp.h
+
+// Number of expression/statement nodes created so far on this thread (front end benchmarks).
+extern thread_local uint64_t NumASTNodes;
+
+// Tensors are passed by pointer to a descriptor, never copied:
+//   { double *data; int64 rank; int64 shape[4]; int64 strides[4] }
+// Strides are in elements. Same layout as lemon::TensorRef (Lemon.h).
+#define TENSOR_MAX_RANK 4
+
+// Structural hash of an AST (see ASTHash.cc): node kinds, names, operators
+// and constants, not source positions. Reformatting or moving a function 
+// around doesn't change its hash, editing it does. Stable across runs.
+class ASTHasher {
+    MD5 Hash;
+public:
+    // Names the tree refers to, for keys that also depend on what those
+    // resolve to (see FunctionCache.cc).
+    std::set<std::string> Callees;
+    std::set<std::string> Variables;
+
+    void addKind(char kind) { Hash.update(ArrayRef<uint8_t>((const uint8_t *)&kind, 1)); }
+    void addInt(uint64_t v) { Hash.update(ArrayRef<uint8_t>((const uint8_t *)&v, sizeof(v))); }
+    void addNumber(double v) { Hash.update(ArrayRef<uint8_t>((const uint8_t *)&v, sizeof(v))); }
+    void addString(StringRef str) { addInt(str.size()); Hash.update(str); }
+
+    uint64_t finish() {
+        MD5::MD5Result Result;
+        Hash.final(Result);
+        return Result.low();
+    }
+};
+
+enum ArgType {
+    type_double = 'd',
+    type_tensor = 't'
+};
+
 // EXPRESSION
 class ExprAST {
+    SourceRange Range;
 public:
+    ExprAST(SourceRange Range) : Range(Range) { NumASTNodes++; }
     virtual ~ExprAST() = default;
-    virtual Value *codegen(const std::string scope) = 0;
+    virtual Value *codegen(CompilerSession &S, const std::string scope) = 0;
     virtual void showAST() = 0;
+    virtual void hash(ASTHasher &H) = 0;
+    virtual uint32_t writeBinary(ASTBinWriter &W) = 0;
+    virtual int emitBytecode(BytecodeCompiler &C) = 0;     // Register with the value, -1 on failure
+
+    SourceRange getRange() const { return Range; }
 };
 
 // STATEMENT
 class StmtAST {
+    SourceRange Range;
 public:
+    StmtAST(SourceRange Range) : Range(Range) { NumASTNodes++; }
     virtual ~StmtAST() = default;
-    virtual Value *codegen(const std::string scope) = 0;
+    virtual Value *codegen(CompilerSession &S, const std::string scope) = 0;
     virtual void showAST() = 0;
+    virtual void hash(ASTHasher &H) = 0;
+    virtual uint32_t writeBinary(ASTBinWriter &W) = 0;
+    virtual bool emitBytecode(BytecodeCompiler &C) = 0;
+
+    SourceRange getRange() const { return Range; }
 };
 
 // MAIN LEMON
@@ -60,8 +126,14 @@ public:
              uint64_t optimizations)
         : statements(std::move(statements)), optimizations(optimizations) {}
 
-    Value *codegen(const std::string scope = "_global");
+    Value *codegen(CompilerSession &S, const std::string scope = "_global");
     void showAST();
+    void hash(ASTHasher &H);
+    uint32_t writeBinary(ASTBinWriter &W);
+    bool emitBytecode(BytecodeCompiler &C);
+
+    const std::vector<std::unique_ptr<StmtAST>> &getStatements() const { return statements; }
+    std::vector<std::unique_ptr<StmtAST>> takeStatements() { return std::move(statements); }
 };
 
 // Sub Trees
@@ -69,26 +141,46 @@ class BinaryExprAST : public ExprAST {
     int op;
     std::unique_ptr<ExprAST> LHS, RHS;
 public:
-    BinaryExprAST(int op, 
+    BinaryExprAST(SourceRange Range, int op, 
                   std::unique_ptr<ExprAST> LHS, 
                   std::unique_ptr<ExprAST> RHS)
-        : op(op), LHS(std::move(LHS)), RHS(std::move(RHS)) {}
+        : ExprAST(Range), op(op), LHS(std::move(LHS)), RHS(std::move(RHS)) {}
     
-    Value *codegen(const std::string scope) override;
+    Value *codegen(CompilerSession &S, const std::string scope) override;
     void showAST() override;
+    void hash(ASTHasher &H) override;
+    uint32_t writeBinary(ASTBinWriter &W) override;
+    int emitBytecode(BytecodeCompiler &C) override;
 
     // Helpers
     const char getOp() const { return op; }
 };
 
+class UnaryExprAST : public ExprAST {
+    int op;
+    std::unique_ptr<ExprAST> operand;
+public:
+    UnaryExprAST(SourceRange Range, int op, std::unique_ptr<ExprAST> operand)
+        : ExprAST(Range), op(op), operand(std::move(operand)) {}
+    
+    Value *codegen(CompilerSession &S, const std::string scope) override;
+    void showAST() override;
+    void hash(ASTHasher &H) override;
+    uint32_t writeBinary(ASTBinWriter &W) override;
+    int emitBytecode(BytecodeCompiler &C) override;
+};
+
 class NumberExprAST : public ExprAST {
     double val;
 public:
-    NumberExprAST(double val)
-        : val(val) {}
+    NumberExprAST(SourceRange Range, double val)
+        : ExprAST(Range), val(val) {}
     
-    Value *codegen(const std::string scope) override;
+    Value *codegen(CompilerSession &S, const std::string scope) override;
     void showAST() override;
+    void hash(ASTHasher &H) override;
+    uint32_t writeBinary(ASTBinWriter &W) override;
+    int emitBytecode(BytecodeCompiler &C) override;
 
     // Helpers
     const double getVal() const { return val; }
@@ -97,25 +189,47 @@ public:
 class VariableExprAST : public ExprAST {
     std::string varName;
 public:
-    VariableExprAST(const std::string &varName) 
-        : varName(varName) {}
+    VariableExprAST(SourceRange Range, const std::string &varName) 
+        : ExprAST(Range), varName(varName) {}
 
-    Value *codegen(const std::string scope) override;
+    Value *codegen(CompilerSession &S, const std::string scope) override;
     void showAST() override;
+    void hash(ASTHasher &H) override;
+    uint32_t writeBinary(ASTBinWriter &W) override;
+    int emitBytecode(BytecodeCompiler &C) override;
 
     // Helpers
     const std::string getVarName() const { return varName; }
 };
 
+// t[i, j], loads one element.
+class IndexExprAST : public ExprAST {
+    std::string tensorName;
+    std::vector<std::unique_ptr<ExprAST>> indices;
+public:
+    IndexExprAST(SourceRange Range, const std::string &tensorName, 
+                 std::vector<std::unique_ptr<ExprAST>> indices)
+        : ExprAST(Range), tensorName(tensorName), indices(std::move(indices)) {}
+    
+    Value *codegen(CompilerSession &S, const std::string scope) override;
+    void showAST() override;
+    void hash(ASTHasher &H) override;
+    uint32_t writeBinary(ASTBinWriter &W) override;
+    int emitBytecode(BytecodeCompiler &C) override;
+};
+
 class CallExprAST : public ExprAST {
     std::string callee; 
     std::vector<std::unique_ptr<ExprAST>> args;
 public:
-    CallExprAST(std::string callee, std::vector<std::unique_ptr<ExprAST>> args)
-        : callee(callee), args(std::move(args)) {}
+    CallExprAST(SourceRange Range, std::string callee, std::vector<std::unique_ptr<ExprAST>> args)
+        : ExprAST(Range), callee(callee), args(std::move(args)) {}
     
-    Value *codegen(const std::string scope) override;
+    Value *codegen(CompilerSession &S, const std::string scope) override;
     void showAST() override;
+    void hash(ASTHasher &H) override;
+    uint32_t writeBinary(ASTBinWriter &W) override;
+    int emitBytecode(BytecodeCompiler &C) override;
 };
 
 // STATEMENT
@@ -125,27 +239,38 @@ public:
 class PrototypeAST {
     std::string name;
     std::vector<std::string> args;
+    std::string argTypes;   // One ArgType per arg, e.g. "td" for f(t: tensor, x)
+    SourceRange Range;
 
 public:
-    PrototypeAST(const std::string name, std::vector<std::string> args)
-        : name(name), args(std::move(args)) {}
+    PrototypeAST(SourceRange Range, const std::string name, std::vector<std::string> args,
+                 std::string argTypes)
+        : name(name), args(std::move(args)), argTypes(std::move(argTypes)), Range(Range) {}
 
-    Function *codegen(const std::string scope = "_global");
+    Function *codegen(CompilerSession &S, const std::string scope = "_global");
     void showAST();
+    void hash(ASTHasher &H);
+    uint32_t writeBinary(ASTBinWriter &W);
 
     const std::string getName() const { return name; }
+    const std::vector<std::string> &getArgs() const { return args; }
+    const std::string &getArgTypes() const { return argTypes; }
+    SourceRange getRange() const { return Range; }
 };
 
 class VariableDeclStmt : public StmtAST {
     std::string varName;
     std::unique_ptr<ExprAST> defBody;
 public:
-    VariableDeclStmt(std::string varName, std::unique_ptr<ExprAST> defBody) 
-        : varName(varName), defBody(std::move(defBody)) {}
+    VariableDeclStmt(SourceRange Range, std::string varName, std::unique_ptr<ExprAST> defBody) 
+        : StmtAST(Range), varName(varName), defBody(std::move(defBody)) {}
 
-    Value *codegen(const std::string scope) override;
-    Value *codegen_global();
+    Value *codegen(CompilerSession &S, const std::string scope) override;
+    Value *codegen_global(CompilerSession &S);
     void showAST() override;
+    void hash(ASTHasher &H) override;
+    uint32_t writeBinary(ASTBinWriter &W) override;
+    bool emitBytecode(BytecodeCompiler &C) override;
 };
 
 // Same as var decl, can just replace?
@@ -153,53 +278,107 @@ class AssignmentStmt : public StmtAST {
     std::string varName;
     std::unique_ptr<ExprAST> defBody;
 public:
-    AssignmentStmt(std::string varName, std::unique_ptr<ExprAST> defBody) 
-        : varName(varName), defBody(std::move(defBody)) {}
+    AssignmentStmt(SourceRange Range, std::string varName, std::unique_ptr<ExprAST> defBody) 
+        : StmtAST(Range), varName(varName), defBody(std::move(defBody)) {}
+
+    Value *codegen(CompilerSession &S, const std::string scope) override;
+    void showAST() override;
+    void hash(ASTHasher &H) override;
+    uint32_t writeBinary(ASTBinWriter &W) override;
+    bool emitBytecode(BytecodeCompiler &C) override;
+};
+
+// t[i, j] = EXPR; writes straight into the caller's buffer.
+class IndexAssignStmt : public StmtAST {
+    std::string tensorName;
+    std::vector<std::unique_ptr<ExprAST>> indices;
+    std::unique_ptr<ExprAST> defBody;
+public:
+    IndexAssignStmt(SourceRange Range, const std::string &tensorName, 
+                    std::vector<std::unique_ptr<ExprAST>> indices,
+                    std::unique_ptr<ExprAST> defBody)
+        : StmtAST(Range), tensorName(tensorName), indices(std::move(indices)), 
+          defBody(std::move(defBody)) {}
 
-    Value *codegen(const std::string scope) override;
+    Value *codegen(CompilerSession &S, const std::string scope) override;
     void showAST() override;
+    void hash(ASTHasher &H) override;
+    uint32_t writeBinary(ASTBinWriter &W) override;
+    bool emitBytecode(BytecodeCompiler &C) override;
 };
 
 class ReturnStmtAST : public StmtAST {
     std::unique_ptr<ExprAST> retBody;
 public:
-    ReturnStmtAST(std::unique_ptr<ExprAST> retBody)
-        : retBody(std::move(retBody)) {}
+    ReturnStmtAST(SourceRange Range, std::unique_ptr<ExprAST> retBody)
+        : StmtAST(Range), retBody(std::move(retBody)) {}
 
-    Value *codegen(const std::string scope) override;
+    Value *codegen(CompilerSession &S, const std::string scope) override;
     void showAST() override;
+    void hash(ASTHasher &H) override;
+    uint32_t writeBinary(ASTBinWriter &W) override;
+    bool emitBytecode(BytecodeCompiler &C) override;
 };
 
 class FunctionAST : public StmtAST {
     std::unique_ptr<PrototypeAST> proto;
     std::vector<std::unique_ptr<StmtAST>> functionBody;
 public:
-    FunctionAST(std::unique_ptr<PrototypeAST> proto, 
+    FunctionAST(SourceRange Range, std::unique_ptr<PrototypeAST> proto, 
                 std::vector<std::unique_ptr<StmtAST>> functionBody)
-        : proto(std::move(proto)), functionBody(std::move(functionBody)) {}
+        : StmtAST(Range), proto(std::move(proto)), functionBody(std::move(functionBody)) {}
     
-    Value *codegen(const std::string scope = "_global") override; // Returns Function *
+    Value *codegen(CompilerSession &S, const std::string scope = "_global") override; // Returns Function *
     void showAST() override;
+    void hash(ASTHasher &H) override;
+    uint32_t writeBinary(ASTBinWriter &W) override;
+    bool emitBytecode(BytecodeCompiler &C) override;
+
+    const PrototypeAST &getProto() const { return *proto; }
 };
 
 class ExternAST : public StmtAST {
     std::unique_ptr<PrototypeAST> proto;
 public:
-    ExternAST(std::unique_ptr<PrototypeAST> proto)
-        : proto(std::move(proto)) {}
+    ExternAST(SourceRange Range, std::unique_ptr<PrototypeAST> proto)
+        : StmtAST(Range), proto(std::move(proto)) {}
+    
+    Value *codegen(CompilerSession &S, const std::string scope) override;
+    void showAST() override;
+    void hash(ASTHasher &H) override;
+    uint32_t writeBinary(ASTBinWriter &W) override;
+    bool emitBytecode(BytecodeCompiler &C) override;
+
+    const PrototypeAST &getProto() const { return *proto; }
+};
+
+// Compiled separately before the importing file, see Import.h.
+class ImportStmtAST : public StmtAST {
+    std::string path;
+public:
+    ImportStmtAST(SourceRange Range, const std::string &path)
+        : StmtAST(Range), path(path) {}
     
-    Value *codegen(const std::string scope) override;
+    Value *codegen(CompilerSession &S, const std::string scope) override;
     void showAST() override;
+    void hash(ASTHasher &H) override;
+    uint32_t writeBinary(ASTBinWriter &W) override;
+    bool emitBytecode(BytecodeCompiler &C) override;
+
+    const std::string &getPath() const { return path; }
 };
 
 class ExpressionStmtAST : public StmtAST {
     std::unique_ptr<ExprAST> expr;
 public:
-    ExpressionStmtAST(std::unique_ptr<ExprAST> expr)
-        : expr(std::move(expr)) {}
+    ExpressionStmtAST(SourceRange Range, std::unique_ptr<ExprAST> expr)
+        : StmtAST(Range), expr(std::move(expr)) {}
 
-    Value *codegen(const std::string scope) override;
+    Value *codegen(CompilerSession &S, const std::string scope) override;
     void showAST() override;
+    void hash(ASTHasher &H) override;
+    uint32_t writeBinary(ASTBinWriter &W) override;
+    bool emitBytecode(BytecodeCompiler &C) override;
 };
 
 class IfStmtAST : public StmtAST {
@@ -208,14 +387,17 @@ class IfStmtAST : public StmtAST {
     std::vector<std::unique_ptr<StmtAST>> elseBody;
 
 public:
-    IfStmtAST(std::unique_ptr<ExprAST> cond,
+    IfStmtAST(SourceRange Range, std::unique_ptr<ExprAST> cond,
               std::vector<std::unique_ptr<StmtAST>> thenBody,
               std::vector<std::unique_ptr<StmtAST>> elseBody)
-        : cond(std::move(cond)), thenBody(std::move(thenBody)), 
+        : StmtAST(Range), cond(std::move(cond)), thenBody(std::move(thenBody)), 
           elseBody(std::move(elseBody)) {}
     
-    Value *codegen(const std::string scope) override;
+    Value *codegen(CompilerSession &S, const std::string scope) override;
     void showAST() override;
+    void hash(ASTHasher &H) override;
+    uint32_t writeBinary(ASTBinWriter &W) override;
+    bool emitBytecode(BytecodeCompiler &C) override;
 };
 
 class ForStmtAST : public StmtAST {
@@ -223,44 +405,26 @@ class ForStmtAST : public StmtAST {
     std::unique_ptr<ExprAST> start, end, step;
     std::vector<std::unique_ptr<StmtAST>> forBody;
 public:
-    ForStmtAST(const std::string &iterator, 
+    ForStmtAST(SourceRange Range, const std::string &iterator, 
                std::unique_ptr<ExprAST> start,
                std::unique_ptr<ExprAST> end,
                std::unique_ptr<ExprAST> step,
                std::vector<std::unique_ptr<StmtAST>> forBody)
-        : iterator(iterator), start(std::move(start)), end(std::move(end)),
+        : StmtAST(Range), iterator(iterator), start(std::move(start)), end(std::move(end)),
           step(std::move(step)), forBody(std::move(forBody)) {}
     
-    Value *codegen(const std::string scope) override;
+    Value *codegen(CompilerSession &S, const std::string scope) override;
     void showAST() override;
+    void hash(ASTHasher &H) override;
+    uint32_t writeBinary(ASTBinWriter &W) override;
+    bool emitBytecode(BytecodeCompiler &C) override;
 };
 
-// Core Variables and Helper functions
-
-extern std::unique_ptr<LLVMContext> TheContext;
-extern std::unique_ptr<IRBuilder<>> Builder;
-extern std::unique_ptr<IRBuilder<>> GlobalVariableBuilder;
-extern std::unique_ptr<IRBuilder<>> MainBuilder;
-extern std::unique_ptr<IRBuilder<>> FunctionBuilder;
-
-extern std::unique_ptr<Module> TheModule;
-extern std::map<std::string, std::map<std::string, AllocaInst*>> SymbolTable; // Stores all variables
-extern std::stack<std::string> ScopeStack;
-extern std::map<std::string, std::unique_ptr<PrototypeAST>> FunctionProtos;
-
-extern int LoopScopeCounter;
-extern std::string generateLoopScope();
-
-extern AllocaInst *CreateEntryBlockAlloca(Function *TheFunction, StringRef varName);
-extern Function *getFunction(std::string name, std::string scope = "_global");
-
-extern std::unique_ptr<FunctionPassManager> TheFPM;
-extern std::unique_ptr<LoopAnalysisManager> TheLAM;
-extern std::unique_ptr<FunctionAnalysisManager> TheFAM;
-extern std::unique_ptr<CGSCCAnalysisManager> TheCGAM;
-extern std::unique_ptr<ModuleAnalysisManager> TheMAM;
-extern std::unique_ptr<PassInstrumentationCallbacks> ThePIC;
-extern std::unique_ptr<StandardInstrumentations> TheSI;
+// Options shared by every CompilerSession, set once from the command line.
+extern std::string VECTOR_LIB;      // --vector-lib=<none|libmvec|sleef|accelerate>
 
-// JIT
-extern std::unique_ptr<LemonJIT> TheJIT;
+// Debug info
+#define DEBUG_INFO_NONE 0
+#define DEBUG_INFO_LINES 1      // -gline-tables-only
+#define DEBUG_INFO_FULL 2       // -g
+extern int DEBUG_INFO;
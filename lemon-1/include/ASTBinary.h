@@ -0,0 +1,122 @@
+// ============================================================================
+// Binary AST (--emit-ast-bin): parse once, load without lexing or parsing
+// ============================================================================
+#include "./AST.h"
+#include "./CompilerSession.h"
+
+#include "llvm/ADT/StringMap.h"
+
+#include <string>
+#include <vector>
+
+using namespace llvm;
+
+#pragma once
+
+// A .astb file, sections 8 byte aligned, in the byte order of the machine
+// that wrote it:
+//
+//     header | nodes | children | strings | string data | source
+//
+// - nodes: one fixed size ASTBinNode per AST node, in post order (children
+//   before their parent). The last one is the program. The loader builds
+//   the tree in one pass over the array, a node's children are always built
+//   by the time it comes up.
+// - children: the child lists of the nodes, as node indices.
+// - strings: interned, every name/path is stored once, nodes refer to them
+//   by index.
+// - source: the original source text. Ranges point into it, so diagnostics
+//   and debug info are the same as when parsing it.
+//
+// The loader reads the mapped file in place. Anything that doesn't check out
+// (version, byte order, indices, ranges) is rejected, not trusted.
+#define AST_BIN_MAGIC "LEMONAST"
+#define AST_BIN_VERSION 1
+#define AST_BIN_BYTE_ORDER 0x01020304
+
+struct ASTBinHeader {
+    char magic[8];              // AST_BIN_MAGIC, no terminator
+    uint32_t version;           // AST_BIN_VERSION
+    uint32_t byteOrder;         // AST_BIN_BYTE_ORDER as the writer saw it
+    uint32_t numNodes;
+    uint32_t numChildren;
+    uint32_t numStrings;
+    uint32_t sourceName;        // String: the file it was parsed from
+    uint64_t nodesOffset;
+    uint64_t childrenOffset;
+    uint64_t stringsOffset;
+    uint64_t stringDataOffset;
+    uint64_t stringDataSize;
+    uint64_t sourceOffset;
+    uint64_t sourceSize;
+};
+
+enum ASTBinKind : uint32_t {
+    bin_program,        // children: statements, value: optimizations
+    bin_binary,         // op, children: LHS, RHS
+    bin_unary,          // op, children: operand
+    bin_number,         // value: the double's bits
+    bin_variable,       // name
+    bin_index,          // name (tensor), children: indices
+    bin_call,           // name (callee), children: args
+    bin_prototype,      // name, children: arg names (strings!), split: argTypes (string)
+    bin_var_decl,       // name, children: initializer, if any
+    bin_assign,         // name, children: value
+    bin_index_assign,   // name (tensor), children: indices..., value
+    bin_return,         // children: value
+    bin_function,       // children: prototype, body...
+    bin_extern,         // children: prototype
+    bin_import,         // name (path)
+    bin_expr_stmt,      // children: expression
+    bin_if,             // children: cond, then..., else... (from child `split` on)
+    bin_for,            // name (iterator), children: start, end, step, body...
+};
+
+struct ASTBinNode {
+    uint32_t kind;          // ASTBinKind
+    int32_t op;
+    uint32_t name;          // String index
+    uint32_t first;         // Children are [first, first + count) in the children section
+    uint32_t count;
+    uint32_t split;         // Kind specific, see ASTBinKind
+    SourceRange range;
+    uint64_t value;         // Kind specific, see ASTBinKind
+};
+
+struct ASTBinString {
+    uint32_t offset;        // Into the string data
+    uint32_t size;
+};
+
+static_assert(sizeof(ASTBinHeader) == 88, "ASTBinHeader layout is part of the file format");
+static_assert(sizeof(ASTBinNode) == 40, "ASTBinNode layout is part of the file format");
+
+// Collects the sections while the AST writes itself out (writeBinary() in
+// every node, see ASTBinary.cc).
+class ASTBinWriter {
+public:
+    std::vector<ASTBinNode> Nodes;
+    std::vector<uint32_t> Children;
+    std::vector<ASTBinString> Strings;
+    std::string StringData;
+    StringMap<uint32_t> StringIds;
+
+    // String 0 is "", nodes without a name point at it.
+    ASTBinWriter() { addString(""); }
+
+    uint32_t addString(StringRef str);
+
+    // Appends N with its children (already written), returns its index.
+    uint32_t addNode(ASTBinNode N, ArrayRef<uint32_t> children = {});
+};
+
+// Writes Program, parsed by `Lex` from its source, to `path`. False on I/O errors.
+bool writeASTBinary(LemonAST &Program, Lexer &Lex, const std::string &path);
+
+// Whether `buffer` is a .astb file (checks the magic only).
+bool isASTBinary(StringRef buffer);
+
+// Builds the AST in `buffer`, and points S.Lex at the source in it (the
+// buffer has to outlive the session). nullptr if the file is broken or
+// from another version, the error is printed.
+std::unique_ptr<LemonAST> loadASTBinary(FrontEnd &S, MemoryBuffer &buffer);
@@ -0,0 +1,26 @@
+// ============================================================================
+// Builtin math library
+// ============================================================================
+#include "llvm/IR/Value.h"
+#include "llvm/IR/IRBuilder.h"
+#include "./Lexer.h"
+#include "./CompilerSession.h"
+
+#include <string>
+#include <vector>
+
+using namespace llvm;
+
+#pragma once
+
+// Builtins are only used when no user function/extern has the same name,
+// so user code can still shadow them.
+bool isBuiltin(const std::string &name);
+
+// Lowers a call to a builtin (sqrt, exp, ...) into the matching llvm.*
+// intrinsic, so the optimizer can constant fold, hoist and vectorize it.
+Value *codegenBuiltin(CompilerSession &S,
+                      IRBuilder<> *TmpBuilder, 
+                      SourceRange range,
+                      const std::string &name, 
+                      std::vector<Value *> &args);
@@ -0,0 +1,185 @@
+// ============================================================================
+// Compiler session: everything one compilation touches
+// ============================================================================
+#include "./AST.h"
+#include "./Lexer.h"
+#include "./LemonJIT.h"
+
+#include "llvm/IR/ValueHandle.h"
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <map>
+#include <set>
+#include <stack>
+
+using namespace llvm;
+using namespace llvm::orc;
+
+#pragma once
+
+struct Diagnostic {
+    SourceRange Range;
+    std::string Message;
+};
+
+// Lexer and diagnostics, all that parsing needs. Nothing in here needs LLVM
+// started, so a script the interpreter runs (see Interp.h) never starts it.
+class FrontEnd {
+public:
+    Lexer Lex;
+    std::vector<Diagnostic> Diagnostics;    // Collected instead of printed, so one run reports all of them
+    std::string *DiagnosticLog = nullptr;   // If set, printDiagnostics() appends here instead of stderr
+
+    // Points the lexer at [begin, end), named `path` ("-": stdin) in
+    // messages. False if it's too big for the lexer, `error` says so.
+    bool setSource(const std::string &path, const char *begin, const char *end, std::string &error);
+
+    // Errors
+    void reportError(SourceRange range, const char *str);
+    bool printDiagnostics();    // Prints (and clears) Diagnostics, true if there were any
+};
+
+// The front end, plus LLVM context/module/builders, symbol tables and pass
+// managers for one program. Nothing in here is shared, so two sessions can
+// compile on two threads at the same time. What is shared:
+//  - the JIT (ORC is thread-safe), each session has its own TargetMachine.
+//  - command line options (VECTOR_LIB, DEBUG_INFO, ...), only written
+//    before any session exists.
+class CompilerSession : public FrontEnd {
+public:
+    LemonJIT &JIT;
+    std::unique_ptr<TargetMachine> TM;
+    ResourceTrackerSP RT;                   // Where JIT'd code goes, null: the main JITDylib
+    std::string EmitObjPath;                // AOT (--emit-obj) output, empty when running in the JIT
+
+    // Codegen
+    std::unique_ptr<LLVMContext> TheContext;
+    std::unique_ptr<IRBuilder<>> Builder;
+    std::unique_ptr<IRBuilder<>> GlobalVariableBuilder;
+    std::unique_ptr<IRBuilder<>> MainBuilder;
+    std::unique_ptr<IRBuilder<>> FunctionBuilder;
+
+    std::unique_ptr<Module> TheModule;
+    std::map<std::string, std::map<std::string, AllocaInst*>> SymbolTable;  // Locals for each scope: their alloca with -g, nullptr otherwise (SSA, see readLocal()).
+    std::stack<std::string> ScopeStack;
+    std::map<std::string, GlobalVariable*> GlobalVariables;                 // Global variables
+    std::map<std::string, std::unique_ptr<PrototypeAST>> FunctionProtos;    // Function signatures
+    std::map<std::string, std::map<std::string, Value*>> Tensors;           // Tensor args (descriptor pointers) for each scope.
+
+    int LoopScopeCounter = 0;
+
+    // SSA construction for locals: the value of each local at the end of
+    // every block generated so far, and the blocks that don't have all their
+    // predecessors yet (loop headers) with the phis waiting for them.
+    std::map<BasicBlock*, std::map<std::string, WeakTrackingVH>> CurrentDefs;
+    std::map<BasicBlock*, std::map<std::string, PHINode*>> IncompletePhis;
+    std::set<BasicBlock*> UnsealedBlocks;
+    std::map<BasicBlock*, std::map<std::string, PHINode*>> VisitingBlocks;     // Being read from their predecessors
+
+    // Optimization
+    std::unique_ptr<FunctionPassManager> TheFPM;
+    std::unique_ptr<LoopAnalysisManager> TheLAM;
+    std::unique_ptr<FunctionAnalysisManager> TheFAM;
+    std::unique_ptr<CGSCCAnalysisManager> TheCGAM;
+    std::unique_ptr<ModuleAnalysisManager> TheMAM;
+    std::unique_ptr<PassInstrumentationCallbacks> ThePIC;
+    std::unique_ptr<StandardInstrumentations> TheSI;
+
+    // Debug info (-g, -gline-tables-only)
+    std::unique_ptr<DIBuilder> DBuilder;
+    DICompileUnit *TheCU = nullptr;
+    DIType *DblDIType = nullptr;
+
+    // Imports compiled in this session -> their interface (see compileImports()).
+    std::map<std::string, std::string> CompiledImports;
+
+    // Per-function object cache (see FunctionCache.h), for the main file only.
+    bool FnCacheEnabled = false;
+    std::map<std::string, std::string> FnCacheMisses;           // Function compiled this time -> its key
+    std::vector<std::unique_ptr<MemoryBuffer>> FnCacheHits;     // Cached objects of the others
+
+    // `FE`: a program parsed before the session existed, its lexer and diagnostics.
+    CompilerSession(LemonJIT &JIT, std::unique_ptr<TargetMachine> TM, FrontEnd FE = FrontEnd())
+        : FrontEnd(std::move(FE)), JIT(JIT), TM(std::move(TM)) { InitializeModule(); }
+
+    // Session with a fresh module, targeting what the JIT targets.
+    static Expected<std::unique_ptr<CompilerSession>> Create(LemonJIT &JIT, FrontEnd FE = FrontEnd()) {
+        auto TM = JIT.createTargetMachine();
+        if (!TM)
+            return TM.takeError();
+        return std::make_unique<CompilerSession>(JIT, std::move(*TM), std::move(FE));
+    }
+
+    // Session for --emit-obj to `path`: PIC objects for the system linker, 
+    // see LemonJIT::createObjectTargetMachine(). Empty CPU: the JIT's.
+    static Expected<std::unique_ptr<CompilerSession>> CreateForObject(LemonJIT &JIT, const std::string &path,
+                                                                      const std::string &CPU = "",
+                                                                      FrontEnd FE = FrontEnd()) {
+        auto TM = JIT.createObjectTargetMachine(CPU);
+        if (!TM)
+            return TM.takeError();
+        auto S = std::make_unique<CompilerSession>(JIT, std::move(*TM), std::move(FE));
+        S->EmitObjPath = path;
+        return std::move(S);
+    }
+
+    // Another session for the same JIT, target, object path and RT, e.g. 
+    // for an imported file compiled on another thread.
+    Expected<std::unique_ptr<CompilerSession>> createSibling();
+
+    // Fresh context, module, builders and pass managers for the next module.
+    void InitializeModule();
+
+    // lemon_main, running the top level statements of Program. Everything
+    // else in Program is codegen'd along the way. nullptr on errors.
+    Function *codegenMain(LemonAST &Program);
+
+    // Running a program, the same for lemon, host mode, lemond and liblemon:
+    //   createProgramJITDylib()  its own JITDylib, RT points there (optional,
+    //                            the main JITDylib otherwise)
+    //   compileProgram()         imports, then lemon_main in TheModule
+    //   loadProgram()            cached functions and TheModule into the JIT
+    //   removeProgramJITDylib()  frees all of it again
+    JITDylib *ProgramJD = nullptr;
+    void createProgramJITDylib(const std::string &name);    // Names have to be unique
+    bool compileProgram(LemonAST &Program, const std::string &path, bool useFnCache = true);    // False on errors (printed)
+    Expected<double (*)()> loadProgram();                   // lemon_main, compiled
+    void removeProgramJITDylib();
+
+    // Errors
+    Value *LogErrorV(SourceRange range, const char *str);
+
+    // Helpers
+    Function *getFunction(std::string name, std::string scope = "_global");
+    AllocaInst *CreateEntryBlockAlloca(Function *TheFunction, StringRef varName);
+    std::string generateLoopScope();
+    StructType *getTensorType();    // The descriptor, see TENSOR_MAX_RANK
+
+    // Locals (args, `var`s in functions, for iterators). Without -g they're
+    // SSA values right away, no alloca/load/store for mem2reg to clean up.
+    // With -g each one lives in an alloca, so the debugger can see it.
+    void declareLocal(IRBuilder<> *TmpBuilder, const std::string &scope, const std::string &name,
+                      Value *val, SourceRange range, unsigned argNo = 0);
+    bool isLocal(const std::string &scope, const std::string &name);
+    Value *readLocal(IRBuilder<> *TmpBuilder, const std::string &scope, const std::string &name);   // nullptr: not a local
+    void writeLocal(IRBuilder<> *TmpBuilder, const std::string &scope, const std::string &name, Value *val);
+    void sealBlock(BasicBlock *BB);     // All of BB's predecessors are there now
+    void forgetLocals(Function *F);     // F is done, passes may delete its blocks
+
+    // Debug info, all no-ops without -g/-gline-tables-only.
+    DISubprogram *emitSubprogram(Function *F, SourceRange range, bool artificial = false);
+    void emitLocation(IRBuilder<> *TmpBuilder, SourceRange range);
+    void emitLocalVariable(IRBuilder<> *TmpBuilder, AllocaInst *Alloca, StringRef name,
+                           SourceRange range, unsigned argNo = 0);
+    void finalizeDebugInfo();
+
+private:
+    DISubroutineType *createFunctionDIType(Function *F);
+
+    Value *readLocalIn(BasicBlock *BB, const std::string &name);
+    Value *readFromPredecessors(BasicBlock *BB, const std::string &name);
+    Value *addPhiOperands(const std::string &name, PHINode *Phi);
+    Value *tryRemoveTrivialPhi(PHINode *Phi);
+};
@@ -0,0 +1,50 @@
+// ============================================================================
+// lemond <-> lemonc protocol (src/Daemon.cc)
+// ============================================================================
+// lemonc connects to lemond's Unix socket and sends one request: a header,
+// the source path, the object path (emit-obj only) and the source. Its
+// stdout and stderr go along as file descriptors (SCM_RIGHTS), so the
+// program's output and the diagnostics are written straight to the
+// client's terminal. lemond answers with the exit code (int32) and closes
+// the connection.
+//
+// POSIX only, no LLVM in here, lemonc doesn't link it.
+
+#include <cstdint>
+#include <string>
+
+#pragma once
+
+enum RequestKind : uint32_t {
+    request_run = 1,        // Compile and run in the daemon's JIT
+    request_emit_obj = 2    // Compile to an object file, like --emit-obj
+};
+
+struct Request {
+    RequestKind kind = request_run;
+    std::string path;       // Source path for diagnostics and imports, absolute or "-"
+    std::string objPath;    // request_emit_obj: absolute output path
+    std::string source;
+    int outFd = -1;         // Client's stdout and stderr, lemond closes them when it's done
+    int errFd = -1;
+};
+
+// $LEMOND_SOCKET, or lemond.sock in $XDG_RUNTIME_DIR, or in /tmp/lemond-<uid>/.
+std::string defaultSocketPath();
+
+// Both ends check who is on the other side: only the user who started
+// lemond may send it code, and lemonc only hands its source and terminal
+// to a lemond of its own user, not to whoever got to the socket path first.
+bool peerIsSameUser(int sock);
+
+// The socket's directory has to be ours and nobody else's to write to,
+// or another user could swap the socket. create: mkdir it (0700) first.
+// false with `error` set otherwise.
+bool checkSocketDir(const std::string &socketPath, bool create, std::string &error);
+
+// Both false on a short read/write or a broken request.
+bool sendRequest(int sock, const Request &R);
+bool recvRequest(int sock, Request &R);
+
+bool writeAll(int fd, const void *data, size_t size);
+bool readAll(int fd, void *data, size_t size);
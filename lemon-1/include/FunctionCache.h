@@ -0,0 +1,32 @@
+// ============================================================================
+// Per-function object cache (--cache-dir)
+// ============================================================================
+#include "./AST.h"
+#include "./CompilerSession.h"
+
+using namespace llvm;
+
+#pragma once
+
+// With --cache-dir, every function of the main file is also cached on its
+// own, as <key>.fn.o. The key is the function's AST hash (see ASTHash.cc)
+// plus what its body resolves against: the prototypes of the functions it
+// calls, which of its names are globals, and the compiler flags. So a file
+// that only changed in a few functions only compiles those, the others are
+// declared and their cached objects are linked in.
+//
+// JIT only, and only when every function is compiled on its own: not with
+// --emit-obj, --whole-program (internalizes across functions) or --profile.
+
+// Whether S (after its imports, which have their own cache) can use it.
+bool functionCacheUsable(CompilerSession &S);
+
+// Called by FunctionAST::codegen when S.FnCacheEnabled. True if F is cached,
+// then only its declaration is needed. Otherwise F gets compiled and its
+// key is remembered for addFunctionObjects().
+bool lookupCachedFunction(CompilerSession &S, FunctionAST &F);
+
+// After codegenMain(): moves every function compiled this time out of
+// S.TheModule into its own object, writes it to the cache and adds it to
+// S.RT, along with the cached objects. False on JIT errors (printed).
+bool addFunctionObjects(CompilerSession &S);
@@ -0,0 +1,31 @@
+// ============================================================================
+// Multi-file programs: import "file.lem";
+// ============================================================================
+#include "./AST.h"
+#include "./CompilerSession.h"
+
+#include <string>
+
+using namespace llvm;
+
+#pragma once
+
+extern std::string CACHE_DIR;   // --cache-dir=<dir>, object cache for imported files
+
+// Compiles every file `Program` imports (directly or not), each in its own
+// session, module and object. A file compiles once the files it imports 
+// are done, files that don't depend on each other compile in parallel:
+//  - JIT: the object is added to S.RT (the main JITDylib if null).
+//  - AOT: the object is written next to S.EmitObjPath as <name>.o.
+// Imported files may only define functions (func, extern, import). Their
+// prototypes stay in S.FunctionProtos so the importer can call them.
+//
+// `path` is the importing file, relative imports are resolved against its
+// directory. Errors are reported as diagnostics, returns false if there were any.
+bool compileImports(CompilerSession &S, LemonAST &Program, const std::string &path);
+
+// Everything that changes the generated code besides the source, for cache keys.
+std::string compilerOptions(TargetMachine &TM);
+
+// Writes an object to <CACHE_DIR>/..., atomically. Failures just mean no cache.
+void writeCacheFile(const std::string &cachePath, StringRef obj);
@@ -0,0 +1,14 @@
+// ============================================================================
+// Profiling instrumentation (--profile)
+// ============================================================================
+#include "llvm/IR/Function.h"
+
+using namespace llvm;
+
+#pragma once
+
+extern int PROFILE;
+
+// Calls lemon_prof_enter(name) on entry and lemon_prof_exit(name) before
+// every return of F. The runtime side lives in src/Profiler.cc.
+void instrumentFunction(Function *F);
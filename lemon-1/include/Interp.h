@@ -0,0 +1,124 @@
+// ============================================================================
+// Bytecode interpreter: fast start for tiny scripts
+// ============================================================================
+#include "./AST.h"
+#include "./LemonJIT.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+using namespace llvm;
+using namespace llvm::orc;
+
+#pragma once
+
+// For a script that runs for microseconds, LLVM (optimizing, then JIT
+// materialization) costs far more than running it. So small programs are
+// compiled to register bytecode instead, which takes microseconds, and
+// interpreted. Doubles, calls, externs, builtins, if and for. Tensors and
+// imports go to the JIT.
+//
+// Functions that get hot (INTERP_HOT_THRESHOLD calls + loop iterations) are
+// handed to the JIT: on the next call into one, every function is compiled,
+// with the globals pointing at the interpreter's. From then on calls go to
+// native code. Code at the top level (lemon_main) is never promoted, and a
+// loop running in a frame stays interpreted until it returns. So auto mode
+// leaves programs with loops to the JIT, a kernel called once would never
+// get out of the interpreter.
+#define INTERP_OFF 0
+#define INTERP_AUTO 1           // Default: when the bytecode is small and has no loops
+#define INTERP_ON 2             // --interp
+extern int INTERP;
+
+#define INTERP_MAX_INSTRS 4096          // Auto: bigger programs go straight to the JIT
+#define INTERP_HOT_THRESHOLD 50000      // Calls + loop iterations before promoting
+#define INTERP_MAX_NATIVE_ARGS 6        // Externs/promoted functions with more args: not handled
+
+enum BytecodeOp : uint32_t {
+    op_loadk,       // R[a] = K[b]
+    op_move,        // R[a] = R[b]
+    op_getg,        // R[a] = G[b]
+    op_setg,        // G[a] = R[b]
+    op_add, op_sub, op_mul, op_div,             // R[a] = R[b] op R[c]
+    op_lt, op_gt, op_le, op_ge, op_eq, op_neq,  // Same, 1.0 or 0.0. Unordered (NaN) compares true, like codegen.
+    op_neg,         // R[a] = -R[b]
+    op_not,         // R[a] = !R[b]
+    op_jmp,         // goto b
+    op_jz,          // if !(R[a] is ordered and != 0) goto b, the test if uses
+    op_forprep,     // if R[a] >= R[c + 1] goto b. R[c]: step, R[c + 1]: end
+    op_forloop,     // R[a] += R[c], if !(R[a] >= R[c + 1]) goto b
+    op_call,        // R[a] = Functions[b](R[c], R[c + 1], ...)
+    op_builtin,     // R[a] = builtin b (R[c], ...), see Interp.cc
+    op_ret          // return R[a]
+};
+
+struct Instr {
+    BytecodeOp op;
+    uint32_t a, b, c;
+};
+
+struct BytecodeFunction {
+    std::string name;
+    unsigned numArgs = 0;
+    unsigned numRegs = 0;           // Args first, then locals and temporaries
+    bool defined = false;           // false: extern, `native` is found when linking
+    std::vector<Instr> code;
+    void *native = nullptr;         // Extern, or promoted to the JIT
+    uint64_t hotness = 0;           // Calls + loop iterations
+};
+
+struct BytecodeProgram {
+    LemonAST &Program;              // For promoting, codegen'd from the AST
+    LemonJIT &(*StartJIT)();        // For promoting, the JIT is only started then
+
+    std::vector<BytecodeFunction> Functions;    // [0] is lemon_main
+    std::vector<double> Constants;
+    std::vector<double> Globals;                // Fixed size once compiled, the JIT gets pointers into it
+    std::map<std::string, unsigned> GlobalSlots;
+    bool redeclaredGlobals = false; // Then functions don't all see the same slot, don't promote
+    bool promoted = false;
+
+    BytecodeProgram(LemonAST &Program, LemonJIT &(*StartJIT)()) : Program(Program), StartJIT(StartJIT) {}
+
+    size_t size() const;            // Instructions, all functions
+    bool loops() const;             // A for loop in lemon_main or anything it calls
+};
+
+// Per function state while compiling, nodes emit into it (emitBytecode()).
+class BytecodeCompiler {
+public:
+    BytecodeProgram &P;
+    std::map<std::string, unsigned> FunctionIds;
+
+    unsigned Fn = 0;                            // Function being compiled
+    std::map<std::string, unsigned> Locals;     // Name -> register, flat per function like SymbolTable
+    bool HideLocals = false;                    // Global initializers only see globals
+    unsigned Top = 0;                           // First free register
+    unsigned Depth = 0;                         // In if/for bodies: only returns at 0 return
+
+    BytecodeCompiler(BytecodeProgram &P) : P(P) {}
+
+    BytecodeFunction &function() { return P.Functions[Fn]; }
+    size_t emit(BytecodeOp op, uint32_t a = 0, uint32_t b = 0, uint32_t c = 0);
+    size_t here() { return function().code.size(); }
+
+    // Locals are reserved at the start of a statement, temporaries above
+    // them are freed at its end, so they never overlap.
+    unsigned newRegister();
+    // For a `var`: a register no temporary had before, so until the
+    // declaration runs it reads 0 (frames start zeroed), like codegen's
+    // locals on paths that don't declare them.
+    unsigned newLocalRegister();
+    int lookupLocal(const std::string &name);
+    int constant(double val);
+};
+
+// Bytecode for Program, nullptr if it uses what the interpreter doesn't do
+// (tensors, imports, externs with too many args, that aren't in the process)
+// or has errors. The JIT path takes it from there and reports those.
+// `StartJIT` starts LLVM and the JIT (or returns it) once something gets hot.
+std::unique_ptr<BytecodeProgram> compileBytecode(LemonAST &Program, LemonJIT &(*StartJIT)());
+
+// Runs lemon_main.
+double runBytecode(BytecodeProgram &P);
@@ -0,0 +1,136 @@
+// ============================================================================
+// liblemon: embedding API
+// ============================================================================
+// Compile once, call the compiled functions directly as often as needed:
+//
+//     lemon::Program p = lemon::compile("func add(a, b) { return a + b; }");
+//     if (!p)
+//         fprintf(stderr, "%s", p.getErrors().c_str());
+//     auto add = p.get<double(double, double)>("add");
+//     add(1, 2);
+//
+// Every Lemon function returns double and takes doubles, or tensors where
+// the signature says `name: tensor`. get() only accepts signatures of that 
+// shape. The code stays in the process until the Program is destroyed, calls
+// go straight to native code.
+//
+// Tensors are host memory, bound without copying:
+//
+//     lemon::Program p = lemon::compile(
+//         "func scale(t: tensor, k) {"
+//         "    for (i = 0, dim(t, 0)) { t[i] = t[i] * k; }"
+//         "}");
+//     std::vector<double> v = {1, 2, 3};
+//     auto t = lemon::TensorRef::vector(v.data(), v.size());
+//     p.get<double(lemon::TensorRef *, double)>("scale")(&t, 2);    // v is {2, 4, 6}
+//
+// No LLVM in here, hosts don't need LLVM headers to use it.
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <type_traits>
+
+#pragma once
+
+namespace lemon {
+
+struct CompileOptions {
+    // Source path, for error messages, debug info and resolving relative
+    // imports. "-" means none, imports are relative to the working directory.
+    std::string Path = "-";
+};
+
+// A view of a host buffer of doubles, what a `t: tensor` argument gets. 
+// Strides are in elements, not bytes, so transposes and slices are just
+// different strides over the same data. Lemon code reads and writes `data`
+// directly and never checks indices against `shape`, keep them in bounds.
+struct TensorRef {
+    static constexpr int MaxRank = 4;
+
+    double *data;
+    int64_t rank;
+    int64_t shape[MaxRank];
+    int64_t strides[MaxRank];
+
+    // Contiguous, n elements.
+    static TensorRef vector(double *data, int64_t n) {
+        return {data, 1, {n}, {1}};
+    }
+
+    // Row major, rows x cols.
+    static TensorRef matrix(double *data, int64_t rows, int64_t cols) {
+        return {data, 2, {rows, cols}, {cols, 1}};
+    }
+};
+
+namespace detail {
+template <typename Arg>
+constexpr char argKind() {
+    if constexpr (std::is_same_v<Arg, double>)
+        return 'd';
+    else if constexpr (std::is_same_v<Arg, TensorRef *> || std::is_same_v<Arg, const TensorRef *>)
+        return 't';
+    else
+        return 0;
+}
+
+template <typename Sig>
+struct LemonSignature {
+    static constexpr bool valid = false;
+};
+
+template <typename... Args>
+struct LemonSignature<double(Args...)> {
+    static constexpr bool valid = ((argKind<Args>() != 0) && ...);
+
+    // Same encoding as the compiler's ArgType, one char per arg.
+    static std::string kinds() {
+        return std::string{argKind<Args>()...};
+    }
+};
+}
+
+class Program {
+public:
+    Program();
+    Program(Program &&);
+    Program &operator=(Program &&);
+    ~Program();     // Frees the compiled code, pointers from get() are dangling after.
+
+    // False if compiling failed, see getErrors().
+    explicit operator bool() const;
+
+    // Diagnostics (file:line:col: ERROR: ...) if compiling failed.
+    const std::string &getErrors() const;
+
+    // Pointer to the compiled function `name`, nullptr if there is no such
+    // function or its arguments don't match Sig (count, tensor vs double).
+    // Safe to call from any thread, and so is the function, as long as two
+    // calls don't write the same tensor.
+    template <typename Sig>
+    Sig *get(const std::string &name) const {
+        static_assert(detail::LemonSignature<Sig>::valid,
+                      "Lemon functions return double and take double or TensorRef *");
+        return reinterpret_cast<Sig *>(lookup(name, detail::LemonSignature<Sig>::kinds()));
+    }
+
+    // Runs the top level statements (lemon_main) and returns the value of
+    // the last one. Global variables are initialized here, so call it before
+    // anything that uses them.
+    double run() const;
+
+private:
+    struct State;
+    std::unique_ptr<State> St;
+
+    void *lookup(const std::string &name, const std::string &argKinds) const;
+
+    friend Program compile(const std::string &source, const CompileOptions &Opts);
+};
+
+// Parses, codegens and JIT compiles `source`. Safe to call from several
+// threads at once, each call compiles in its own CompilerSession.
+Program compile(const std::string &source, const CompileOptions &Opts = CompileOptions());
+
+}
@@ -6,12 +6,14 @@
 #define LLVM_EXECUTIONENGINE_ORC_LEMONJIT_H
 
 #include "llvm/ADT/StringRef.h"
+#include "llvm/ADT/StringExtras.h"
 #include "llvm/ExecutionEngine/JITSymbol.h"
 #include "llvm/ExecutionEngine/Orc/CompileUtils.h"
 #include "llvm/ExecutionEngine/Orc/Core.h"
 #include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
 #include "llvm/ExecutionEngine/Orc/ExecutorProcessControl.h"
 #include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
 #include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
 #include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
 // #include "llvm/ExecutionEngine/Orc/SelfExecutorProcessControl.h"
@@ -19,14 +21,32 @@
 #include "llvm/ExecutionEngine/SectionMemoryManager.h"
 #include "llvm/IR/DataLayout.h"
 #include "llvm/IR/LLVMContext.h"
+#include "llvm/MC/TargetRegistry.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/ExecutionEngine/JITEventListener.h"
+#include "./PerfMapListener.h"
 #include <memory>
+#include <optional>
+#include <string>
+#include <vector>
 
 namespace llvm {
 namespace orc {
 
+struct LemonJITOptions {
+    std::string CPU;        // --mcpu, empty means the host CPU.
+    std::string Features;   // --mattr, e.g. "+avx2,-avx512f". Applied on top of the CPU.
+
+    // Profiler / debugger visibility of JIT'd code.
+    bool PerfMap = false;           // --perf-map, /tmp/perf-<pid>.map
+    bool JITDump = false;           // --jitdump, needs LLVM built with LLVM_USE_PERF
+    bool GDBRegistration = false;   // --gdb-jit, GDB JIT interface
+};
+
 class LemonJIT {
 private:
     std::unique_ptr<ExecutionSession> ES;
+    JITTargetMachineBuilder JTMB;   // Kept for createTargetMachine()
 
     DataLayout DL;
     MangleAndInterner Mangle;
@@ -36,10 +56,14 @@ private:
 
     JITDylib &MainJD;
 
+    std::unique_ptr<PerfMapListener> PerfMap;
+
 public:
     LemonJIT(std::unique_ptr<ExecutionSession> ES, 
-             JITTargetMachineBuilder JTMB, DataLayout DL)
-        : ES(std::move(ES)), DL(std::move(DL)), Mangle(*this->ES, this->DL),
+             JITTargetMachineBuilder JTMB, DataLayout DL,
+             const LemonJITOptions &Opts = LemonJITOptions())
+        : ES(std::move(ES)), JTMB(JTMB), DL(std::move(DL)), 
+          Mangle(*this->ES, this->DL),
           ObjectLayer(*this->ES,
                       []() {
                         return std::make_unique<SectionMemoryManager>();
@@ -52,10 +76,24 @@ public:
             MainJD.addGenerator(
                 cantFail(DynamicLibrarySearchGenerator::GetForCurrentProcess(
                     DL.getGlobalPrefix())));
-            if (JTMB.getTargetTriple().isOSBinFormatCOFF()) {
+            if (this->JTMB.getTargetTriple().isOSBinFormatCOFF()) {
                 ObjectLayer.setOverrideObjectFlagsWithResponsibilityFlags(true);
                 ObjectLayer.setAutoClaimResponsibilityForObjectSymbols(true);
             }
+
+            // Without listeners perf/gdb only see anonymous addresses.
+            if (Opts.PerfMap) {
+                PerfMap = std::make_unique<PerfMapListener>();
+                ObjectLayer.registerJITEventListener(*PerfMap);
+            }
+            if (Opts.JITDump) {
+                if (auto *L = JITEventListener::createPerfJITEventListener())
+                    ObjectLayer.registerJITEventListener(*L);
+                else
+                    fprintf(stderr, "🍋 jitdump needs LLVM built with LLVM_USE_PERF, ignoring --jitdump.\n");
+            }
+            if (Opts.GDBRegistration)
+                ObjectLayer.registerJITEventListener(*JITEventListener::createGDBRegistrationListener());
           }
 
     ~LemonJIT() {
@@ -64,7 +102,7 @@ public:
         }
     }
 
-    static Expected<std::unique_ptr<LemonJIT> > Create() {
+    static Expected<std::unique_ptr<LemonJIT> > Create(const LemonJITOptions &Opts = LemonJITOptions()) {
         auto EPC = SelfExecutorProcessControl::Create();
 
         if (!EPC) {
@@ -73,23 +111,113 @@ public:
 
         auto ES = std::make_unique<ExecutionSession>(std::move(*EPC));
 
-        JITTargetMachineBuilder JTMB(
-            ES->getExecutorProcessControl().getTargetTriple());
+        // Host CPU name + features (AVX2, AVX-512, ...), otherwise we only 
+        // get baseline code for the triple.
+        auto JTMB = JITTargetMachineBuilder::detectHost();
+
+        if (!JTMB) {
+            return JTMB.takeError();
+        }
+
+        // --mcpu replaces the host CPU, its features come from the CPU name.
+        if (!Opts.CPU.empty()) {
+            JTMB->setCPU(Opts.CPU);
+            JTMB->getFeatures() = SubtargetFeatures();
+        }
+
+        // --mattr is added on top, later entries win.
+        if (!Opts.Features.empty()) {
+            std::vector<std::string> Features;
+            for (StringRef F : split(Opts.Features, ','))
+                if (!F.empty())
+                    Features.push_back(F.str());
+            JTMB->addFeatures(Features);
+        }
             
-        auto DL = JTMB.getDefaultDataLayoutForTarget();
+        auto DL = JTMB->getDefaultDataLayoutForTarget();
 
         if (!DL) {
             return DL.takeError();
         }
 
-        return std::make_unique<LemonJIT>(std::move(ES), std::move(JTMB), 
-                                          std::move(*DL));
+        return std::make_unique<LemonJIT>(std::move(ES), std::move(*JTMB), 
+                                          std::move(*DL), Opts);
     }
 
     const DataLayout &getDataLayout() const { return DL; }
 
+    // Same target (CPU, features) as the JIT, so TTI (vector widths, costs)
+    // in the optimizer matches what actually gets generated. A TargetMachine
+    // isn't thread-safe, every CompilerSession makes its own.
+    Expected<std::unique_ptr<TargetMachine>> createTargetMachine() {
+        return JTMB.createTargetMachine();
+    }
+
+    // For --emit-obj. JIT target machines use the JIT's code model and no 
+    // PIC, which the system linker rejects (or needs text relocations for) 
+    // in a PIE. So a regular one: PIC, default code model. Same triple, and 
+    // the JIT's CPU/features unless CPU is given, e.g. "generic" for objects 
+    // that run on other machines.
+    Expected<std::unique_ptr<TargetMachine>> createObjectTargetMachine(const std::string &CPU = "") {
+        const Triple &TT = JTMB.getTargetTriple();
+        std::string Err;
+        const Target *T = TargetRegistry::lookupTarget(TT.str(), Err);
+        if (!T)
+            return make_error<StringError>(Err, inconvertibleErrorCode());
+
+        std::string TargetCPU = CPU.empty() ? JTMB.getCPU() : CPU;
+        std::string Features = CPU.empty() ? JTMB.getFeatures().getString() : "";
+        TargetMachine *TM = T->createTargetMachine(TT.str(), TargetCPU, Features, JTMB.getOptions(),
+                                                   Reloc::PIC_, std::nullopt, CodeGenOptLevel::Default);
+        if (!TM)
+            return make_error<StringError>("Can't create a target machine for " + TT.str(),
+                                           inconvertibleErrorCode());
+        return std::unique_ptr<TargetMachine>(TM);
+    }
+
     JITDylib &getMainJITDylib() { return MainJD; }
 
+    // Separate symbol namespace for one program, so two programs can both
+    // define `add`. Anything it doesn't define (runtime, libm, ...) is 
+    // looked up in the main JITDylib.
+    JITDylib &createJITDylib(const std::string &Name) {
+        JITDylib &JD = ES->createBareJITDylib(Name);
+        JD.addToLinkOrder(MainJD);
+        return JD;
+    }
+
+    // Frees all code and symbols of JD, nothing in it may run afterwards.
+    Error removeJITDylib(JITDylib &JD) {
+        return ES->removeJITDylib(JD);
+    }
+
+    // Host function programs can extern, found even if the host binary
+    // doesn't export its symbols.
+    Error defineAbsolute(StringRef Name, void *Addr) {
+        return MainJD.define(absoluteSymbols({
+            {Mangle(Name.str()), {ExecutorAddr::fromPtr(Addr), JITSymbolFlags::Exported | JITSymbolFlags::Callable}}
+        }));
+    }
+
+    // Re-pointable stubs (--watch): callers are linked against the stub, 
+    // updatePointer() swaps the code behind it without touching them.
+    Expected<std::unique_ptr<IndirectStubsManager>> createIndirectStubsManager() {
+        auto Builder = createLocalIndirectStubsManagerBuilder(JTMB.getTargetTriple());
+        if (!Builder)
+            return make_error<StringError>("No indirect stubs for " + JTMB.getTargetTriple().str(), 
+                                           inconvertibleErrorCode());
+        return Builder();
+    }
+
+    // Stub `Name` in ISM, defined as `Name` in JD. Points nowhere until 
+    // ISM.updatePointer(Name, ...).
+    Error defineStub(JITDylib &JD, IndirectStubsManager &ISM, StringRef Name) {
+        auto Flags = JITSymbolFlags::Exported | JITSymbolFlags::Callable;
+        if (auto Err = ISM.createStub(Name, ExecutorAddr(), Flags))
+            return Err;
+        return JD.define(absoluteSymbols({{Mangle(Name.str()), ISM.findStub(Name, true)}}));
+    }
+
     Error addModule(ThreadSafeModule TSM, ResourceTrackerSP RT = nullptr) {
         if (!RT) {
             RT = MainJD.getDefaultResourceTracker();
@@ -98,10 +226,23 @@ public:
         return CompileLayer.add(RT, std::move(TSM));
     }
 
+    // Already compiled code, e.g. an imported file from the object cache.
+    Error addObjectFile(std::unique_ptr<MemoryBuffer> Obj, ResourceTrackerSP RT = nullptr) {
+        if (!RT) {
+            RT = MainJD.getDefaultResourceTracker();
+        }
+
+        return ObjectLayer.add(RT, std::move(Obj));
+    }
+
     Expected<ExecutorSymbolDef> lookup(StringRef Name) {
         return ES->lookup({&MainJD}, Mangle(Name.str()));
     }
 
+    Expected<ExecutorSymbolDef> lookup(JITDylib &JD, StringRef Name) {
+        return ES->lookup({&JD}, Mangle(Name.str()));
+    }
+
     ExecutionSession& getExecutionSession() { return *ES; }
 };
 
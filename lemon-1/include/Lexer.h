@@ -3,6 +3,9 @@
 // ============================================================================
 
 #include <string>
+#include <string_view>
+#include <cstdint>
+#include <vector>
 
 #pragma once
 
@@ -42,15 +45,69 @@ enum Token {
     tok_eq = -25,
     tok_neq = -26,
 
-    tok_for = -27
+    tok_for = -27,
+
+    tok_not = -28,
+
+    tok_import = -29,
+    tok_string = -30,
+
+    // Tensors: t[i, j], func f(t: tensor)
+    tok_lbracket = -31,
+    tok_rbracket = -32,
+    tok_colon = -33
+};
+
+// Span of source text as byte offsets into the lexer's buffer, [Begin, End).
+// Every token and AST node carries one, so it has to stay small. Line and
+// column are only worked out when something asks (errors, debug info).
+struct SourceRange {
+    uint32_t Begin = 0;
+    uint32_t End = 0;
+};
+
+// Line/column in the source file, both 1 based.
+struct LineCol {
+    unsigned Line;
+    unsigned Col;
 };
 
-extern std::string idStr;
-extern double numVal;
-extern int curTok;
-extern char curChar;
+// Lexer state for one source buffer. Every CompilerSession has its own, so
+// files can be lexed on several threads at once.
+class Lexer {
+public:
+    std::string_view idStr;             // Points into the source buffer, also the contents of a tok_string
+    double numVal = 0;
+    int curTok = 0;
+    char curChar = ' ';
+    SourceRange CurRange;               // Span of curTok
+    uint32_t PrevTokEnd = 0;            // Where the token before curTok ended
+    std::string SourceFileName = "<stdin>";  // For messages and debug info
+    const char *srcBegin = nullptr;     // Buffer being lexed
+    const char *srcEnd = nullptr;
+
+    // Lexer reads from [begin, end), the buffer must outlive lexing.
+    // Offsets are 32 bit, so the source can't be bigger than 4 GiB (see
+    // CompilerSession::setSource()).
+    void setSource(const char *begin, const char *end);
+
+    LineCol getLineCol(uint32_t offset);
+
+    int gettok();
+    int getNextToken();
+    int peakNextToken();
+
+private:
+    const char *srcCur = nullptr;
+    uint32_t LexOffset = 0;             // Offset of curChar
+
+    // Offset of the first character of every line. Built on the first
+    // getLineCol() so lexing itself doesn't pay for it.
+    std::vector<uint32_t> LineStarts;
+
+    int getNextChar();
+    int lexToken();
+};
 
-int gettok();
-int getNextToken();
-int peakNextToken();
-std::string tokenToString(int token);
+int lookupKeyword(std::string_view id);  // tok_id if not a keyword
+std::string tokenToString(int token);    // Spelling of operators and keywords
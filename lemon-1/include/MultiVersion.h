@@ -0,0 +1,19 @@
+// ============================================================================
+// Function multi-versioning (--multiversion)
+// ============================================================================
+#include "llvm/IR/Function.h"
+#include "llvm/IR/PassManager.h"
+
+using namespace llvm;
+
+#pragma once
+
+extern int MULTIVERSION;
+
+// For functions with loops (kernels): clones F once per ISA level (SSE4.2, 
+// AVX2, AVX-512), optimizes every clone for its own target features and 
+// turns F itself into a dispatcher that calls the best one. The choice is 
+// made once at startup by a global constructor that checks CPUID through 
+// __cpu_model (libgcc / compiler-rt). x86-64 only, meant for --emit-obj.
+// The clones are optimized with FPM, the pipeline F itself goes through.
+void multiVersionFunction(Function *F, FunctionPassManager &FPM, FunctionAnalysisManager &FAM);
@@ -3,64 +3,92 @@
 // ============================================================================
 #include "llvm/IR/Value.h"
 #include "../include/AST.h"
+#include "../include/CompilerSession.h"
 
 #include <memory>
 #include <map>
+#include <vector>
 
 using namespace llvm;
 
 #pragma once
-extern std::map<int, int> operatorPrecedence;
 
 // Helper Functions
-int getPrecedence(int tok);
+constexpr int NumTokenKinds = 64;   // Bigger than -(lowest token), see Lexer.h
+static_assert(-tok_colon < NumTokenKinds, "Token table too small");
 
+struct BinaryOpInfo {
+    int precedence;     // 0: not a binary op
+    bool rightAssoc;
+};
 
-// Error Functions
-std::unique_ptr<ExprAST> LogError(const char *str);
+BinaryOpInfo getBinaryOp(int tok);
 
-std::unique_ptr<PrototypeAST> LogErrorP(const char *str);
 
-std::unique_ptr<StmtAST> LogErrorS(const char *str);
+// Recursive descent over the session's lexer, errors go to the session's
+// diagnostics. The lexer has to be on the first token (getNextToken()).
+class Parser {
+    FrontEnd &S;
+    Lexer &Lex;
 
-std::unique_ptr<FunctionAST> LogErrorF(const char *str);
+public:
+    Parser(FrontEnd &S) : S(S), Lex(S.Lex) {}
 
-Value *LogErrorV(const char *Str);
+    std::unique_ptr<LemonAST> Parse();
 
+private:
+    SourceRange rangeFrom(SourceRange start);
 
-// Parsing Functions
-std::unique_ptr<LemonAST> Parse();
+    // Error Functions
+    void synchronize();
 
-std::vector<std::unique_ptr<StmtAST>> ParseStatementList();
+    std::unique_ptr<ExprAST> LogError(const char *str);
 
-std::unique_ptr<StmtAST> ParseStatement();
+    std::unique_ptr<PrototypeAST> LogErrorP(const char *str);
 
-std::unique_ptr<PrototypeAST> ParsePrototype();
+    std::unique_ptr<StmtAST> LogErrorS(const char *str);
 
-std::unique_ptr<FunctionAST> ParseFunction();
+    std::unique_ptr<FunctionAST> LogErrorF(const char *str);
 
-std::unique_ptr<StmtAST> ParseExtern();
 
-std::unique_ptr<StmtAST> ParseIfStmt();
+    // Parsing Functions
+    std::vector<std::unique_ptr<StmtAST>> ParseStatementList();
 
-std::unique_ptr<StmtAST> ParseForStmt();
+    std::unique_ptr<StmtAST> ParseStatement();
 
-std::vector<std::unique_ptr<ExprAST>> ParseArgList();
+    std::unique_ptr<PrototypeAST> ParsePrototype();
 
-std::unique_ptr<StmtAST> ParseVariableDecl();
+    std::unique_ptr<FunctionAST> ParseFunction();
 
-std::unique_ptr<StmtAST> ParseVariableAssignOrFunctionCall();
+    std::unique_ptr<StmtAST> ParseExtern();
 
-std::unique_ptr<StmtAST> ParseVariableAssign();
+    std::unique_ptr<StmtAST> ParseImport();
 
-std::unique_ptr<StmtAST> ParseReturn();
+    std::unique_ptr<StmtAST> ParseIfStmt();
 
-std::unique_ptr<ExprAST> ParseExpression();
+    std::unique_ptr<StmtAST> ParseForStmt();
 
-std::unique_ptr<ExprAST> ParseFactor();
+    std::vector<std::unique_ptr<ExprAST>> ParseArgList();
 
-std::unique_ptr<ExprAST> ParseBinOpRHS(int precedence, std::unique_ptr<ExprAST> LHS);
+    std::unique_ptr<StmtAST> ParseVariableDecl();
 
-std::unique_ptr<ExprAST> ParseNumberExpr();
+    std::unique_ptr<StmtAST> ParseVariableAssignOrFunctionCall();
 
-std::unique_ptr<ExprAST> ParseIdentifierExpr();
+    std::unique_ptr<StmtAST> ParseVariableAssign();
+
+    std::unique_ptr<StmtAST> ParseIndexAssign();
+
+    bool ParseIndexList(std::vector<std::unique_ptr<ExprAST>> &indices);
+
+    std::unique_ptr<StmtAST> ParseReturn();
+
+    std::unique_ptr<ExprAST> ParseExpression(int minPrecedence = 0);
+
+    std::unique_ptr<ExprAST> ParseUnary();
+
+    std::unique_ptr<ExprAST> ParseFactor();
+
+    std::unique_ptr<ExprAST> ParseNumberExpr();
+
+    std::unique_ptr<ExprAST> ParseIdentifierExpr();
+};
@@ -0,0 +1,32 @@
+// Writes /tmp/perf-<pid>.map entries for everything the JIT loads, so perf
+// can symbolize JIT'd Lemon functions instead of showing raw addresses.
+// Format (one line per function): <start hex> <size hex> <name>
+
+#ifndef LEMON_PERFMAPLISTENER_H
+#define LEMON_PERFMAPLISTENER_H
+
+#include "llvm/ExecutionEngine/JITEventListener.h"
+
+#include <cstdio>
+#include <mutex>
+
+namespace llvm {
+namespace orc {
+
+class PerfMapListener : public JITEventListener {
+private:
+    FILE *MapFile = nullptr;
+    std::mutex Lock;
+
+public:
+    PerfMapListener();
+    ~PerfMapListener() override;
+
+    void notifyObjectLoaded(ObjectKey K, const object::ObjectFile &Obj,
+                            const RuntimeDyld::LoadedObjectInfo &L) override;
+};
+
+}
+}
+
+#endif
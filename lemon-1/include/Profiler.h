@@ -0,0 +1,16 @@
+// ============================================================================
+// Execution profiler runtime (--profile)
+// ============================================================================
+// Every Lemon function calls lemon_prof_enter/lemon_prof_exit with its own 
+// name (see instrumentFunction). Timing uses the CPU timestamp counter and 
+// per-thread buffers, so there is no locking on the hot path.
+
+#pragma once
+
+extern "C" {
+    void lemon_prof_enter(const char *name);
+    void lemon_prof_exit(const char *name);
+
+    // Prints a flat profile and the call graph to stderr.
+    void lemon_prof_report();
+}
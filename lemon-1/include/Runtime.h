@@ -0,0 +1,16 @@
+// ============================================================================
+// Runtime functions Lemon code can extern (src/Runtime.cc)
+// ============================================================================
+
+#pragma once
+
+#ifdef _WIN32
+#define DLLEXPORT __declspec(dllexport)
+#else
+#define DLLEXPORT
+#endif
+
+extern "C" {
+    DLLEXPORT double putchard(double X);
+    DLLEXPORT double printd(double X);
+}
@@ -0,0 +1,25 @@
+// ============================================================================
+// Watch mode (--watch): hot reload, one function at a time
+// ============================================================================
+#include "./LemonJIT.h"
+
+#include <string>
+
+using namespace llvm;
+using namespace llvm::orc;
+
+#pragma once
+
+// Runs `file`, then runs it again every time it changes, until killed.
+// The JIT state stays alive in between:
+//  - Every function is its own module, behind a re-pointable stub. On a
+//    change, only functions whose AST hash changed are recompiled, and their
+//    stub is pointed at the new code. The old code is freed through its
+//    ResourceTracker. Callers are not touched.
+//  - Global variables keep their storage, lemon_main (which initializes
+//    them) runs again after every reload.
+//  - Anything else (globals, top level statements, externs, imports, a
+//    function's signature, adding/removing functions) reloads everything.
+// Parse or codegen errors keep the old code running. Only `file` itself is
+// watched, not the files it imports.
+int runWatch(LemonJIT &JIT, const std::string &file);
@@ -0,0 +1,52 @@
+#include "../include/AOT.h"
+
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/raw_ostream.h"
+
+void addMainWrapper(Module &M) {
+    LLVMContext &Ctx = M.getContext();
+    Function *LemonMain = M.getFunction("lemon_main");
+
+    FunctionType *FT = FunctionType::get(Type::getInt32Ty(Ctx), false);
+    Function *Main = Function::Create(FT, Function::ExternalLinkage, "main", M);
+
+    IRBuilder<> TmpBuilder(BasicBlock::Create(Ctx, "entry", Main));
+    TmpBuilder.CreateCall(LemonMain, {});
+
+    // Instrumented with --profile, print the profile before exiting.
+    if (M.getFunction("lemon_prof_enter")) {
+        FunctionCallee Report = M.getOrInsertFunction("lemon_prof_report", 
+                                                      FunctionType::get(Type::getVoidTy(Ctx), false));
+        TmpBuilder.CreateCall(Report, {});
+    }
+    TmpBuilder.CreateRet(TmpBuilder.getInt32(0));
+}
+
+bool emitObject(Module &M, TargetMachine &TM, raw_pwrite_stream &out) {
+    legacy::PassManager PM;
+    if (TM.addPassesToEmitFile(PM, out, nullptr, CodeGenFileType::ObjectFile)) {
+        errs() << "Target machine can't emit an object file.\n";
+        return false;
+    }
+
+    PM.run(M);
+    return true;
+}
+
+bool emitObjectFile(Module &M, TargetMachine &TM, const std::string &path) {
+    std::error_code EC;
+    raw_fd_ostream out(path, EC, sys::fs::OF_None);
+
+    if (EC) {
+        errs() << "Error opening file: " << EC.message() << "\n";
+        return false;
+    }
+
+    if (!emitObject(M, TM, out))
+        return false;
+    out.flush();
+
+    return true;
+}
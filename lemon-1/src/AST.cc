@@ -0,0 +1,3 @@
+#include "../include/AST.h"
+
+thread_local uint64_t NumASTNodes = 0;
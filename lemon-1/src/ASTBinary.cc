@@ -0,0 +1,601 @@
+#include "../include/ASTBinary.h"
+
+#include <cstring>
+
+// ============================================================================
+//                                  Writing
+// ============================================================================
+
+uint32_t ASTBinWriter::addString(StringRef str) {
+    auto [It, inserted] = StringIds.try_emplace(str, Strings.size());
+    if (inserted) {
+        Strings.push_back({(uint32_t)StringData.size(), (uint32_t)str.size()});
+        StringData += str;
+    }
+    return It->second;
+}
+
+uint32_t ASTBinWriter::addNode(ASTBinNode N, ArrayRef<uint32_t> children) {
+    N.first = Children.size();
+    N.count = children.size();
+    Children.insert(Children.end(), children.begin(), children.end());
+    Nodes.push_back(N);
+    return Nodes.size() - 1;
+}
+
+static ASTBinNode binNode(ASTBinKind kind, SourceRange range) {
+    ASTBinNode N = {};
+    N.kind = kind;
+    N.range = range;
+    return N;
+}
+
+static void writeStatements(ASTBinWriter &W, std::vector<std::unique_ptr<StmtAST>> &statements,
+                            SmallVectorImpl<uint32_t> &children) {
+    for (auto &statement : statements)
+        children.push_back(statement->writeBinary(W));
+}
+
+static void writeExprs(ASTBinWriter &W, std::vector<std::unique_ptr<ExprAST>> &exprs,
+                       SmallVectorImpl<uint32_t> &children) {
+    for (auto &expr : exprs)
+        children.push_back(expr->writeBinary(W));
+}
+
+uint32_t LemonAST::writeBinary(ASTBinWriter &W) {
+    SmallVector<uint32_t, 64> children;
+    writeStatements(W, statements, children);
+
+    ASTBinNode N = binNode(bin_program, SourceRange());
+    N.value = optimizations;
+    return W.addNode(N, children);
+}
+
+uint32_t BinaryExprAST::writeBinary(ASTBinWriter &W) {
+    uint32_t children[] = {LHS->writeBinary(W), RHS->writeBinary(W)};
+    ASTBinNode N = binNode(bin_binary, getRange());
+    N.op = op;
+    return W.addNode(N, children);
+}
+
+uint32_t UnaryExprAST::writeBinary(ASTBinWriter &W) {
+    uint32_t children[] = {operand->writeBinary(W)};
+    ASTBinNode N = binNode(bin_unary, getRange());
+    N.op = op;
+    return W.addNode(N, children);
+}
+
+uint32_t NumberExprAST::writeBinary(ASTBinWriter &W) {
+    ASTBinNode N = binNode(bin_number, getRange());
+    memcpy(&N.value, &val, sizeof(val));
+    return W.addNode(N);
+}
+
+uint32_t VariableExprAST::writeBinary(ASTBinWriter &W) {
+    ASTBinNode N = binNode(bin_variable, getRange());
+    N.name = W.addString(varName);
+    return W.addNode(N);
+}
+
+uint32_t IndexExprAST::writeBinary(ASTBinWriter &W) {
+    SmallVector<uint32_t, TENSOR_MAX_RANK> children;
+    writeExprs(W, indices, children);
+
+    ASTBinNode N = binNode(bin_index, getRange());
+    N.name = W.addString(tensorName);
+    return W.addNode(N, children);
+}
+
+uint32_t CallExprAST::writeBinary(ASTBinWriter &W) {
+    SmallVector<uint32_t, 8> children;
+    writeExprs(W, args, children);
+
+    ASTBinNode N = binNode(bin_call, getRange());
+    N.name = W.addString(callee);
+    return W.addNode(N, children);
+}
+
+uint32_t PrototypeAST::writeBinary(ASTBinWriter &W) {
+    SmallVector<uint32_t, 8> argNames;
+    for (auto &arg : args)
+        argNames.push_back(W.addString(arg));
+
+    ASTBinNode N = binNode(bin_prototype, Range);
+    N.name = W.addString(name);
+    N.split = W.addString(argTypes);
+    return W.addNode(N, argNames);
+}
+
+uint32_t VariableDeclStmt::writeBinary(ASTBinWriter &W) {
+    SmallVector<uint32_t, 1> children;
+    if (defBody)
+        children.push_back(defBody->writeBinary(W));
+
+    ASTBinNode N = binNode(bin_var_decl, getRange());
+    N.name = W.addString(varName);
+    return W.addNode(N, children);
+}
+
+uint32_t AssignmentStmt::writeBinary(ASTBinWriter &W) {
+    uint32_t children[] = {defBody->writeBinary(W)};
+    ASTBinNode N = binNode(bin_assign, getRange());
+    N.name = W.addString(varName);
+    return W.addNode(N, children);
+}
+
+uint32_t IndexAssignStmt::writeBinary(ASTBinWriter &W) {
+    SmallVector<uint32_t, TENSOR_MAX_RANK + 1> children;
+    writeExprs(W, indices, children);
+    children.push_back(defBody->writeBinary(W));
+
+    ASTBinNode N = binNode(bin_index_assign, getRange());
+    N.name = W.addString(tensorName);
+    return W.addNode(N, children);
+}
+
+uint32_t ReturnStmtAST::writeBinary(ASTBinWriter &W) {
+    uint32_t children[] = {retBody->writeBinary(W)};
+    return W.addNode(binNode(bin_return, getRange()), children);
+}
+
+uint32_t FunctionAST::writeBinary(ASTBinWriter &W) {
+    SmallVector<uint32_t, 16> children;
+    children.push_back(proto->writeBinary(W));
+    writeStatements(W, functionBody, children);
+    return W.addNode(binNode(bin_function, getRange()), children);
+}
+
+uint32_t ExternAST::writeBinary(ASTBinWriter &W) {
+    uint32_t children[] = {proto->writeBinary(W)};
+    return W.addNode(binNode(bin_extern, getRange()), children);
+}
+
+uint32_t ImportStmtAST::writeBinary(ASTBinWriter &W) {
+    ASTBinNode N = binNode(bin_import, getRange());
+    N.name = W.addString(path);
+    return W.addNode(N);
+}
+
+uint32_t ExpressionStmtAST::writeBinary(ASTBinWriter &W) {
+    uint32_t children[] = {expr->writeBinary(W)};
+    return W.addNode(binNode(bin_expr_stmt, getRange()), children);
+}
+
+uint32_t IfStmtAST::writeBinary(ASTBinWriter &W) {
+    SmallVector<uint32_t, 16> children;
+    children.push_back(cond->writeBinary(W));
+    writeStatements(W, thenBody, children);
+    uint32_t split = children.size();
+    writeStatements(W, elseBody, children);
+
+    ASTBinNode N = binNode(bin_if, getRange());
+    N.split = split;
+    return W.addNode(N, children);
+}
+
+uint32_t ForStmtAST::writeBinary(ASTBinWriter &W) {
+    SmallVector<uint32_t, 16> children;
+    children.push_back(start->writeBinary(W));
+    children.push_back(end->writeBinary(W));
+    children.push_back(step->writeBinary(W));
+    writeStatements(W, forBody, children);
+
+    ASTBinNode N = binNode(bin_for, getRange());
+    N.name = W.addString(iterator);
+    return W.addNode(N, children);
+}
+
+static uint64_t alignTo8(uint64_t offset) {
+    return (offset + 7) & ~uint64_t(7);
+}
+
+static void writeSection(raw_ostream &out, uint64_t &offset, uint64_t sectionOffset, const void *data, size_t size) {
+    out.write_zeros(sectionOffset - offset);
+    out.write((const char *)data, size);
+    offset = sectionOffset + size;
+}
+
+bool writeASTBinary(LemonAST &Program, Lexer &Lex, const std::string &path) {
+    ASTBinWriter W;
+    Program.writeBinary(W);
+
+    ASTBinHeader H = {};
+    memcpy(H.magic, AST_BIN_MAGIC, sizeof(H.magic));
+    H.version = AST_BIN_VERSION;
+    H.byteOrder = AST_BIN_BYTE_ORDER;
+    H.numNodes = W.Nodes.size();
+    H.numChildren = W.Children.size();
+    H.sourceName = W.addString(Lex.SourceFileName);
+    H.numStrings = W.Strings.size();
+    H.sourceSize = Lex.srcEnd - Lex.srcBegin;
+
+    H.nodesOffset = alignTo8(sizeof(H));
+    H.childrenOffset = alignTo8(H.nodesOffset + W.Nodes.size() * sizeof(ASTBinNode));
+    H.stringsOffset = alignTo8(H.childrenOffset + W.Children.size() * sizeof(uint32_t));
+    H.stringDataOffset = alignTo8(H.stringsOffset + W.Strings.size() * sizeof(ASTBinString));
+    H.stringDataSize = W.StringData.size();
+    H.sourceOffset = alignTo8(H.stringDataOffset + H.stringDataSize);
+
+    std::error_code EC;
+    raw_fd_ostream out(path, EC, sys::fs::OF_None);
+    if (EC)
+        return false;
+
+    uint64_t offset = 0;
+    writeSection(out, offset, 0, &H, sizeof(H));
+    writeSection(out, offset, H.nodesOffset, W.Nodes.data(), W.Nodes.size() * sizeof(ASTBinNode));
+    writeSection(out, offset, H.childrenOffset, W.Children.data(), W.Children.size() * sizeof(uint32_t));
+    writeSection(out, offset, H.stringsOffset, W.Strings.data(), W.Strings.size() * sizeof(ASTBinString));
+    writeSection(out, offset, H.stringDataOffset, W.StringData.data(), W.StringData.size());
+    writeSection(out, offset, H.sourceOffset, Lex.srcBegin, H.sourceSize);
+
+    out.close();
+    return !out.has_error();
+}
+
+// ============================================================================
+//                                  Loading
+// ============================================================================
+
+bool isASTBinary(StringRef buffer) {
+    return buffer.startswith(StringRef(AST_BIN_MAGIC, 8));
+}
+
+namespace {
+
+// Builds nodes front to back. Each built node sits in the slot for its
+// kind until its parent takes it, so a child can't be taken twice (or by
+// a parent written before it, which would make a cycle).
+class ASTBinLoader {
+    StringRef File;
+    ASTBinHeader H;
+
+    std::vector<std::unique_ptr<ExprAST>> Exprs;
+    std::vector<std::unique_ptr<StmtAST>> Stmts;
+    std::vector<std::unique_ptr<PrototypeAST>> Protos;
+    std::unique_ptr<LemonAST> Program;
+
+public:
+    const char *Error = nullptr;
+
+    ASTBinLoader(StringRef File) : File(File) {}
+
+    std::unique_ptr<LemonAST> load();
+    StringRef source() const { return File.substr(H.sourceOffset, H.sourceSize); }
+    bool getSourceName(std::string &out) { return getString(H.sourceName, out); }
+
+private:
+    bool getString(uint32_t id, std::string &out);
+
+    bool fail(const char *error) {
+        if (!Error)
+            Error = error;
+        return false;
+    }
+
+    // Whether `count` T's starting at `offset` are in the file.
+    template <typename T>
+    bool inFile(uint64_t offset, uint64_t count) {
+        return offset <= File.size() && count <= (File.size() - offset) / sizeof(T);
+    }
+
+    // memcpy, the buffer doesn't have to be aligned.
+    template <typename T>
+    T read(uint64_t offset, uint64_t index) {
+        T value;
+        memcpy(&value, File.data() + offset + index * sizeof(T), sizeof(T));
+        return value;
+    }
+
+    std::unique_ptr<ExprAST> takeExpr(uint32_t self, uint32_t child);
+    std::unique_ptr<StmtAST> takeStmt(uint32_t self, uint32_t child);
+    std::unique_ptr<PrototypeAST> takeProto(uint32_t self, uint32_t child);
+    bool takeExprs(uint32_t self, ArrayRef<uint32_t> children, std::vector<std::unique_ptr<ExprAST>> &out);
+    bool takeStmts(uint32_t self, ArrayRef<uint32_t> children, std::vector<std::unique_ptr<StmtAST>> &out);
+
+    bool build(uint32_t index, const ASTBinNode &N, ArrayRef<uint32_t> children);
+};
+
+} // namespace
+
+bool ASTBinLoader::getString(uint32_t id, std::string &out) {
+    if (id >= H.numStrings)
+        return fail("string index out of range");
+
+    auto S = read<ASTBinString>(H.stringsOffset, id);
+    if (S.offset > H.stringDataSize || S.size > H.stringDataSize - S.offset)
+        return fail("string out of range");
+
+    out.assign(File.data() + H.stringDataOffset + S.offset, S.size);
+    return true;
+}
+
+std::unique_ptr<ExprAST> ASTBinLoader::takeExpr(uint32_t self, uint32_t child) {
+    if (child >= self || !Exprs[child]) {
+        fail("bad expression child");
+        return nullptr;
+    }
+    return std::move(Exprs[child]);
+}
+
+std::unique_ptr<StmtAST> ASTBinLoader::takeStmt(uint32_t self, uint32_t child) {
+    if (child >= self || !Stmts[child]) {
+        fail("bad statement child");
+        return nullptr;
+    }
+    return std::move(Stmts[child]);
+}
+
+std::unique_ptr<PrototypeAST> ASTBinLoader::takeProto(uint32_t self, uint32_t child) {
+    if (child >= self || !Protos[child]) {
+        fail("bad prototype child");
+        return nullptr;
+    }
+    return std::move(Protos[child]);
+}
+
+bool ASTBinLoader::takeExprs(uint32_t self, ArrayRef<uint32_t> children, std::vector<std::unique_ptr<ExprAST>> &out) {
+    for (uint32_t child : children) {
+        out.push_back(takeExpr(self, child));
+        if (!out.back())
+            return false;
+    }
+    return true;
+}
+
+bool ASTBinLoader::takeStmts(uint32_t self, ArrayRef<uint32_t> children, std::vector<std::unique_ptr<StmtAST>> &out) {
+    for (uint32_t child : children) {
+        out.push_back(takeStmt(self, child));
+        if (!out.back())
+            return false;
+    }
+    return true;
+}
+
+bool ASTBinLoader::build(uint32_t index, const ASTBinNode &N, ArrayRef<uint32_t> children) {
+    SourceRange range = N.range;
+    std::string name;
+    if (!getString(N.name, name))
+        return false;
+
+    switch (N.kind) {
+    case bin_program: {
+        std::vector<std::unique_ptr<StmtAST>> statements;
+        if (!takeStmts(index, children, statements))
+            return false;
+        Program = std::make_unique<LemonAST>(std::move(statements), N.value);
+        return true;
+    }
+    case bin_binary: {
+        if (children.size() != 2)
+            return fail("binary expression needs 2 children");
+        auto LHS = takeExpr(index, children[0]);
+        auto RHS = takeExpr(index, children[1]);
+        if (!LHS || !RHS)
+            return false;
+        Exprs[index] = std::make_unique<BinaryExprAST>(range, N.op, std::move(LHS), std::move(RHS));
+        return true;
+    }
+    case bin_unary: {
+        if (children.size() != 1)
+            return fail("unary expression needs 1 child");
+        auto operand = takeExpr(index, children[0]);
+        if (!operand)
+            return false;
+        Exprs[index] = std::make_unique<UnaryExprAST>(range, N.op, std::move(operand));
+        return true;
+    }
+    case bin_number: {
+        double val;
+        memcpy(&val, &N.value, sizeof(val));
+        Exprs[index] = std::make_unique<NumberExprAST>(range, val);
+        return true;
+    }
+    case bin_variable:
+        Exprs[index] = std::make_unique<VariableExprAST>(range, name);
+        return true;
+    case bin_index: {
+        std::vector<std::unique_ptr<ExprAST>> indices;
+        if (children.size() > TENSOR_MAX_RANK || !takeExprs(index, children, indices))
+            return fail("bad tensor index");
+        Exprs[index] = std::make_unique<IndexExprAST>(range, name, std::move(indices));
+        return true;
+    }
+    case bin_call: {
+        std::vector<std::unique_ptr<ExprAST>> args;
+        if (!takeExprs(index, children, args))
+            return false;
+        Exprs[index] = std::make_unique<CallExprAST>(range, name, std::move(args));
+        return true;
+    }
+    case bin_prototype: {
+        // Children are strings here, not nodes.
+        std::vector<std::string> args(children.size());
+        std::string argTypes;
+        for (size_t i = 0; i < children.size(); ++i) {
+            if (!getString(children[i], args[i]))
+                return false;
+        }
+        if (!getString(N.split, argTypes))
+            return false;
+        if (argTypes.size() != args.size())
+            return fail("prototype arg types don't match its args");
+        Protos[index] = std::make_unique<PrototypeAST>(range, name, std::move(args), std::move(argTypes));
+        return true;
+    }
+    case bin_var_decl: {
+        if (children.size() > 1)
+            return fail("variable declaration has more than 1 child");
+        std::unique_ptr<ExprAST> defBody;
+        if (children.size() == 1 && !(defBody = takeExpr(index, children[0])))
+            return false;
+        Stmts[index] = std::make_unique<VariableDeclStmt>(range, name, std::move(defBody));
+        return true;
+    }
+    case bin_assign: {
+        if (children.size() != 1)
+            return fail("assignment needs 1 child");
+        auto defBody = takeExpr(index, children[0]);
+        if (!defBody)
+            return false;
+        Stmts[index] = std::make_unique<AssignmentStmt>(range, name, std::move(defBody));
+        return true;
+    }
+    case bin_index_assign: {
+        if (children.empty() || children.size() > TENSOR_MAX_RANK + 1)
+            return fail("bad tensor index");
+        std::vector<std::unique_ptr<ExprAST>> indices;
+        if (!takeExprs(index, children.drop_back(), indices))
+            return false;
+        auto defBody = takeExpr(index, children.back());
+        if (!defBody)
+            return false;
+        Stmts[index] = std::make_unique<IndexAssignStmt>(range, name, std::move(indices), std::move(defBody));
+        return true;
+    }
+    case bin_return: {
+        if (children.size() != 1)
+            return fail("return needs 1 child");
+        auto retBody = takeExpr(index, children[0]);
+        if (!retBody)
+            return false;
+        Stmts[index] = std::make_unique<ReturnStmtAST>(range, std::move(retBody));
+        return true;
+    }
+    case bin_function: {
+        if (children.empty())
+            return fail("function without a prototype");
+        auto proto = takeProto(index, children[0]);
+        std::vector<std::unique_ptr<StmtAST>> body;
+        if (!proto || !takeStmts(index, children.drop_front(), body))
+            return false;
+        Stmts[index] = std::make_unique<FunctionAST>(range, std::move(proto), std::move(body));
+        return true;
+    }
+    case bin_extern: {
+        if (children.size() != 1)
+            return fail("extern needs a prototype");
+        auto proto = takeProto(index, children[0]);
+        if (!proto)
+            return false;
+        Stmts[index] = std::make_unique<ExternAST>(range, std::move(proto));
+        return true;
+    }
+    case bin_import:
+        Stmts[index] = std::make_unique<ImportStmtAST>(range, name);
+        return true;
+    case bin_expr_stmt: {
+        if (children.size() != 1)
+            return fail("expression statement needs 1 child");
+        auto expr = takeExpr(index, children[0]);
+        if (!expr)
+            return false;
+        Stmts[index] = std::make_unique<ExpressionStmtAST>(range, std::move(expr));
+        return true;
+    }
+    case bin_if: {
+        if (children.empty() || N.split < 1 || N.split > children.size())
+            return fail("bad if statement");
+        auto cond = takeExpr(index, children[0]);
+        std::vector<std::unique_ptr<StmtAST>> thenBody, elseBody;
+        if (!cond || !takeStmts(index, children.slice(1, N.split - 1), thenBody) ||
+            !takeStmts(index, children.drop_front(N.split), elseBody))
+            return false;
+        Stmts[index] = std::make_unique<IfStmtAST>(range, std::move(cond), std::move(thenBody), std::move(elseBody));
+        return true;
+    }
+    case bin_for: {
+        if (children.size() < 3)
+            return fail("for loop needs start, end and step");
+        auto start = takeExpr(index, children[0]);
+        auto end = takeExpr(index, children[1]);
+        auto step = takeExpr(index, children[2]);
+        std::vector<std::unique_ptr<StmtAST>> body;
+        if (!start || !end || !step || !takeStmts(index, children.drop_front(3), body))
+            return false;
+        Stmts[index] = std::make_unique<ForStmtAST>(range, name, std::move(start), std::move(end),
+                                                    std::move(step), std::move(body));
+        return true;
+    }
+    default:
+        return fail("unknown node kind");
+    }
+}
+
+std::unique_ptr<LemonAST> ASTBinLoader::load() {
+    if (File.size() < sizeof(H)) {
+        fail("truncated header");
+        return nullptr;
+    }
+    memcpy(&H, File.data(), sizeof(H));
+
+    if (H.byteOrder != AST_BIN_BYTE_ORDER) {
+        fail("written on a machine with another byte order");
+        return nullptr;
+    }
+    if (H.version != AST_BIN_VERSION) {
+        fail("written by another version of lemon, run --emit-ast-bin again");
+        return nullptr;
+    }
+    if (!inFile<ASTBinNode>(H.nodesOffset, H.numNodes) ||
+        !inFile<uint32_t>(H.childrenOffset, H.numChildren) ||
+        !inFile<ASTBinString>(H.stringsOffset, H.numStrings) ||
+        !inFile<char>(H.stringDataOffset, H.stringDataSize) ||
+        !inFile<char>(H.sourceOffset, H.sourceSize) || H.sourceSize > UINT32_MAX) {
+        fail("truncated file");
+        return nullptr;
+    }
+
+    Exprs.resize(H.numNodes);
+    Stmts.resize(H.numNodes);
+    Protos.resize(H.numNodes);
+
+    SmallVector<uint32_t, 16> children;
+    for (uint32_t i = 0; i < H.numNodes; ++i) {
+        auto N = read<ASTBinNode>(H.nodesOffset, i);
+        if (N.first > H.numChildren || N.count > H.numChildren - N.first) {
+            fail("child list out of range");
+            return nullptr;
+        }
+        if (N.range.Begin > N.range.End || N.range.End > H.sourceSize) {
+            fail("source range out of range");
+            return nullptr;
+        }
+
+        children.clear();
+        for (uint32_t c = 0; c < N.count; ++c)
+            children.push_back(read<uint32_t>(H.childrenOffset, N.first + c));
+
+        // The program comes last, and only once.
+        if (Program || (N.kind == bin_program && i != H.numNodes - 1)) {
+            fail("program node isn't the last one");
+            return nullptr;
+        }
+        if (!build(i, N, children))
+            return nullptr;
+    }
+
+    if (!Program)
+        fail("no program node");
+    return std::move(Program);
+}
+
+std::unique_ptr<LemonAST> loadASTBinary(FrontEnd &S, MemoryBuffer &buffer) {
+    ASTBinLoader Loader(buffer.getBuffer());
+    auto Program = Loader.load();
+
+    std::string sourceName;
+    if (Program && !Loader.getSourceName(sourceName))
+        Program = nullptr;
+    if (!Program) {
+        fprintf(stderr, "🍋 %s: not a valid AST binary: %s.\n",
+                buffer.getBufferIdentifier().str().c_str(), Loader.Error);
+        return nullptr;
+    }
+
+    // Diagnostics and debug info point at the original file.
+    StringRef source = Loader.source();
+    S.Lex.SourceFileName = sourceName;
+    S.Lex.setSource(source.begin(), source.end());
+    return Program;
+}
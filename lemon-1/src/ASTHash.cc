@@ -0,0 +1,131 @@
+#include "../include/AST.h"
+
+// Every node starts with its own kind char, lists with their length, so
+// two different trees can't produce the same byte stream.
+
+static void hashStatements(ASTHasher &H, std::vector<std::unique_ptr<StmtAST>> &statements) {
+    H.addInt(statements.size());
+    for (auto &statement : statements)
+        statement->hash(H);
+}
+
+static void hashExprs(ASTHasher &H, std::vector<std::unique_ptr<ExprAST>> &exprs) {
+    H.addInt(exprs.size());
+    for (auto &expr : exprs)
+        expr->hash(H);
+}
+
+void LemonAST::hash(ASTHasher &H) {
+    H.addKind('L');
+    hashStatements(H, statements);
+}
+
+void BinaryExprAST::hash(ASTHasher &H) {
+    H.addKind('B');
+    H.addInt(op);
+    LHS->hash(H);
+    RHS->hash(H);
+}
+
+void UnaryExprAST::hash(ASTHasher &H) {
+    H.addKind('U');
+    H.addInt(op);
+    operand->hash(H);
+}
+
+void NumberExprAST::hash(ASTHasher &H) {
+    H.addKind('N');
+    H.addNumber(val);
+}
+
+void VariableExprAST::hash(ASTHasher &H) {
+    H.addKind('V');
+    H.addString(varName);
+    H.Variables.insert(varName);
+}
+
+void IndexExprAST::hash(ASTHasher &H) {
+    H.addKind('I');
+    H.addString(tensorName);
+    hashExprs(H, indices);
+}
+
+void CallExprAST::hash(ASTHasher &H) {
+    H.addKind('C');
+    H.addString(callee);
+    H.Callees.insert(callee);
+    hashExprs(H, args);
+}
+
+void PrototypeAST::hash(ASTHasher &H) {
+    H.addKind('P');
+    H.addString(name);
+    H.addInt(args.size());
+    for (auto &arg : args)
+        H.addString(arg);
+    H.addString(argTypes);
+}
+
+void VariableDeclStmt::hash(ASTHasher &H) {
+    H.addKind('D');
+    H.addString(varName);
+    H.addInt(defBody != nullptr);
+    if (defBody)
+        defBody->hash(H);
+}
+
+void AssignmentStmt::hash(ASTHasher &H) {
+    H.addKind('A');
+    H.addString(varName);
+    H.Variables.insert(varName);
+    defBody->hash(H);
+}
+
+void IndexAssignStmt::hash(ASTHasher &H) {
+    H.addKind('X');
+    H.addString(tensorName);
+    hashExprs(H, indices);
+    defBody->hash(H);
+}
+
+void ReturnStmtAST::hash(ASTHasher &H) {
+    H.addKind('R');
+    retBody->hash(H);
+}
+
+void FunctionAST::hash(ASTHasher &H) {
+    H.addKind('F');
+    proto->hash(H);
+    hashStatements(H, functionBody);
+}
+
+void ExternAST::hash(ASTHasher &H) {
+    H.addKind('E');
+    proto->hash(H);
+}
+
+void ImportStmtAST::hash(ASTHasher &H) {
+    H.addKind('M');
+    H.addString(path);
+}
+
+void ExpressionStmtAST::hash(ASTHasher &H) {
+    H.addKind('S');
+    expr->hash(H);
+}
+
+void IfStmtAST::hash(ASTHasher &H) {
+    H.addKind('?');
+    cond->hash(H);
+    hashStatements(H, thenBody);
+    hashStatements(H, elseBody);
+}
+
+void ForStmtAST::hash(ASTHasher &H) {
+    H.addKind('O');
+    H.addString(iterator);
+    start->hash(H);
+    end->hash(H);
+    step->hash(H);
+    hashStatements(H, forBody);
+}
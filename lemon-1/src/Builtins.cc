@@ -0,0 +1,64 @@
+#include "../include/Builtins.h"
+#include "../include/Parser.h"
+#include "../include/AST.h"
+
+#include "llvm/IR/Intrinsics.h"
+
+// name -> (intrinsic, # of args)
+// not_intrinsic means there is no llvm.* intrinsic for it (tanh), so it goes
+// to libm instead, declared readnone so LLVM still treats it as a math call.
+struct BuiltinInfo {
+    Intrinsic::ID id;
+    unsigned numArgs;
+};
+
+static const std::map<std::string, BuiltinInfo> Builtins = {
+    {"sqrt", {Intrinsic::sqrt, 1}},
+    {"exp",  {Intrinsic::exp, 1}},
+    {"log",  {Intrinsic::log, 1}},
+    {"sin",  {Intrinsic::sin, 1}},
+    {"cos",  {Intrinsic::cos, 1}},
+    {"tanh", {Intrinsic::not_intrinsic, 1}},
+    {"pow",  {Intrinsic::pow, 2}},
+    {"fma",  {Intrinsic::fma, 3}},
+    {"abs",  {Intrinsic::fabs, 1}},
+    {"min",  {Intrinsic::minnum, 2}},
+    {"max",  {Intrinsic::maxnum, 2}},
+};
+
+bool isBuiltin(const std::string &name) {
+    return Builtins.count(name);
+}
+
+Value *codegenBuiltin(CompilerSession &S,
+                      IRBuilder<> *TmpBuilder, 
+                      SourceRange range,
+                      const std::string &name, 
+                      std::vector<Value *> &args) {
+    auto it = Builtins.find(name);
+    if (it == Builtins.end())
+        return S.LogErrorV(range, "Unknown builtin referenced.");
+    
+    const BuiltinInfo &info = it->second;
+    if (info.numArgs != args.size()) {
+        std::string errorStr = "Incorrect # of arguments passed to builtin (" + name + ").";
+        return S.LogErrorV(range, errorStr.c_str());
+    }
+
+    Type *DoubleTy = Type::getDoubleTy(*S.TheContext);
+    Function *F;
+
+    if (info.id != Intrinsic::not_intrinsic) {
+        F = Intrinsic::getDeclaration(S.TheModule.get(), info.id, {DoubleTy});
+    } else {
+        std::vector<Type*> doubles(info.numArgs, DoubleTy);
+        FunctionType *FT = FunctionType::get(DoubleTy, doubles, false);
+
+        F = cast<Function>(S.TheModule->getOrInsertFunction(name, FT).getCallee());
+        F->setDoesNotAccessMemory();
+        F->setDoesNotThrow();
+        F->setWillReturn();
+    }
+
+    return TmpBuilder->CreateCall(F, args, name + "tmp");
+}
@@ -1,35 +1,14 @@
 #include "../include/Lexer.h"
 #include "../include/Parser.h"
 #include "../include/AST.h"
+#include "../include/CompilerSession.h"
+#include "../include/Builtins.h"
+#include "../include/MultiVersion.h"
+#include "../include/Instrument.h"
+#include "../include/FunctionCache.h"
 
 using namespace llvm;
 
-std::unique_ptr<LLVMContext> TheContext;
-std::unique_ptr<IRBuilder<>> Builder; 
-
-std::unique_ptr<IRBuilder<>> GlobalVariableBuilder;
-std::unique_ptr<IRBuilder<>> MainBuilder;
-std::unique_ptr<IRBuilder<>> FunctionBuilder;
-
-std::unique_ptr<Module> TheModule;
-std::map<std::string, std::map<std::string, AllocaInst*>> SymbolTable;  // SymbolTable for each scope.
-std::stack<std::string> ScopeStack;
-std::map<std::string, GlobalVariable*> GlobalVariables;                 // Global variables
-std::map<std::string, std::unique_ptr<PrototypeAST>> FunctionProtos;    // Function signatures
-
-int LoopScopeCounter;
-
-// Optimization Vars
-std::unique_ptr<FunctionPassManager> TheFPM;
-std::unique_ptr<LoopAnalysisManager> TheLAM;
-std::unique_ptr<FunctionAnalysisManager> TheFAM;
-std::unique_ptr<CGSCCAnalysisManager> TheCGAM;
-std::unique_ptr<ModuleAnalysisManager> TheMAM;
-std::unique_ptr<PassInstrumentationCallbacks> ThePIC;
-std::unique_ptr<StandardInstrumentations> TheSI;
-
-std::unique_ptr<LemonJIT> TheJIT;
-
 int nextGlobalPriority = 0;
 
 // Codegen Definitions
@@ -43,29 +22,30 @@ void dbug() {
     fprintf(stderr, "%s", toPrint.c_str());    
 }
 
-Value *LemonAST::codegen(const std::string scope) {
+Value *LemonAST::codegen(CompilerSession &S, const std::string scope) {
     // fprintf(stderr, "# Lemon Codegen Started\n");
-    const int totalStatements = statements.size();
-    int i = 0;
-    for (auto &statement : statements) {
-        Value *stmtVal = statement->codegen(scope);
-        if (i == totalStatements-1) {
-            MainBuilder->CreateRet(stmtVal);
-        }
-        i++;
-    }
+    Value *stmtVal = nullptr;
+    for (auto &statement : statements)
+        stmtVal = statement->codegen(S, scope);
+
+    // lemon_main returns the value of the last statement. Declarations,
+    // loops and functions don't have one, return 0.
+    if (!stmtVal || !stmtVal->getType()->isDoubleTy())
+        stmtVal = ConstantFP::get(*S.TheContext, APFloat(0.0));
+    S.MainBuilder->CreateRet(stmtVal);
     return nullptr;
 }
 
-Value *BinaryExprAST::codegen(const std::string scope) {
-    Value *L = LHS->codegen(scope);
-    Value *R = RHS->codegen(scope);
+Value *BinaryExprAST::codegen(CompilerSession &S, const std::string scope) {
+    Value *L = LHS->codegen(S, scope);
+    Value *R = RHS->codegen(S, scope);
 
     if (!L || !R)
         return nullptr;
   
     // TODO: Definitely need to refactor this.... use better methods...........
-    IRBuilder<> *TmpBuilder = (scope == "_global") ? MainBuilder.get() : Builder.get();
+    IRBuilder<> *TmpBuilder = (scope == "_global") ? S.MainBuilder.get() : S.Builder.get();
+    S.emitLocation(TmpBuilder, getRange());
         
     switch (op) {
     case tok_add:
@@ -78,104 +58,235 @@ Value *BinaryExprAST::codegen(const std::string scope) {
         return TmpBuilder->CreateFDiv(L, R, "divtmp");
     case tok_lt:
         L = TmpBuilder->CreateFCmpULT(L, R, "cmptmp_lt");
-        return TmpBuilder->CreateUIToFP(L, Type::getDoubleTy(*TheContext), "booltmp_lt");
+        return TmpBuilder->CreateUIToFP(L, Type::getDoubleTy(*S.TheContext), "booltmp_lt");
     case tok_gt:
         L = TmpBuilder->CreateFCmpUGT(L, R, "cmptmp_gt");
-        return TmpBuilder->CreateUIToFP(L, Type::getDoubleTy(*TheContext), "booltmp_gt");
+        return TmpBuilder->CreateUIToFP(L, Type::getDoubleTy(*S.TheContext), "booltmp_gt");
     case tok_le:
         L = TmpBuilder->CreateFCmpULE(L, R, "cmptmp_le");
-        return TmpBuilder->CreateUIToFP(L, Type::getDoubleTy(*TheContext), "booltmp_le");
+        return TmpBuilder->CreateUIToFP(L, Type::getDoubleTy(*S.TheContext), "booltmp_le");
     case tok_ge:
         L = TmpBuilder->CreateFCmpUGE(L, R, "cmptmp_ge");
-        return TmpBuilder->CreateUIToFP(L, Type::getDoubleTy(*TheContext), "booltmp_ge");
+        return TmpBuilder->CreateUIToFP(L, Type::getDoubleTy(*S.TheContext), "booltmp_ge");
     case tok_eq:
         L = TmpBuilder->CreateFCmpUEQ(L, R, "cmptmp_eq");
-        return TmpBuilder->CreateUIToFP(L, Type::getDoubleTy(*TheContext), "booltmp_eq");
+        return TmpBuilder->CreateUIToFP(L, Type::getDoubleTy(*S.TheContext), "booltmp_eq");
+    case tok_neq:
+        L = TmpBuilder->CreateFCmpUNE(L, R, "cmptmp_neq");
+        return TmpBuilder->CreateUIToFP(L, Type::getDoubleTy(*S.TheContext), "booltmp_neq");
 
     default:
-        return LogErrorV("Invalid Binary Operator.");
+        return S.LogErrorV(getRange(), "Invalid Binary Operator.");
     }
 }
 
-Value *NumberExprAST::codegen(const std::string scope) {
-    return ConstantFP::get(*TheContext, APFloat(val));
-}
+Value *UnaryExprAST::codegen(CompilerSession &S, const std::string scope) {
+    Value *V = operand->codegen(S, scope);
+    if (!V)
+        return nullptr;
 
-Value *VariableExprAST::codegen(const std::string scope) {
-    AllocaInst* A = SymbolTable[scope][varName];
-    GlobalVariable* GV = GlobalVariables[varName];
+    IRBuilder<> *TmpBuilder = (scope == "_global") ? S.MainBuilder.get() : S.Builder.get();
+    S.emitLocation(TmpBuilder, getRange());
 
-    if (A) {
-        if (scope == "_global")
-            return MainBuilder->CreateLoad(A->getAllocatedType(), A, varName.c_str());
-        return Builder->CreateLoad(A->getAllocatedType(), A, varName.c_str());
+    switch (op) {
+    case tok_sub:
+        return TmpBuilder->CreateFNeg(V, "negtmp");
+    case tok_not:
+        // Exact negation of the test if uses (ONE 0.0), so !NaN is 1 like !0.
+        V = TmpBuilder->CreateFCmpUEQ(V, ConstantFP::get(*S.TheContext, APFloat(0.0)), "nottmp");
+        return TmpBuilder->CreateUIToFP(V, Type::getDoubleTy(*S.TheContext), "booltmp_not");
+
+    default:
+        return S.LogErrorV(getRange(), "Invalid Unary Operator.");
     }
-    else if (GV) {
-        if (scope == "_global")
-            return MainBuilder->CreateLoad(GV->getValueType(), GV, varName.c_str());
-        return Builder->CreateLoad(GV->getValueType(), GV, varName.c_str());
+}
+
+Value *NumberExprAST::codegen(CompilerSession &S, const std::string scope) {
+    return ConstantFP::get(*S.TheContext, APFloat(val));
+}
+
+Value *VariableExprAST::codegen(CompilerSession &S, const std::string scope) {
+    if (S.Tensors[scope].count(varName)) {
+        std::string errorStr = "(" + varName + ") is a tensor, index it (" + varName + "[i]) or pass it to a tensor argument.";
+        return S.LogErrorV(getRange(), errorStr.c_str());
     }
+
+    IRBuilder<> *TmpBuilder = (scope == "_global") ? S.MainBuilder.get() : S.Builder.get();
+    if (Value *V = S.readLocal(TmpBuilder, scope, varName))
+        return V;
+
+    GlobalVariable* GV = S.GlobalVariables[varName];
+    if (GV)
+        return TmpBuilder->CreateLoad(GV->getValueType(), GV, varName.c_str());
+
     std::string errorStr = "Unknown variable name (" + varName + ") referenced in Scope: (" + scope + ").";
-    return LogErrorV(errorStr.c_str());
+    return S.LogErrorV(getRange(), errorStr.c_str());
+}
+
+// Address of tensor[indices...]: data + sum(index_k * strides[k]).
+// Indices are truncated to integers, nothing is bounds checked.
+static Value *tensorElementPtr(CompilerSession &S, const std::string &scope, SourceRange range,
+                              const std::string &tensorName, 
+                              std::vector<std::unique_ptr<ExprAST>> &indices) {
+    Value *Desc = S.Tensors[scope][tensorName];
+    if (!Desc) {
+        std::string errorStr = "Unknown tensor (" + tensorName + ") referenced in Scope: (" + scope + ").";
+        return S.LogErrorV(range, errorStr.c_str());
+    }
+
+    IRBuilder<> *TmpBuilder = (scope == "_global") ? S.MainBuilder.get() : S.Builder.get();
+    StructType *TensorTy = S.getTensorType();
+    Type *I64 = Type::getInt64Ty(*S.TheContext);
+
+    Value *Offset = ConstantInt::get(I64, 0);
+    for (unsigned k = 0; k < indices.size(); ++k) {
+        Value *idx = indices[k]->codegen(S, scope);
+        if (!idx)
+            return nullptr;
+        idx = TmpBuilder->CreateFPToSI(idx, I64, "idx");
+
+        Value *StridePtr = TmpBuilder->CreateStructGEP(TensorTy, Desc, 3);
+        StridePtr = TmpBuilder->CreateConstInBoundsGEP2_64(TensorTy->getElementType(3), StridePtr, 0, k);
+        Value *Stride = TmpBuilder->CreateLoad(I64, StridePtr, "stride");
+        Offset = TmpBuilder->CreateAdd(Offset, TmpBuilder->CreateMul(idx, Stride), "offset");
+    }
+
+    Value *DataPtr = TmpBuilder->CreateStructGEP(TensorTy, Desc, 0);
+    Value *Data = TmpBuilder->CreateLoad(TensorTy->getElementType(0), DataPtr, "data");
+    return TmpBuilder->CreateInBoundsGEP(Type::getDoubleTy(*S.TheContext), Data, Offset, "elem");
+}
+
+Value *IndexExprAST::codegen(CompilerSession &S, const std::string scope) {
+    Value *ElemPtr = tensorElementPtr(S, scope, getRange(), tensorName, indices);
+    if (!ElemPtr)
+        return nullptr;
+
+    IRBuilder<> *TmpBuilder = (scope == "_global") ? S.MainBuilder.get() : S.Builder.get();
+    return TmpBuilder->CreateLoad(Type::getDoubleTy(*S.TheContext), ElemPtr, tensorName.c_str());
+}
+
+// dim(t, k): size of dimension k of tensor t.
+static Value *codegenDim(CompilerSession &S, const std::string &scope, SourceRange range,
+                         std::vector<std::unique_ptr<ExprAST>> &args) {
+    auto *Var = args.size() == 2 ? dynamic_cast<VariableExprAST *>(args[0].get()) : nullptr;
+    Value *Desc = Var ? S.Tensors[scope][Var->getVarName()] : nullptr;
+    if (!Desc)
+        return S.LogErrorV(range, "dim() takes a tensor and a dimension: dim(t, k).");
+
+    Value *k = args[1]->codegen(S, scope);
+    if (!k)
+        return nullptr;
+    if (auto *C = dyn_cast<ConstantFP>(k)) {
+        double v = C->getValueAPF().convertToDouble();
+        if (!(v > -1 && v < TENSOR_MAX_RANK))
+            return S.LogErrorV(args[1]->getRange(), "dim(): tensors have dimensions 0 to 3.");
+    }
+
+    IRBuilder<> *TmpBuilder = (scope == "_global") ? S.MainBuilder.get() : S.Builder.get();
+    StructType *TensorTy = S.getTensorType();
+    Type *I64 = Type::getInt64Ty(*S.TheContext);
+    Type *Dbl = Type::getDoubleTy(*S.TheContext);
+
+    // k indexes shape[], so check it against the rank (and the array, in
+    // case the host's rank is garbage) before loading. The compares are on
+    // doubles so NaN and huge k fail them too. Out of range: dim is 0.
+    Value *Rank = TmpBuilder->CreateLoad(I64, TmpBuilder->CreateStructGEP(TensorTy, Desc, 1), "rank");
+    Value *K = TmpBuilder->CreateUnaryIntrinsic(Intrinsic::trunc, k);
+    Value *Zero = ConstantFP::get(Dbl, 0.0);
+    Value *InRange = TmpBuilder->CreateAnd(
+        TmpBuilder->CreateAnd(TmpBuilder->CreateFCmpOGE(K, Zero),
+                              TmpBuilder->CreateFCmpOLT(K, ConstantFP::get(Dbl, TENSOR_MAX_RANK))),
+        TmpBuilder->CreateFCmpOLT(K, TmpBuilder->CreateSIToFP(Rank, Dbl)), "inrange");
+
+    Value *Idx = TmpBuilder->CreateFPToSI(TmpBuilder->CreateSelect(InRange, K, Zero), I64, "k");
+    Value *ShapePtr = TmpBuilder->CreateInBoundsGEP(TensorTy, Desc, 
+        {TmpBuilder->getInt32(0), TmpBuilder->getInt32(2), Idx});
+    Value *Dim = TmpBuilder->CreateLoad(I64, ShapePtr, "dim");
+    Dim = TmpBuilder->CreateSelect(InRange, Dim, ConstantInt::get(I64, 0));
+    return TmpBuilder->CreateSIToFP(Dim, Dbl, "dimtmp");
 }
 
-Value *CallExprAST::codegen(const std::string scope) {
-    Function *calleeF = getFunction(callee, scope);
+Value *CallExprAST::codegen(CompilerSession &S, const std::string scope) {
+    Function *calleeF = S.getFunction(callee, scope);
+    IRBuilder<> *TmpBuilder = (scope == "_global") ? S.MainBuilder.get() : S.Builder.get();
+
+    if (!calleeF && callee == "dim")
+        return codegenDim(S, scope, getRange(), args);
+
+    // No user function by that name, try the builtin math library.
+    if (!calleeF && isBuiltin(callee)) {
+        std::vector<Value *> argsValue;
+        for (auto &arg : args) {
+            Value *evaluated = arg->codegen(S, scope);
+            if (!evaluated)
+                return nullptr;
+            argsValue.push_back(evaluated);
+        }
+
+        S.emitLocation(TmpBuilder, getRange());
+        return codegenBuiltin(S, TmpBuilder, getRange(), callee, argsValue);
+    }
 
     if (!calleeF) 
-        return LogErrorV("Unknown function referenced.");
+        return S.LogErrorV(getRange(), "Unknown function referenced.");
 
     if (calleeF->arg_size() != args.size())
-        return LogErrorV("Incorrect # of arguments passed.");
+        return S.LogErrorV(getRange(), "Incorrect # of arguments passed.");
 
     std::vector<Value *> argsValue;
     // Generating IR to evaluate all arguments first
     int arg_sz = args.size();
     for (int i = 0; i < arg_sz; ++i) {
-        Value *evaluated = args[i]->codegen(scope);
+        // Tensor args take the caller's descriptor as is, the callee sees the same buffer.
+        if (calleeF->getArg(i)->getType()->isPointerTy()) {
+            auto *Var = dynamic_cast<VariableExprAST *>(args[i].get());
+            Value *Desc = Var ? S.Tensors[scope][Var->getVarName()] : nullptr;
+            if (!Desc)
+                return S.LogErrorV(args[i]->getRange(), "Expected a tensor argument.");
+            argsValue.push_back(Desc);
+            continue;
+        }
+
+        Value *evaluated = args[i]->codegen(S, scope);
         if (!evaluated)
             return nullptr;
         argsValue.push_back(evaluated);
     }
 
-    if (scope == "_global") {
-        return MainBuilder->CreateCall(calleeF, argsValue, "calltmp");
-    }
-
-    return Builder->CreateCall(calleeF, argsValue, "calltmp");
+    // Args may have moved the location, point it back at the call.
+    S.emitLocation(TmpBuilder, getRange());
+    return TmpBuilder->CreateCall(calleeF, argsValue, "calltmp");
 }
 
-Value *VariableDeclStmt::codegen(const std::string scope) {
-    if (scope == "_global")
-        return codegen_global();
+Value *VariableDeclStmt::codegen(CompilerSession &S, const std::string scope) {
+    if (scope == "_global") {
+        S.emitLocation(S.MainBuilder.get(), getRange());
+        return codegen_global(S);
+    }
 
-    Function *TheFunction = Builder->GetInsertBlock()->getParent();
+    S.emitLocation(S.Builder.get(), getRange());
 
     Value *initVal;
 
     if (defBody) {
-        initVal = defBody->codegen(scope);
+        initVal = defBody->codegen(S, scope);
         if (!initVal)
             return nullptr;
     } else {
         // If not specified, default to 0.0.
-        initVal = ConstantFP::get(*TheContext, APFloat(0.0)); 
+        initVal = ConstantFP::get(*S.TheContext, APFloat(0.0)); 
     }
 
-    AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, varName);
-    Builder->CreateStore(initVal, Alloca);
-
-    SymbolTable[scope][varName] = Alloca;
-
-    return Alloca;
+    S.declareLocal(S.Builder.get(), scope, varName, initVal, getRange());
+    return initVal;
 }
 
-Value *VariableDeclStmt::codegen_global() {
+Value *VariableDeclStmt::codegen_global(CompilerSession &S) {
 
     // Initialize with constant 0.0, then call initializer function on program startup
-    Constant *dummy_constant = ConstantFP::get(*TheContext, APFloat(0.0));
-    GlobalVariable *GV = new GlobalVariable(*TheModule, 
-                                            Type::getDoubleTy(*TheContext), 
+    Constant *dummy_constant = ConstantFP::get(*S.TheContext, APFloat(0.0));
+    GlobalVariable *GV = new GlobalVariable(*S.TheModule, 
+                                            Type::getDoubleTy(*S.TheContext), 
                                             false, 
                                             GlobalValue::ExternalLinkage, 
                                             dummy_constant, 
@@ -190,170 +301,193 @@ Value *VariableDeclStmt::codegen_global() {
         std::string initFuncScope = "_init_global_" + varName;
 
         FunctionType *FT = FunctionType::get(
-            Type::getVoidTy(*TheContext), 
+            Type::getVoidTy(*S.TheContext), 
             false
         );
         
         // Internal linkage, no need for cross-module
         Function *F = Function::Create(
             FT, 
-            Function::ExternalLinkage,     
+            Function::InternalLinkage,     
             initFuncScope, 
-            TheModule.get()
+            S.TheModule.get()
         );
         
         // Basic block:
-        BasicBlock *BB = BasicBlock::Create(*TheContext, "entry", F);
+        BasicBlock *BB = BasicBlock::Create(*S.TheContext, "entry", F);
 
         // User tmp builder to build inside init func.
         std::unique_ptr<IRBuilder<>> TmpBuilder = std::make_unique<IRBuilder<>>(BB);  
-        swap(TmpBuilder, Builder); // Swap the old builder with the new one.
+        swap(TmpBuilder, S.Builder); // Swap the old builder with the new one.
 
-        Builder->SetInsertPoint(BB);
+        S.Builder->SetInsertPoint(BB);
+        S.emitSubprogram(F, getRange(), true);
+        S.emitLocation(S.Builder.get(), getRange());
 
-        Value *initVal = defBody->codegen(initFuncScope);
+        Value *initVal = defBody->codegen(S, initFuncScope);
         if (!initVal) {
             F->eraseFromParent();
             return nullptr;
         }
 
         // Store to global:
-        Builder->CreateStore(initVal, GV);
-        Builder->CreateRetVoid();
+        S.Builder->CreateStore(initVal, GV);
+        S.Builder->CreateRetVoid();
 
-        swap(TmpBuilder, Builder); // Swap back the old builder.
+        swap(TmpBuilder, S.Builder); // Swap back the old builder.
         
         // Optimizations
-        TheFPM->run(*F, *TheFAM);
+        S.TheFPM->run(*F, *S.TheFAM);
 
         // llvm::appendToGlobalCtors 
         // Referenced from: https://llvm.org/doxygen/ModuleUtils_8h.html
         // DEACTIVATED, currently init'ing global vars via function calls in lemon_main
-        // appendToGlobalCtors(*TheModule, F, nextGlobalPriority++);
+        // appendToGlobalCtors(*S.TheModule, F, nextGlobalPriority++);
 
         // Add it to table
-        GlobalVariables[varName] = GV;
+        S.GlobalVariables[varName] = GV;
         
         // Call init function in main
         std::string initFuncName = initFuncScope;
-        Function *calleeF = getFunction(initFuncName);  // Should get directly from TheModule
-        MainBuilder->CreateCall(calleeF, std::vector<Value*>(), "init_calltmp");
+        Function *calleeF = S.getFunction(initFuncName);  // Should get directly from TheModule
+        S.MainBuilder->CreateCall(calleeF, std::vector<Value*>(), "init_calltmp");
     }
 
     return GV;
 }
 
-Value *AssignmentStmt::codegen(const std::string scope) {
-    Value *newVal = defBody->codegen(scope);
+Value *AssignmentStmt::codegen(CompilerSession &S, const std::string scope) {
+    IRBuilder<> *TmpBuilder = (scope == "_global") ? S.MainBuilder.get() : S.Builder.get();
+    S.emitLocation(TmpBuilder, getRange());
+    Value *newVal = defBody->codegen(S, scope);
     
     if (!newVal)
         return nullptr;
 
-    Value *variable = SymbolTable[scope][varName];
-    if (!variable)
-        variable = GlobalVariables[varName];
+    if (S.isLocal(scope, varName)) {
+        S.writeLocal(TmpBuilder, scope, varName, newVal);
+        return newVal;
+    }
+
+    GlobalVariable *GV = S.GlobalVariables[varName];
+    if (!GV)
+        return S.LogErrorV(getRange(), "Unknown variable name referenced in assignment operator.");
+
+    TmpBuilder->CreateStore(newVal, GV);
+    return newVal;
+}
+
+Value *IndexAssignStmt::codegen(CompilerSession &S, const std::string scope) {
+    S.emitLocation((scope == "_global") ? S.MainBuilder.get() : S.Builder.get(), getRange());
+    Value *newVal = defBody->codegen(S, scope);
+    if (!newVal)
+        return nullptr;
 
-    if (!variable)
-        return LogErrorV("Unknown variable name referenced in assignment operator.");
+    Value *ElemPtr = tensorElementPtr(S, scope, getRange(), tensorName, indices);
+    if (!ElemPtr)
+        return nullptr;
 
     if (scope == "_global") 
-        MainBuilder->CreateStore(newVal, variable);
+        S.MainBuilder->CreateStore(newVal, ElemPtr);
     else    
-        Builder->CreateStore(newVal, variable);
+        S.Builder->CreateStore(newVal, ElemPtr);
 
     return newVal;
 }
 
-Value *ReturnStmtAST::codegen(const std::string scope) {
-    Value *retV = retBody->codegen(scope);
+Value *ReturnStmtAST::codegen(CompilerSession &S, const std::string scope) {
+    S.emitLocation((scope == "_global") ? S.MainBuilder.get() : S.Builder.get(), getRange());
+    Value *retV = retBody->codegen(S, scope);
     return retV;
 }
 
-Value *ExpressionStmtAST::codegen(const std::string scope) {
-    return expr->codegen(scope);
+Value *ExpressionStmtAST::codegen(CompilerSession &S, const std::string scope) {
+    S.emitLocation((scope == "_global") ? S.MainBuilder.get() : S.Builder.get(), getRange());
+    return expr->codegen(S, scope);
 }
 
-Value *IfStmtAST::codegen(const std::string scope) {
-    Value *condV = cond->codegen(scope);
+Value *IfStmtAST::codegen(CompilerSession &S, const std::string scope) {
+    S.emitLocation((scope == "_global") ? S.MainBuilder.get() : S.Builder.get(), getRange());
+    Value *condV = cond->codegen(S, scope);
 
     if (!condV)
         return nullptr;
     
     // TODO: Need a better way to handle builders... this is tedious!
     if (scope == "_global")             
-        swap(Builder, MainBuilder);
+        swap(S.Builder, S.MainBuilder);
 
-    condV = Builder->CreateFCmpONE(
+    condV = S.Builder->CreateFCmpONE(
         condV, 
-        ConstantFP::get(*TheContext, APFloat(0.0)), 
+        ConstantFP::get(*S.TheContext, APFloat(0.0)), 
         "ifcond"
     );
 
-    Function *TheFunction = Builder->GetInsertBlock()->getParent();
+    Function *TheFunction = S.Builder->GetInsertBlock()->getParent();
     BasicBlock *ThenBB = 
-        BasicBlock::Create(*TheContext, "then", TheFunction);
+        BasicBlock::Create(*S.TheContext, "then", TheFunction);
     BasicBlock *ElseBB = 
-        BasicBlock::Create(*TheContext, "else");
+        BasicBlock::Create(*S.TheContext, "else");
     BasicBlock *MergeBB = 
-        BasicBlock::Create(*TheContext, "ifcont");
+        BasicBlock::Create(*S.TheContext, "ifcont");
     
-    Builder->CreateCondBr(condV, ThenBB, ElseBB);
+    S.Builder->CreateCondBr(condV, ThenBB, ElseBB);
 
     // Emitting THEN block
-    Builder->SetInsertPoint(ThenBB);
+    S.Builder->SetInsertPoint(ThenBB);
 
     if (scope == "_global")
-        swap(Builder, MainBuilder);
+        swap(S.Builder, S.MainBuilder);
     
     for (auto &stmt : thenBody) {
-        Value *thenStmtV = stmt->codegen(scope);
+        Value *thenStmtV = stmt->codegen(S, scope);
         if (!thenStmtV)
             return nullptr;
     }
     
     if (scope == "_global")
-        swap(Builder, MainBuilder);
+        swap(S.Builder, S.MainBuilder);
 
     // After THEN block, jump to MergeBB
-    Builder->CreateBr(MergeBB);
-    ThenBB = Builder->GetInsertBlock(); // Update ThenBB
+    S.Builder->CreateBr(MergeBB);
+    ThenBB = S.Builder->GetInsertBlock(); // Update ThenBB
 
     // Emitting ELSE block
     TheFunction->insert(TheFunction->end(), ElseBB);
-    Builder->SetInsertPoint(ElseBB);
+    S.Builder->SetInsertPoint(ElseBB);
 
     if (scope == "_global")
-        swap(Builder, MainBuilder);
+        swap(S.Builder, S.MainBuilder);
     
     for (auto &stmt : elseBody) {
-        Value *elseStmtV = stmt->codegen(scope);
+        Value *elseStmtV = stmt->codegen(S, scope);
         if (!elseStmtV)
             return nullptr;
     }
 
     if (scope == "_global")
-        swap(Builder, MainBuilder);
+        swap(S.Builder, S.MainBuilder);
     
-    Builder->CreateBr(MergeBB);
-    ElseBB = Builder->GetInsertBlock(); // Update ElseBB
+    S.Builder->CreateBr(MergeBB);
+    ElseBB = S.Builder->GetInsertBlock(); // Update ElseBB
 
     TheFunction->insert(TheFunction->end(), MergeBB);
-    Builder->SetInsertPoint(MergeBB);
+    S.Builder->SetInsertPoint(MergeBB);
 
     // Phinodes:
     PHINode *PN = 
-        Builder->CreatePHI(Type::getDoubleTy(*TheContext), 2, "iftmp");
+        S.Builder->CreatePHI(Type::getDoubleTy(*S.TheContext), 2, "iftmp");
 
-    PN->addIncoming(ConstantFP::get(*TheContext, APFloat(0.0)), ThenBB);
-    PN->addIncoming(ConstantFP::get(*TheContext, APFloat(0.0)), ElseBB);
+    PN->addIncoming(ConstantFP::get(*S.TheContext, APFloat(0.0)), ThenBB);
+    PN->addIncoming(ConstantFP::get(*S.TheContext, APFloat(0.0)), ElseBB);
     
     if (scope == "_global")
-        swap(Builder, MainBuilder);
+        swap(S.Builder, S.MainBuilder);
     
     return PN;
 }
 
-Value *ForStmtAST::codegen(const std::string scope) {
+Value *ForStmtAST::codegen(CompilerSession &S, const std::string scope) {
     // if global scope, generate local vars within main
     // if in func scope, generate local vars within func
 
@@ -369,84 +503,91 @@ Value *ForStmtAST::codegen(const std::string scope) {
     // afterloop:
     //
 
+    S.emitLocation((scope == "_global") ? S.MainBuilder.get() : S.Builder.get(), getRange());
+
     // Create iterator start value;
-    Value *startV = start->codegen(scope);
+    Value *startV = start->codegen(S, scope);
     if (!startV)
         return nullptr;
     
     if (scope == "_global")
-        swap(Builder, MainBuilder);
+        swap(S.Builder, S.MainBuilder);
     
     // Get parent block
-    Function* F = Builder->GetInsertBlock()->getParent();
+    Function* F = S.Builder->GetInsertBlock()->getParent();
     
-    AllocaInst *Alloca = CreateEntryBlockAlloca(F, iterator);
-    Builder->CreateStore(startV, Alloca);
-    SymbolTable[scope][iterator] = Alloca;
+    S.declareLocal(S.Builder.get(), scope, iterator, startV, getRange());
 
-    // Basic blocks
-    BasicBlock *LoopBB = BasicBlock::Create(*TheContext, "loop", F);
-    BasicBlock *AfterBB = BasicBlock::Create(*TheContext, "afterloop", F);
+    // Basic blocks. The loop's back edge comes after its body, until then
+    // locals read in there are incomplete phis.
+    BasicBlock *LoopBB = BasicBlock::Create(*S.TheContext, "loop", F);
+    BasicBlock *AfterBB = BasicBlock::Create(*S.TheContext, "afterloop", F);
+    S.UnsealedBlocks.insert(LoopBB);
     
     if (scope == "_global")
-        swap(Builder, MainBuilder);
+        swap(S.Builder, S.MainBuilder);
     
         // Calculate step value
-    Value *stepVal = step->codegen(scope);
+    Value *stepVal = step->codegen(S, scope);
 
     // Evaluate expression to a value
-    Value *endVal = end->codegen(scope);
+    Value *endVal = end->codegen(S, scope);
     if (!endVal)
         return nullptr;
 
     
     if (scope == "_global")
-        swap(Builder, MainBuilder);
+        swap(S.Builder, S.MainBuilder);
 
     // Compare current value & branch
-    Value *curVal = Builder->CreateLoad(Alloca->getAllocatedType(), Alloca, iterator.c_str());
-    Value *endCond = Builder->CreateFCmpULT(curVal, endVal, "loopcond");
-    Builder->CreateCondBr(endCond, LoopBB, AfterBB);
+    Value *curVal = S.readLocal(S.Builder.get(), scope, iterator);
+    Value *endCond = S.Builder->CreateFCmpULT(curVal, endVal, "loopcond");
+    S.Builder->CreateCondBr(endCond, LoopBB, AfterBB);
 
     // Loop body:
-    Builder->SetInsertPoint(LoopBB);
+    S.Builder->SetInsertPoint(LoopBB);
 
     if (scope == "_global")
-        swap(Builder, MainBuilder);
+        swap(S.Builder, S.MainBuilder);
     
     for (auto &stmt : forBody) {
-        stmt->codegen(scope);
+        stmt->codegen(S, scope);
     }
     
     if (scope == "_global")
-        swap(Builder, MainBuilder);
+        swap(S.Builder, S.MainBuilder);
 
     // Increment iterator
-    curVal = Builder->CreateLoad(Alloca->getAllocatedType(), Alloca, iterator.c_str());
-    Value *nextVal = Builder->CreateFAdd(curVal, stepVal, "nextval");
-    Builder->CreateStore(nextVal, Alloca);
+    curVal = S.readLocal(S.Builder.get(), scope, iterator);
+    Value *nextVal = S.Builder->CreateFAdd(curVal, stepVal, "nextval");
+    S.writeLocal(S.Builder.get(), scope, iterator, nextVal);
     
     // Check termination condition
-    endCond = Builder->CreateFCmpULT(nextVal, endVal, "loopcond");
-    Builder->CreateCondBr(endCond, LoopBB, AfterBB);
+    endCond = S.Builder->CreateFCmpULT(nextVal, endVal, "loopcond");
+    S.Builder->CreateCondBr(endCond, LoopBB, AfterBB);
+    S.sealBlock(LoopBB);
 
-    Builder->SetInsertPoint(AfterBB);
+    S.Builder->SetInsertPoint(AfterBB);
 
     if (scope == "_global")
-        swap(Builder, MainBuilder);
+        swap(S.Builder, S.MainBuilder);
 
     return nullptr;
 }
 
-Function *PrototypeAST::codegen(const std::string scope) {
+Function *PrototypeAST::codegen(CompilerSession &S, const std::string scope) {
     // fprintf(stderr, "Prototype codegen called in: (%s)\n", scope.c_str());
-    std::vector<Type*> doubles(args.size(), Type::getDoubleTy(*TheContext));
+    // Tensors are passed as a pointer to their descriptor.
+    std::vector<Type*> argTys;
+    for (char type : argTypes)
+        argTys.push_back(type == type_tensor ? (Type *)PointerType::getUnqual(*S.TheContext)
+                                             : Type::getDoubleTy(*S.TheContext));
 
     FunctionType *FT = 
-        FunctionType::get(Type::getDoubleTy(*TheContext), doubles, false);
+        FunctionType::get(Type::getDoubleTy(*S.TheContext), argTys, false);
 
     Function *F = 
-        Function::Create(FT, Function::ExternalLinkage, name, TheModule.get());
+        Function::Create(FT, Function::ExternalLinkage, name, S.TheModule.get());
     
     unsigned idx = 0;
     for (auto &arg : F->args()) 
@@ -455,90 +596,87 @@ Function *PrototypeAST::codegen(const std::string scope) {
     return F;
 }
 
-Value *FunctionAST::codegen(const std::string scope) {
+Value *FunctionAST::codegen(CompilerSession &S, const std::string scope) {
     // fprintf(stderr, "Function Codegen\n");
     // Should return Function *
     // But since Function class inherits from Value, it should be fine :)
     auto &p = *proto; // Save a ref to use later on in code
     std::string functionScope = "_" + p.getName();
 
-    FunctionProtos[proto->getName()] = std::move(proto);
-    Function *TheFunction = getFunction(p.getName(), scope);
+    // Compiled before (--cache-dir), the cached object has the body. Looked
+    // up before its own prototype is registered, callees only.
+    bool cached = S.FnCacheEnabled && lookupCachedFunction(S, *this);
 
-    if (!TheFunction)
-        return nullptr;
+    S.FunctionProtos[proto->getName()] = std::move(proto);
+    Function *TheFunction = S.getFunction(p.getName(), scope);
+
+    if (!TheFunction || cached)
+        return TheFunction;
     
-    BasicBlock *BB = BasicBlock::Create(*TheContext, "entry", TheFunction);
-    Builder->SetInsertPoint(BB); // Update builder to insert into function
+    BasicBlock *BB = BasicBlock::Create(*S.TheContext, "entry", TheFunction);
+    S.Builder->SetInsertPoint(BB); // Update builder to insert into function
+
+    // The builder still has the last location of the previous function.
+    S.emitSubprogram(TheFunction, p.getRange());
+    S.emitLocation(S.Builder.get(), p.getRange());
 
     // Adding arguments to function scope
+    unsigned argNo = 1;
     for (auto &arg : TheFunction->args()) {
-        AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, arg.getName());
+        // Tensors aren't copied or reassigned, no alloca.
+        if (arg.getType()->isPointerTy()) {
+            S.Tensors[functionScope][arg.getName().str()] = &arg;
+            argNo++;
+            continue;
+        }
 
-        Builder->CreateStore(&arg, Alloca);
-        
-        SymbolTable[functionScope][arg.getName().str()] = Alloca;
+        S.declareLocal(S.Builder.get(), functionScope, arg.getName().str(), &arg, p.getRange(), argNo++);
     }
 
     // Generating body
     if (functionBody.size() > 0) {
         for (int i = 0; i < functionBody.size(); ++i) {
-            Value *stmtVal = functionBody[i]->codegen(functionScope);
+            Value *stmtVal = functionBody[i]->codegen(S, functionScope);
 
             // Check if is return statement:
-            if (ReturnStmtAST* dPtr = dynamic_cast<ReturnStmtAST*>(functionBody[i].get())) {
-                Builder->CreateRet(stmtVal);
+            if (ReturnStmtAST* dPtr = dynamic_cast<ReturnStmtAST*>(functionBody[i].get()); dPtr && stmtVal) {
+                S.Builder->CreateRet(stmtVal);
             }
         }
-        Builder->CreateRet(ConstantFP::get(*TheContext, APFloat(0.0)));
+        S.Builder->CreateRet(ConstantFP::get(*S.TheContext, APFloat(0.0)));
+        S.forgetLocals(TheFunction);
 
         verifyFunction(*TheFunction);
 
+        if (PROFILE)
+            instrumentFunction(TheFunction);
+
         // Optimizations
-        TheFPM->run(*TheFunction, *TheFAM);
+        if (MULTIVERSION)
+            multiVersionFunction(TheFunction, *S.TheFPM, *S.TheFAM);
+        S.TheFPM->run(*TheFunction, *S.TheFAM);
 
         return TheFunction;
     }
 
     // Error occured, or doesn't have function body (?)
+    S.forgetLocals(TheFunction);
     TheFunction->eraseFromParent();
     return nullptr;
 }
 
-Value *ExternAST::codegen(const std::string scope) {
+Value *ImportStmtAST::codegen(CompilerSession &S, const std::string scope) {
+    // Already compiled by compileImports(), its prototypes are in the session's FunctionProtos.
+    return nullptr;
+}
+
+Value *ExternAST::codegen(CompilerSession &S, const std::string scope) {
     // Should always be global scope.
     auto &p = proto;
 
-    FunctionProtos[proto->getName()] = std::move(proto);
+    S.FunctionProtos[proto->getName()] = std::move(proto);
 
     return nullptr;
 } 
 
 
-// Helper Function
-Function *getFunction(std::string name, std::string scope) {
-    // First, see if the function has already been added to the current module.
-    if (auto *F = TheModule->getFunction(name))
-        return F;
-
-    // If not, check whether we can codegen the declaration from some existing
-    // prototype.
-    // This codegen's the prototypeAST.
-    auto FI = FunctionProtos.find(name);
-    if (FI != FunctionProtos.end())
-        return FI->second->codegen(scope);
-
-    // If no existing prototype exists, return null.
-    return nullptr;
-}
-
-AllocaInst *CreateEntryBlockAlloca(Function *TheFunction,
-                                          StringRef varName) {
-    IRBuilder<> TmpB(&TheFunction->getEntryBlock(),
-                     TheFunction->getEntryBlock().begin());
-    return TmpB.CreateAlloca(Type::getDoubleTy(*TheContext), nullptr, varName);
-}
-
-std::string generateLoopScope() {
-    return "_Loop_" + std::to_string(LoopScopeCounter++);
-}
\ No newline at end of file
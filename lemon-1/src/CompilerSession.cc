@@ -0,0 +1,533 @@
+#include "../include/CompilerSession.h"
+#include "../include/Instrument.h"
+#include "../include/Import.h"
+#include "../include/FunctionCache.h"
+
+#include <algorithm>
+
+using namespace llvm;
+
+// Shared options, see CompilerSession.h.
+std::string VECTOR_LIB = "none";    // --vector-lib=<none|libmvec|sleef|accelerate>
+int DEBUG_INFO = DEBUG_INFO_NONE;   // -g, -gline-tables-only
+
+// Vector math library the loop vectorizer is allowed to call, so loops over
+// exp/log/sin/... get vectorized instead of scalarized.
+static TargetLibraryInfoImpl::VectorLibrary getVectorLibrary() {
+    if (VECTOR_LIB == "libmvec")
+        return TargetLibraryInfoImpl::LIBMVEC_X86;
+    if (VECTOR_LIB == "sleef")
+        return TargetLibraryInfoImpl::SLEEFGNUABI;
+    if (VECTOR_LIB == "accelerate")
+        return TargetLibraryInfoImpl::Accelerate;
+    return TargetLibraryInfoImpl::NoLibrary;
+}
+
+void CompilerSession::InitializeModule() {
+    // Open a new context and module.
+    // Symbols from the previous module are gone with it, prototypes stay.
+    SymbolTable.clear();
+    CurrentDefs.clear();
+    IncompletePhis.clear();
+    UnsealedBlocks.clear();
+    VisitingBlocks.clear();
+    Tensors.clear();
+    GlobalVariables.clear();
+    DBuilder.reset();
+    TheModule.reset();      // Before its context goes
+
+    TheContext = std::make_unique<LLVMContext>();
+    TheModule = std::make_unique<Module>("LEMON JIT", *TheContext);
+    TheModule->setDataLayout(JIT.getDataLayout());
+
+    Triple TT = JIT.getExecutionSession().getExecutorProcessControl().getTargetTriple();
+    TheModule->setTargetTriple(TT.str());
+
+    if (DEBUG_INFO != DEBUG_INFO_NONE) {
+        TheModule->addModuleFlag(Module::Warning, "Debug Info Version", DEBUG_METADATA_VERSION);
+        // Darwin only understands DWARF v2.
+        if (TT.isOSDarwin())
+            TheModule->addModuleFlag(Module::Warning, "Dwarf Version", 2);
+
+        DBuilder = std::make_unique<DIBuilder>(*TheModule);
+        TheCU = DBuilder->createCompileUnit(
+            dwarf::DW_LANG_C, 
+            DBuilder->createFile(Lex.SourceFileName, "."),
+            "Lemon Compiler", 
+            DEBUG_INFO != DEBUG_INFO_FULL,  // isOptimized
+            "", 0, "",
+            DEBUG_INFO == DEBUG_INFO_FULL ? DICompileUnit::FullDebug : DICompileUnit::LineTablesOnly
+        );
+        DblDIType = DBuilder->createBasicType("double", 64, dwarf::DW_ATE_float);
+    }
+
+    // Create a new builder for the module.
+    Builder = std::make_unique<IRBuilder<>>(*TheContext);
+
+    // 3 insertion points.
+    GlobalVariableBuilder = std::make_unique<IRBuilder<>>(*TheContext);
+    MainBuilder = std::make_unique<IRBuilder<>>(*TheContext);
+    FunctionBuilder = std::make_unique<IRBuilder<>>(*TheContext);
+
+    // Optimizations
+    TheFPM = std::make_unique<FunctionPassManager>();
+    TheLAM = std::make_unique<LoopAnalysisManager>();
+    TheFAM = std::make_unique<FunctionAnalysisManager>();
+    TheCGAM = std::make_unique<CGSCCAnalysisManager>();
+    TheMAM = std::make_unique<ModuleAnalysisManager>();
+
+    ThePIC = std::make_unique<PassInstrumentationCallbacks>();
+    TheSI = std::make_unique<StandardInstrumentations>(*TheContext,
+                                                        /*DebugLogging*/ true);
+    TheSI->registerCallbacks(*ThePIC, TheMAM.get());
+
+    // Add transform passes.
+    // With -g everything stays in its alloca so the debugger can see every
+    // variable, the same as -O0 in clang. -gline-tables-only keeps optimizing.
+    if (DEBUG_INFO != DEBUG_INFO_FULL) {
+        // Eliminate Common SubExpressions.
+        TheFPM->addPass(GVNPass());
+        // Simplify the control flow graph (deleting unreachable blocks, etc).
+        TheFPM->addPass(SimplifyCFGPass());
+
+        // No mem2reg, locals are SSA already (see readLocal()).
+        TheFPM->addPass(InstCombinePass());
+        TheFPM->addPass(ReassociatePass());
+
+        // ADCE passes
+        TheFPM->addPass(ADCEPass());
+        TheFPM->addPass(DSEPass());
+
+        // Vectorization passes
+        TheFPM->addPass(LoopVectorizePass());
+        TheFPM->addPass(SLPVectorizerPass());
+        TheFPM->addPass(InstCombinePass());
+    }
+
+    // Vector math library mappings, has to be registered before
+    // registerFunctionAnalyses() adds the default TargetLibraryAnalysis.
+    TargetLibraryInfoImpl TLII(TT);
+    TLII.addVectorizableFunctionsFromVecLib(getVectorLibrary(), TT);
+    TheFAM->registerPass([&] { return TargetLibraryAnalysis(TLII); });
+
+    // Register analysis passes used in these transform passes.
+    PassBuilder PB(TM.get());
+    PB.registerModuleAnalyses(*TheMAM);
+    PB.registerFunctionAnalyses(*TheFAM);
+    PB.registerLoopAnalyses(*TheLAM);
+    PB.crossRegisterProxies(*TheLAM, *TheFAM, *TheCGAM, *TheMAM);
+}
+
+Expected<std::unique_ptr<CompilerSession>> CompilerSession::createSibling() {
+    std::unique_ptr<CompilerSession> S;
+    if (EmitObjPath.empty()) {
+        auto Session = Create(JIT);
+        if (!Session)
+            return Session.takeError();
+        S = std::move(*Session);
+    } else {
+        // Same object target machine as ours, see LemonJIT::createObjectTargetMachine().
+        std::unique_ptr<TargetMachine> ObjTM(TM->getTarget().createTargetMachine(
+            TM->getTargetTriple().str(), TM->getTargetCPU(), TM->getTargetFeatureString(), TM->Options,
+            TM->getRelocationModel(), TM->getCodeModel(), TM->getOptLevel()));
+        S = std::make_unique<CompilerSession>(JIT, std::move(ObjTM));
+        S->EmitObjPath = EmitObjPath;
+    }
+    S->RT = RT;
+    return std::move(S);
+}
+
+Function *CompilerSession::codegenMain(LemonAST &Program) {
+    FunctionType *FT = 
+        FunctionType::get(Type::getDoubleTy(*TheContext), false);        
+    
+    Function *F =
+        Function::Create(FT, Function::ExternalLinkage, "lemon_main", TheModule.get());
+    
+    BasicBlock *BB = BasicBlock::Create(*TheContext, "entry", F);
+    MainBuilder->SetInsertPoint(BB);
+    emitSubprogram(F, SourceRange());
+
+    Program.codegen(*this);
+    forgetLocals(F);
+    if (!Diagnostics.empty())
+        return nullptr;
+
+    if (PROFILE)
+        instrumentFunction(F);
+
+    // Has to happen before anything looks at the module.
+    finalizeDebugInfo();
+    return F;
+}
+
+bool FrontEnd::setSource(const std::string &path, const char *begin, const char *end, std::string &error) {
+    if (path != "-")
+        Lex.SourceFileName = path;
+    // SourceRange offsets are 32 bit.
+    if (end - begin > UINT32_MAX) {
+        error = Lex.SourceFileName + " is too big, sources are limited to 4 GiB.";
+        return false;
+    }
+    Lex.setSource(begin, end);
+    return true;
+}
+
+void CompilerSession::createProgramJITDylib(const std::string &name) {
+    ProgramJD = &JIT.createJITDylib(name);
+    RT = ProgramJD->getDefaultResourceTracker();
+}
+
+bool CompilerSession::compileProgram(LemonAST &Program, const std::string &path, bool useFnCache) {
+    // Each imported file is its own module/object, done before this one.
+    bool ok = compileImports(*this, Program, path);
+
+    // Functions are cached one by one, after their imports.
+    FnCacheEnabled = useFnCache && functionCacheUsable(*this);
+    if (!ok || !codegenMain(Program)) {
+        printDiagnostics();
+        return false;
+    }
+    return true;
+}
+
+Expected<double (*)()> CompilerSession::loadProgram() {
+    if (!addFunctionObjects(*this))
+        return make_error<StringError>("Failed to load cached functions", inconvertibleErrorCode());
+
+    auto TSM = ThreadSafeModule(std::move(TheModule), std::move(TheContext));
+    if (auto Err = JIT.addModule(std::move(TSM), RT))
+        return std::move(Err);
+
+    // Lookup is what actually materializes (compiles) the module.
+    auto Main = JIT.lookup(RT ? RT->getJITDylib() : JIT.getMainJITDylib(), "lemon_main");
+    if (!Main)
+        return Main.takeError();
+    return Main->getAddress().toPtr<double (*)()>();
+}
+
+void CompilerSession::removeProgramJITDylib() {
+    if (!ProgramJD)
+        return;
+    RT = nullptr;
+    if (auto Err = JIT.removeJITDylib(*ProgramJD))
+        JIT.getExecutionSession().reportError(std::move(Err));
+    ProgramJD = nullptr;
+}
+
+// Debug Info Helpers
+// Every lemon function is double(double, ...), tensors show up as void *.
+DISubroutineType *CompilerSession::createFunctionDIType(Function *F) {
+    SmallVector<Metadata *, 8> types(1, DblDIType);
+    for (auto &arg : F->args())
+        types.push_back(arg.getType()->isPointerTy() ? DBuilder->createPointerType(nullptr, 64) : DblDIType);
+    return DBuilder->createSubroutineType(DBuilder->getOrCreateTypeArray(types));
+}
+
+DISubprogram *CompilerSession::emitSubprogram(Function *F, SourceRange range, bool artificial) {
+    if (!DBuilder)
+        return nullptr;
+
+    LineCol loc = Lex.getLineCol(range.Begin);
+    DIFile *Unit = TheCU->getFile();
+    DISubprogram::DISPFlags spFlags = DISubprogram::SPFlagDefinition;
+    if (F->hasLocalLinkage())
+        spFlags |= DISubprogram::SPFlagLocalToUnit;
+
+    DISubprogram *SP = DBuilder->createFunction(
+        Unit, F->getName(), StringRef(), Unit, loc.Line,
+        createFunctionDIType(F), loc.Line,
+        artificial ? DINode::FlagArtificial : DINode::FlagPrototyped,
+        spFlags
+    );
+    F->setSubprogram(SP);
+    return SP;
+}
+
+// Points the builder at the start of `range`, in whatever function it is inserting into.
+void CompilerSession::emitLocation(IRBuilder<> *TmpBuilder, SourceRange range) {
+    if (!DBuilder)
+        return;
+
+    BasicBlock *BB = TmpBuilder->GetInsertBlock();
+    DISubprogram *SP = BB ? BB->getParent()->getSubprogram() : nullptr;
+    if (!SP) {
+        TmpBuilder->SetCurrentDebugLocation(DebugLoc());
+        return;
+    }
+    LineCol loc = Lex.getLineCol(range.Begin);
+    TmpBuilder->SetCurrentDebugLocation(
+        DILocation::get(SP->getContext(), loc.Line, loc.Col, SP));
+}
+
+// -g only, tells the debugger which alloca holds `name`.
+// argNo is 1-based for parameters, 0 for locals.
+void CompilerSession::emitLocalVariable(IRBuilder<> *TmpBuilder, AllocaInst *Alloca, StringRef name, 
+                                        SourceRange range, unsigned argNo) {
+    if (!DBuilder || DEBUG_INFO != DEBUG_INFO_FULL)
+        return;
+
+    DISubprogram *SP = Alloca->getFunction()->getSubprogram();
+    if (!SP)
+        return;
+
+    LineCol loc = Lex.getLineCol(range.Begin);
+    DILocalVariable *D = argNo 
+        ? DBuilder->createParameterVariable(SP, name, argNo, SP->getFile(), loc.Line, DblDIType, true)
+        : DBuilder->createAutoVariable(SP, name, SP->getFile(), loc.Line, DblDIType, true);
+
+    DBuilder->insertDeclare(Alloca, D, DBuilder->createExpression(),
+                            DILocation::get(SP->getContext(), loc.Line, loc.Col, SP),
+                            TmpBuilder->GetInsertBlock());
+}
+
+void CompilerSession::finalizeDebugInfo() {
+    if (DBuilder)
+        DBuilder->finalize();
+}
+
+// Errors
+void FrontEnd::reportError(SourceRange range, const char *str) {
+    // One error per position, whatever broke first is the interesting one.
+    // The rest are usually the same problem seen from a parent rule.
+    for (auto it = Diagnostics.rbegin(); it != Diagnostics.rend(); ++it) {
+        if (it->Range.Begin == range.Begin)
+            return;
+    }
+    Diagnostics.push_back({range, str});
+}
+
+// file:line:col: ERROR: message
+bool FrontEnd::printDiagnostics() {
+    if (Diagnostics.empty())
+        return false;
+
+    std::stable_sort(Diagnostics.begin(), Diagnostics.end(), 
+                     [](const Diagnostic &a, const Diagnostic &b) { 
+                         return a.Range.Begin < b.Range.Begin; 
+                     });
+
+    std::string out;
+    for (auto &diag : Diagnostics) {
+        LineCol lc = Lex.getLineCol(diag.Range.Begin);
+        out += Lex.SourceFileName + ":" + std::to_string(lc.Line) + ":" + std::to_string(lc.Col) + 
+               ": ERROR: " + diag.Message + "\n";
+    }
+    out += "🍋 " + std::to_string(Diagnostics.size()) + " error(s).\n";
+
+    if (DiagnosticLog)
+        *DiagnosticLog += out;
+    else
+        fputs(out.c_str(), stderr);
+    
+    Diagnostics.clear();
+    return true;
+}
+
+// Codegen errors point at the node being generated.
+Value *CompilerSession::LogErrorV(SourceRange range, const char *str) {
+    reportError(range, str);
+    return nullptr;
+}
+
+// Helper Function
+Function *CompilerSession::getFunction(std::string name, std::string scope) {
+    // First, see if the function has already been added to the current module.
+    if (auto *F = TheModule->getFunction(name))
+        return F;
+
+    // If not, check whether we can codegen the declaration from some existing
+    // prototype.
+    // This codegen's the prototypeAST.
+    auto FI = FunctionProtos.find(name);
+    if (FI != FunctionProtos.end())
+        return FI->second->codegen(*this, scope);
+
+    // If no existing prototype exists, return null.
+    return nullptr;
+}
+
+AllocaInst *CompilerSession::CreateEntryBlockAlloca(Function *TheFunction,
+                                                    StringRef varName) {
+    IRBuilder<> TmpB(&TheFunction->getEntryBlock(),
+                     TheFunction->getEntryBlock().begin());
+    return TmpB.CreateAlloca(Type::getDoubleTy(*TheContext), nullptr, varName);
+}
+
+std::string CompilerSession::generateLoopScope() {
+    return "_Loop_" + std::to_string(LoopScopeCounter++);
+}
+
+// { double *data; i64 rank; i64 shape[TENSOR_MAX_RANK]; i64 strides[TENSOR_MAX_RANK] },
+// lemon::TensorRef on the C++ side.
+StructType *CompilerSession::getTensorType() {
+    if (StructType *TensorTy = StructType::getTypeByName(*TheContext, "lemon.tensor"))
+        return TensorTy;
+    Type *I64 = Type::getInt64Ty(*TheContext);
+    Type *Dims = ArrayType::get(I64, TENSOR_MAX_RANK);
+    return StructType::create(*TheContext, {PointerType::getUnqual(*TheContext), I64, Dims, Dims},
+                              "lemon.tensor");
+}
+
+// Locals
+void CompilerSession::declareLocal(IRBuilder<> *TmpBuilder, const std::string &scope, const std::string &name,
+                                   Value *val, SourceRange range, unsigned argNo) {
+    if (DEBUG_INFO == DEBUG_INFO_FULL) {
+        AllocaInst *Alloca = CreateEntryBlockAlloca(TmpBuilder->GetInsertBlock()->getParent(), name);
+        TmpBuilder->CreateStore(val, Alloca);
+        emitLocalVariable(TmpBuilder, Alloca, name, range, argNo);
+        SymbolTable[scope][name] = Alloca;
+        return;
+    }
+
+    // A declaration is just the first assignment, a second `var x` too.
+    SymbolTable[scope][name] = nullptr;
+    writeLocal(TmpBuilder, scope, name, val);
+}
+
+bool CompilerSession::isLocal(const std::string &scope, const std::string &name) {
+    auto It = SymbolTable.find(scope);
+    return It != SymbolTable.end() && It->second.count(name);
+}
+
+Value *CompilerSession::readLocal(IRBuilder<> *TmpBuilder, const std::string &scope, const std::string &name) {
+    if (!isLocal(scope, name))
+        return nullptr;
+    if (AllocaInst *Alloca = SymbolTable[scope][name])
+        return TmpBuilder->CreateLoad(Alloca->getAllocatedType(), Alloca, name);
+    return readLocalIn(TmpBuilder->GetInsertBlock(), name);
+}
+
+void CompilerSession::writeLocal(IRBuilder<> *TmpBuilder, const std::string &scope, const std::string &name, Value *val) {
+    if (AllocaInst *Alloca = SymbolTable[scope][name])
+        TmpBuilder->CreateStore(val, Alloca);
+    else
+        CurrentDefs[TmpBuilder->GetInsertBlock()][name] = val;
+}
+
+static PHINode *createPhi(BasicBlock *BB, const std::string &name) {
+    Type *DoubleTy = Type::getDoubleTy(BB->getContext());
+    if (BB->empty())
+        return PHINode::Create(DoubleTy, 0, name, BB);
+    return PHINode::Create(DoubleTy, 0, name, &BB->front());
+}
+
+// Braun et al., "Simple and Efficient Construction of Static Single
+// Assignment Form": the value of `name` at the end of BB (as far as it's
+// generated). Not assigned in BB: it's what the predecessors have, through
+// a phi if they don't agree.
+Value *CompilerSession::readLocalIn(BasicBlock *BB, const std::string &name) {
+    auto &Defs = CurrentDefs[BB];
+    auto It = Defs.find(name);
+    if (It != Defs.end() && It->second)
+        return It->second;
+
+    Value *val;
+    if (UnsealedBlocks.count(BB)) {
+        // Loop header without its back edge, the operands come in sealBlock().
+        PHINode *Phi = createPhi(BB, name);
+        IncompletePhis[BB][name] = Phi;
+        val = Phi;
+    } else if (BasicBlock *Pred = BB->getSinglePredecessor()) {
+        val = readLocalIn(Pred, name);
+    } else if (pred_empty(BB)) {
+        // Entry, and not declared on this path (only in an if branch): 0, like `var x;`.
+        val = ConstantFP::get(*TheContext, APFloat(0.0));
+    } else {
+        auto &Visiting = VisitingBlocks[BB];
+        auto VisitingIt = Visiting.find(name);
+        if (VisitingIt != Visiting.end()) {
+            // Back here through a loop while asking BB's predecessors: a
+            // phi to break the cycle, its operands come when they're known.
+            if (!VisitingIt->second)
+                VisitingIt->second = createPhi(BB, name);
+            return VisitingIt->second;
+        }
+        val = readFromPredecessors(BB, name);
+    }
+    Defs[name] = val;
+    return val;
+}
+
+// Most merges (after an if) don't need a phi, only one branch assigned the
+// variable or none did. So no phi until the predecessors disagree, instead
+// of one for every read that is removed again right away.
+Value *CompilerSession::readFromPredecessors(BasicBlock *BB, const std::string &name) {
+    auto &Visiting = VisitingBlocks[BB];
+    auto VisitingIt = Visiting.emplace(name, nullptr).first;
+    SmallVector<std::pair<BasicBlock *, WeakTrackingVH>, 4> Incoming;
+    for (BasicBlock *Pred : predecessors(BB))
+        Incoming.push_back({Pred, readLocalIn(Pred, name)});
+
+    PHINode *Phi = VisitingIt->second;
+    Visiting.erase(VisitingIt);
+
+    if (!Phi) {
+        Value *Same = Incoming[0].second;
+        bool agree = std::all_of(Incoming.begin(), Incoming.end(),
+                                 [&](auto &In) { return (Value *)In.second == Same; });
+        if (agree)
+            return Same;
+        Phi = createPhi(BB, name);
+    }
+    for (auto &[Pred, val] : Incoming)
+        Phi->addIncoming(val, Pred);
+    return tryRemoveTrivialPhi(Phi);
+}
+
+Value *CompilerSession::addPhiOperands(const std::string &name, PHINode *Phi) {
+    for (BasicBlock *Pred : predecessors(Phi->getParent()))
+        Phi->addIncoming(readLocalIn(Pred, name), Pred);
+    return tryRemoveTrivialPhi(Phi);
+}
+
+// A phi of one value (and itself) is that value. Phis using it may be
+// trivial after that too.
+Value *CompilerSession::tryRemoveTrivialPhi(PHINode *Phi) {
+    Value *Same = nullptr;
+    for (Value *Op : Phi->incoming_values()) {
+        if (Op == Same || Op == Phi)
+            continue;
+        if (Same)
+            return Phi;
+        Same = Op;
+    }
+    if (!Same)
+        Same = ConstantFP::get(*TheContext, APFloat(0.0));   // Unreachable
+
+    SmallVector<WeakTrackingVH, 8> Users;
+    for (User *U : Phi->users()) {
+        if (U != Phi && isa<PHINode>(U))
+            Users.push_back(U);
+    }
+
+    // CurrentDefs follow the replacement (WeakTrackingVH).
+    Phi->replaceAllUsesWith(Same);
+    Phi->eraseFromParent();
+
+    WeakTrackingVH Result = Same;
+    for (auto &U : Users) {
+        if (auto *UserPhi = dyn_cast_or_null<PHINode>(U))
+            tryRemoveTrivialPhi(UserPhi);
+    }
+    return Result;
+}
+
+void CompilerSession::sealBlock(BasicBlock *BB) {
+    UnsealedBlocks.erase(BB);
+    auto Phis = std::move(IncompletePhis[BB]);
+    IncompletePhis.erase(BB);
+    for (auto &[name, Phi] : Phis)
+        addPhiOperands(name, Phi);
+}
+
+// Blocks are keyed by address, one deleted by a pass mustn't leave its
+// values to the next block allocated there.
+void CompilerSession::forgetLocals(Function *F) {
+    for (BasicBlock &BB : *F) {
+        CurrentDefs.erase(&BB);
+        IncompletePhis.erase(&BB);
+        VisitingBlocks.erase(&BB);
+        UnsealedBlocks.erase(&BB);
+    }
+}
@@ -0,0 +1,171 @@
+#include "../include/Daemon.h"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// Fixed size part of a request, the strings follow it in this order.
+struct RequestHeader {
+    uint32_t kind;
+    uint32_t pathLen;
+    uint32_t objPathLen;
+    uint32_t sourceLen;
+};
+
+// Sources are limited to 4 GiB anyway (see the lexer), paths are short.
+constexpr uint32_t MaxPathLen = 1 << 16;
+
+std::string defaultSocketPath() {
+    if (const char *path = getenv("LEMOND_SOCKET"))
+        return path;
+    // Per user and 0700 already (systemd/logind), /tmp isn't.
+    const char *runtimeDir = getenv("XDG_RUNTIME_DIR");
+    if (runtimeDir && *runtimeDir)
+        return std::string(runtimeDir) + "/lemond.sock";
+    return "/tmp/lemond-" + std::to_string(getuid()) + "/lemond.sock";
+}
+
+bool peerIsSameUser(int sock) {
+#ifdef SO_PEERCRED
+    ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) || len != sizeof(cred))
+        return false;
+    return cred.uid == getuid();
+#else
+    uid_t uid;
+    gid_t gid;
+    return getpeereid(sock, &uid, &gid) == 0 && uid == getuid();
+#endif
+}
+
+bool checkSocketDir(const std::string &socketPath, bool create, std::string &error) {
+    size_t slash = socketPath.rfind('/');
+    std::string dir = slash == std::string::npos ? "." : slash == 0 ? "/" : socketPath.substr(0, slash);
+
+    if (create && mkdir(dir.c_str(), 0700) && errno != EEXIST) {
+        error = "Can't create " + dir + ": " + strerror(errno);
+        return false;
+    }
+
+    // lstat: a symlink planted there would point somewhere else.
+    struct stat st;
+    if (lstat(dir.c_str(), &st)) {
+        error = "Can't stat " + dir + ": " + strerror(errno);
+        return false;
+    }
+    if (!S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & (S_IWGRP | S_IWOTH))) {
+        error = dir + " has to be a directory owned by you that only you can write to";
+        return false;
+    }
+    return true;
+}
+
+bool writeAll(int fd, const void *data, size_t size) {
+    auto *p = static_cast<const char *>(data);
+    while (size > 0) {
+        ssize_t n = write(fd, p, size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool readAll(int fd, void *data, size_t size) {
+    auto *p = static_cast<char *>(data);
+    while (size > 0) {
+        ssize_t n = read(fd, p, size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool sendRequest(int sock, const Request &R) {
+    if (R.source.size() > UINT32_MAX || R.path.size() > MaxPathLen || R.objPath.size() > MaxPathLen)
+        return false;
+
+    RequestHeader H = {R.kind, (uint32_t)R.path.size(), (uint32_t)R.objPath.size(), (uint32_t)R.source.size()};
+
+    // The header carries the fds, everything after it is plain bytes.
+    int fds[2] = {R.outFd, R.errFd};
+    char control[CMSG_SPACE(sizeof(fds))] = {};
+
+    iovec iov = {&H, sizeof(H)};
+    msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    ssize_t n;
+    do {
+        n = sendmsg(sock, &msg, 0);
+    } while (n < 0 && errno == EINTR);
+    if (n != sizeof(H))
+        return false;
+
+    return writeAll(sock, R.path.data(), R.path.size()) &&
+           writeAll(sock, R.objPath.data(), R.objPath.size()) &&
+           writeAll(sock, R.source.data(), R.source.size());
+}
+
+bool recvRequest(int sock, Request &R) {
+    RequestHeader H;
+    int fds[2] = {-1, -1};
+    char control[CMSG_SPACE(sizeof(fds))] = {};
+
+    iovec iov = {&H, sizeof(H)};
+    msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t n;
+    do {
+        n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    } while (n < 0 && errno == EINTR);
+
+    if (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+            cmsg->cmsg_len == CMSG_LEN(sizeof(fds)))
+            memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    }
+    R.outFd = fds[0];
+    R.errFd = fds[1];
+
+    // A short header would leave the rest of the stream misaligned.
+    if (n != sizeof(H) || R.outFd < 0 || R.errFd < 0 || (msg.msg_flags & MSG_CTRUNC))
+        return false;
+    if (H.kind != request_run && H.kind != request_emit_obj)
+        return false;
+    if (H.pathLen > MaxPathLen || H.objPathLen > MaxPathLen)
+        return false;
+
+    R.kind = (RequestKind)H.kind;
+    R.path.resize(H.pathLen);
+    R.objPath.resize(H.objPathLen);
+    R.source.resize(H.sourceLen);
+    return readAll(sock, R.path.data(), R.path.size()) &&
+           readAll(sock, R.objPath.data(), R.objPath.size()) &&
+           readAll(sock, R.source.data(), R.source.size());
+}
@@ -0,0 +1,160 @@
+#include "../include/FunctionCache.h"
+#include "../include/Import.h"
+#include "../include/AOT.h"
+#include "../include/Instrument.h"
+#include "../include/MultiVersion.h"
+
+#include "llvm/IR/InstIterator.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+
+bool functionCacheUsable(CompilerSession &S) {
+    return !CACHE_DIR.empty() && S.EmitObjPath.empty() && !PROFILE && !MULTIVERSION;
+}
+
+static std::string functionCachePath(const std::string &key) {
+    SmallString<256> path(CACHE_DIR);
+    sys::path::append(path, key + ".fn.o");
+    return std::string(path);
+}
+
+// The AST alone isn't enough: the same body compiles differently if a callee
+// now takes a tensor, or if a name it uses became (or stopped being) a global.
+static std::string functionKey(CompilerSession &S, FunctionAST &F) {
+    ASTHasher H;
+    F.hash(H);
+    uint64_t astHash = H.finish();
+
+    MD5 Hash;
+    Hash.update(ArrayRef<uint8_t>((const uint8_t *)&astHash, sizeof(astHash)));
+
+    const std::string &name = F.getProto().getName();
+    for (auto &callee : H.Callees) {
+        if (callee == name)
+            continue;   // Its own prototype is in the AST hash
+        auto It = S.FunctionProtos.find(callee);
+        // Not a function: a builtin, or an error (which never gets cached).
+        Hash.update(callee + "=" + (It == S.FunctionProtos.end() ? "-" : It->second->getArgTypes()) + ";");
+    }
+    for (auto &var : H.Variables)
+        Hash.update(var + (S.GlobalVariables.count(var) ? "=g;" : "=l;"));
+
+    Hash.update(compilerOptions(*S.TM));
+
+    // Debug info has the file, lines and columns in it. The AST hash ignores
+    // positions, the source text doesn't.
+    if (DEBUG_INFO != DEBUG_INFO_NONE) {
+        SourceRange range = F.getRange();
+        LineCol loc = S.Lex.getLineCol(range.Begin);
+        Hash.update(S.Lex.SourceFileName + ":" + std::to_string(loc.Line) + ":" + std::to_string(loc.Col) + ";");
+        Hash.update(StringRef(S.Lex.srcBegin + range.Begin, range.End - range.Begin));
+    }
+
+    MD5::MD5Result Result;
+    Hash.final(Result);
+    return std::string(Result.digest());
+}
+
+bool lookupCachedFunction(CompilerSession &S, FunctionAST &F) {
+    std::string key = functionKey(S, F);
+    const std::string &name = F.getProto().getName();
+
+    if (auto Cached = MemoryBuffer::getFile(functionCachePath(key))) {
+        S.FnCacheHits.push_back(std::move(*Cached));
+        return true;
+    }
+    S.FnCacheMisses[name] = key;
+    return false;
+}
+
+// Copy of F in a module of its own, everything it uses declared. Only
+// walks F, so splitting n functions out of a big module stays O(n).
+// nullptr if F uses something that can't be declared from another object
+// (internal globals, constant expressions), it stays in the main module then.
+static std::unique_ptr<Module> extractFunction(Function &F) {
+    Module &M = *F.getParent();
+    auto New = std::make_unique<Module>(F.getName(), M.getContext());
+    New->setDataLayout(M.getDataLayout());
+    New->setTargetTriple(M.getTargetTriple());
+
+    // "Debug Info Version" and friends.
+    SmallVector<Module::ModuleFlagEntry, 4> Flags;
+    M.getModuleFlagsMetadata(Flags);
+    for (auto &Flag : Flags)
+        New->addModuleFlag(Flag.Behavior, Flag.Key->getString(), Flag.Val);
+
+    ValueToValueMapTy VMap;
+    Function *NewF = Function::Create(F.getFunctionType(), F.getLinkage(), F.getName(), New.get());
+    VMap[&F] = NewF;
+
+    for (auto &I : instructions(F)) {
+        for (Value *Op : I.operands()) {
+            if (isa<ConstantExpr>(Op))
+                return nullptr;
+            auto *GV = dyn_cast<GlobalValue>(Op);
+            if (!GV || VMap.count(GV))
+                continue;
+            if (GV->hasLocalLinkage())
+                return nullptr;
+
+            if (auto *Callee = dyn_cast<Function>(GV)) {
+                Function *Decl = Function::Create(Callee->getFunctionType(), GlobalValue::ExternalLinkage,
+                                                  Callee->getName(), New.get());
+                Decl->copyAttributesFrom(Callee);
+                VMap[Callee] = Decl;
+            } else if (auto *Var = dyn_cast<GlobalVariable>(GV)) {
+                VMap[Var] = new GlobalVariable(*New, Var->getValueType(), Var->isConstant(),
+                                               GlobalValue::ExternalLinkage, nullptr, Var->getName());
+            } else {
+                return nullptr;
+            }
+        }
+    }
+
+    auto NewArg = NewF->arg_begin();
+    for (auto &Arg : F.args()) {
+        NewArg->setName(Arg.getName());
+        VMap[&Arg] = &*NewArg++;
+    }
+
+    SmallVector<ReturnInst *, 8> Returns;
+    CloneFunctionInto(NewF, &F, VMap, CloneFunctionChangeType::DifferentModule, Returns);
+    return New;
+}
+
+bool addFunctionObjects(CompilerSession &S) {
+    for (auto &[name, key] : S.FnCacheMisses) {
+        Function *F = S.TheModule->getFunction(name);
+        if (!F || F->isDeclaration())
+            continue;
+
+        auto M = extractFunction(*F);
+        if (!M)
+            continue;
+
+        SmallVector<char, 0> ObjBuffer;
+        raw_svector_ostream out(ObjBuffer);
+        if (!emitObject(*M, *S.TM, out))
+            continue;
+
+        StringRef Obj(ObjBuffer.data(), ObjBuffer.size());
+        writeCacheFile(functionCachePath(key), Obj);
+
+        // The object has the code now, don't compile it twice.
+        F->deleteBody();
+        S.FnCacheHits.push_back(MemoryBuffer::getMemBufferCopy(Obj, name));
+    }
+    S.FnCacheMisses.clear();
+
+    bool ok = true;
+    for (auto &Obj : S.FnCacheHits) {
+        std::string objName = Obj->getBufferIdentifier().str();
+        if (auto Err = S.JIT.addObjectFile(std::move(Obj), S.RT)) {
+            fprintf(stderr, "🍋 Failed to load %s: %s\n", objName.c_str(), toString(std::move(Err)).c_str());
+            ok = false;
+        }
+    }
+    S.FnCacheHits.clear();
+    return ok;
+}
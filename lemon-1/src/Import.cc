@@ -0,0 +1,383 @@
+#include "../include/Import.h"
+#include "../include/Parser.h"
+#include "../include/Lexer.h"
+#include "../include/AOT.h"
+#include "../include/Instrument.h"
+#include "../include/MultiVersion.h"
+
+#include "llvm/Config/llvm-config.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/Path.h"
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+std::string CACHE_DIR;
+
+std::string resolveImport(const std::string &importPath, const std::string &importerPath) {
+    SmallString<256> path;
+    if (sys::path::is_absolute(importPath) || importerPath == "-") {
+        path = importPath;
+    } else {
+        path = sys::path::parent_path(importerPath);
+        sys::path::append(path, importPath);
+    }
+
+    // Same file through different relative paths should only compile once.
+    SmallString<256> realPath;
+    if (!sys::fs::real_path(path, realPath))
+        return std::string(realPath);
+    return std::string(path);
+}
+
+// Everything that changes the generated code, besides the source itself.
+std::string compilerOptions(TargetMachine &TM) {
+    return std::string(LLVM_VERSION_STRING) + 
+           ";" + TM.getTargetTriple().str() +
+           ";" + TM.getTargetCPU().str() + 
+           ";" + TM.getTargetFeatureString().str() +
+           ";pic=" + std::to_string(TM.isPositionIndependent()) +    // --emit-obj's aren't for the JIT
+           ";vlib=" + VECTOR_LIB +
+           ";g=" + std::to_string(DEBUG_INFO) +
+           ";prof=" + std::to_string(PROFILE) +
+           ";mv=" + std::to_string(MULTIVERSION);
+}
+
+std::string cacheKey(CompilerSession &S, const std::string &file, StringRef source, const std::string &deps) {
+    MD5 Hash;
+    Hash.update(file);      // Debug info has the path in it.
+    Hash.update(source);
+    Hash.update(deps);
+    Hash.update(compilerOptions(*S.TM));
+
+    MD5::MD5Result Result;
+    Hash.final(Result);
+    return std::string(Result.digest());
+}
+
+// Codegen's the functions of an imported file into the (fresh) S.TheModule.
+bool codegenImport(CompilerSession &S, LemonAST &Program) {
+    S.InitializeModule();
+
+    for (auto &stmt : Program.getStatements())
+        stmt->codegen(S, "_global");
+    
+    if (!S.Diagnostics.empty())
+        return false;
+
+    S.finalizeDebugInfo();
+    return true;
+}
+
+// A cached object already has the code, the importer still needs prototypes.
+void registerPrototypes(CompilerSession &S, LemonAST &Program) {
+    for (auto &stmt : Program.getStatements()) {
+        if (auto *F = dynamic_cast<FunctionAST *>(stmt.get()))
+            S.FunctionProtos[F->getProto().getName()] = std::make_unique<PrototypeAST>(F->getProto());
+        else if (auto *E = dynamic_cast<ExternAST *>(stmt.get()))
+            S.FunctionProtos[E->getProto().getName()] = std::make_unique<PrototypeAST>(E->getProto());
+    }
+}
+
+// Writes through a temp file, so a concurrent run never sees half an object.
+// Unique per write, not per process: host mode compiles the same import on
+// several threads.
+void writeCacheFile(const std::string &cachePath, StringRef obj) {
+    if (sys::fs::create_directories(CACHE_DIR))
+        return;
+
+    int FD;
+    SmallString<256> tmpPath;
+    if (sys::fs::createUniqueFile(cachePath + ".tmp%%%%%%", FD, tmpPath))
+        return;
+    raw_fd_ostream out(FD, /*shouldClose=*/true);
+    out << obj;
+    out.close();
+
+    if (out.has_error() || sys::fs::rename(tmpPath, cachePath))
+        sys::fs::remove(tmpPath);
+}
+
+// One imported file. Parsed in its own session while the imports are
+// discovered, compiled (on any thread) once the files it imports are.
+struct ImportUnit {
+    std::string file;
+    std::unique_ptr<MemoryBuffer> Source;
+    std::unique_ptr<CompilerSession> S;
+    std::unique_ptr<LemonAST> Program;
+    std::vector<std::pair<std::string, ImportStmtAST *>> imports;   // Resolved file, statement
+    std::vector<ImportUnit *> importers;
+    unsigned pending = 0;           // Imports not compiled yet
+    std::string interface;
+    std::string diagnostics;        // S's, printed in order once everything is done
+    bool ok = false;
+};
+
+// Imports of one parsed file, resolved against `path`.
+static std::vector<std::pair<std::string, ImportStmtAST *>> findImports(LemonAST &Program, const std::string &path) {
+    std::vector<std::pair<std::string, ImportStmtAST *>> imports;
+    for (auto &stmt : Program.getStatements()) {
+        if (auto *Import = dynamic_cast<ImportStmtAST *>(stmt.get()))
+            imports.push_back({resolveImport(Import->getPath(), path), Import});
+    }
+    return imports;
+}
+
+// Reads and parses `file` (imported by `Import` in Importer) into its own 
+// session, like S. Errors are reported in Importer or the new session.
+static std::unique_ptr<ImportUnit> parseImport(CompilerSession &S, CompilerSession &Importer, 
+                                               ImportStmtAST *Import, const std::string &file) {
+    auto Source = MemoryBuffer::getFile(file);
+    if (!Source) {
+        Importer.reportError(Import->getRange(), ("Can't read \"" + file + "\": " + Source.getError().message()).c_str());
+        return nullptr;
+    }
+
+    auto Session = S.createSibling();
+    if (!Session) {
+        Importer.reportError(Import->getRange(), toString(Session.takeError()).c_str());
+        return nullptr;
+    }
+
+    std::string error;
+    if (!(*Session)->setSource(file, (*Source)->getBufferStart(), (*Source)->getBufferEnd(), error)) {
+        Importer.reportError(Import->getRange(), error.c_str());
+        return nullptr;
+    }
+
+    auto U = std::make_unique<ImportUnit>();
+    U->file = file;
+    U->Source = std::move(*Source);
+    U->S = std::move(*Session);
+    U->S->DiagnosticLog = &U->diagnostics;
+
+    // Whatever S imported before is visible to it too.
+    for (auto &[name, Proto] : S.FunctionProtos)
+        U->S->FunctionProtos[name] = std::make_unique<PrototypeAST>(*Proto);
+
+    U->S->Lex.getNextToken();
+    U->Program = Parser(*U->S).Parse();
+
+    // No lemon_main in an imported file, so nothing to run statements in.
+    for (auto &stmt : U->Program->getStatements()) {
+        if (!dynamic_cast<FunctionAST *>(stmt.get()) && 
+            !dynamic_cast<ExternAST *>(stmt.get()) &&
+            !dynamic_cast<ImportStmtAST *>(stmt.get()))
+            U->S->reportError(stmt->getRange(), "Only func, extern and import are allowed at the top level of an imported file.");
+    }
+    U->imports = findImports(*U->Program, file);
+    return U;
+}
+
+// Compiles a parsed unit whose imports are all compiled.
+static bool compileImportUnit(CompilerSession &Root, ImportUnit &U, std::map<std::string, ImportUnit *> &Units) {
+    CompilerSession &S = *U.S;
+    if (S.printDiagnostics())
+        return false;
+
+    // The functions it calls have to be declared.
+    std::string deps;
+    for (auto &[file, Import] : U.imports) {
+        auto It = Units.find(file);
+        if (It == Units.end()) {
+            auto Compiled = Root.CompiledImports.find(file);    // Read only, other threads too
+            if (Compiled != Root.CompiledImports.end())
+                deps += Compiled->second;
+            continue;
+        }
+        deps += It->second->interface;
+        for (auto &[name, Proto] : It->second->S->FunctionProtos)
+            S.FunctionProtos[name] = std::make_unique<PrototypeAST>(*Proto);
+    }
+
+    std::string cachePath;
+    std::unique_ptr<MemoryBuffer> Obj;
+    if (!CACHE_DIR.empty()) {
+        SmallString<256> path(CACHE_DIR);
+        sys::path::append(path, cacheKey(S, U.file, U.Source->getBuffer(), deps) + ".o");
+        cachePath = std::string(path);
+
+        if (auto Cached = MemoryBuffer::getFile(cachePath)) {
+            Obj = std::move(*Cached);
+            registerPrototypes(S, *U.Program);
+        }
+    }
+
+    if (!Obj) {
+        if (!codegenImport(S, *U.Program)) {
+            S.printDiagnostics();
+            return false;
+        }
+
+        SmallVector<char, 0> ObjBuffer;
+        raw_svector_ostream out(ObjBuffer);
+        if (!emitObject(*S.TheModule, *S.TM, out))
+            return false;
+
+        Obj = MemoryBuffer::getMemBufferCopy(StringRef(ObjBuffer.data(), ObjBuffer.size()), U.file);
+        if (!cachePath.empty())
+            writeCacheFile(cachePath, Obj->getBuffer());
+    }
+
+    // Interface: what importers can call, which is every prototype it has,
+    // its imports' included. A stale object compiled against an old
+    // interface would call with the wrong args (number or tensor vs double),
+    // so it's part of the cache key of everything importing this file.
+    for (auto &[name, Proto] : S.FunctionProtos)
+        U.interface += name + "/" + Proto->getArgTypes() + ";";
+
+    // AOT: prog.o gets lib.o next to it, both go on the link line.
+    if (!S.EmitObjPath.empty()) {
+        SmallString<256> objPath(sys::path::parent_path(S.EmitObjPath));
+        sys::path::append(objPath, sys::path::stem(U.file) + ".o");
+
+        std::error_code EC;
+        raw_fd_ostream out(objPath, EC, sys::fs::OF_None);
+        if (EC) {
+            fprintf(stderr, "🍋 Can't write %s: %s\n", objPath.c_str(), EC.message().c_str());
+            return false;
+        }
+        out << Obj->getBuffer();
+        return true;
+    }
+
+    if (auto Err = S.JIT.addObjectFile(std::move(Obj), S.RT)) {
+        fprintf(stderr, "🍋 Failed to load %s: %s\n", U.file.c_str(), toString(std::move(Err)).c_str());
+        return false;
+    }
+    return true;
+}
+
+// Cycles among the units reachable from `imports`, reported where the
+// cycle closes. Visiting: on the current path.
+static bool checkCycles(CompilerSession &Importer, std::vector<std::pair<std::string, ImportStmtAST *>> &imports,
+                        std::map<std::string, ImportUnit *> &Units, std::map<std::string, bool> &Visiting) {
+    for (auto &[file, Import] : imports) {
+        auto It = Units.find(file);
+        if (It == Units.end())
+            continue;
+        auto State = Visiting.find(file);
+        if (State != Visiting.end()) {
+            if (!State->second)
+                continue;   // Done already
+            Importer.reportError(Import->getRange(), ("Import cycle through \"" + Import->getPath() + "\".").c_str());
+            return false;
+        }
+        Visiting[file] = true;
+        if (!checkCycles(*It->second->S, It->second->imports, Units, Visiting))
+            return false;
+        Visiting[file] = false;
+    }
+    return true;
+}
+
+bool compileImports(CompilerSession &S, LemonAST &Program, const std::string &path) {
+    // 1. Find (and parse) every file imported, directly or not.
+    std::vector<std::unique_ptr<ImportUnit>> Order;     // Discovery order, for diagnostics
+    std::map<std::string, ImportUnit *> Units;
+    auto rootImports = findImports(Program, path);
+
+    bool ok = true;
+    std::vector<std::pair<CompilerSession *, std::vector<std::pair<std::string, ImportStmtAST *>> *>> Work;
+    Work.push_back({&S, &rootImports});
+    for (size_t w = 0; w < Work.size() && ok; ++w) {
+        auto [Importer, imports] = Work[w];
+        for (auto &[file, Import] : *imports) {
+            if (S.CompiledImports.count(file) || Units.count(file))
+                continue;
+            auto U = parseImport(S, *Importer, Import, file);
+            if (!U) {
+                ok = false;
+                break;
+            }
+            Units[file] = U.get();
+            Work.push_back({U->S.get(), &U->imports});
+            Order.push_back(std::move(U));
+        }
+    }
+
+    std::map<std::string, bool> Visiting;
+    if (ok)
+        ok = checkCycles(S, rootImports, Units, Visiting);
+
+    // 2. Compile them, each one as soon as its imports are done. Files that
+    //    don't import each other compile in parallel, one session each.
+    if (ok && !Order.empty()) {
+        std::deque<ImportUnit *> Ready;
+        for (auto &U : Order) {
+            for (auto &[file, Import] : U->imports) {
+                auto It = Units.find(file);
+                if (It != Units.end()) {
+                    It->second->importers.push_back(U.get());
+                    U->pending++;
+                }
+            }
+        }
+        for (auto &U : Order) {
+            if (!U->pending)
+                Ready.push_back(U.get());
+        }
+
+        std::mutex Mutex;
+        std::condition_variable Changed;
+        size_t running = 0, done = 0;
+        bool failed = false;
+
+        auto worker = [&]() {
+            std::unique_lock<std::mutex> Lock(Mutex);
+            while (true) {
+                Changed.wait(Lock, [&] { return !Ready.empty() || failed || done == Order.size() || !running; });
+                if (Ready.empty() || failed)
+                    return;     // Done, failed, or only waiting on nothing (can't happen without cycles)
+                ImportUnit *U = Ready.front();
+                Ready.pop_front();
+                running++;
+
+                Lock.unlock();
+                U->ok = compileImportUnit(S, *U, Units);
+                Lock.lock();
+
+                running--;
+                done++;
+                failed |= !U->ok;
+                for (ImportUnit *Importer : U->importers) {
+                    if (!--Importer->pending)
+                        Ready.push_back(Importer);
+                }
+                Changed.notify_all();
+            }
+        };
+
+        unsigned numThreads = std::min<size_t>(Order.size(), std::max(1u, std::thread::hardware_concurrency()));
+        std::vector<std::thread> threads;
+        for (unsigned i = 1; i < numThreads; ++i)
+            threads.emplace_back(worker);
+        worker();
+        for (auto &T : threads)
+            T.join();
+
+        ok = !failed && done == Order.size();
+    }
+
+    // 3. Diagnostics in a stable order, and the prototypes for the importer.
+    for (auto &U : Order) {
+        U->S->printDiagnostics();
+        if (!U->diagnostics.empty()) {
+            if (S.DiagnosticLog)
+                *S.DiagnosticLog += U->diagnostics;
+            else
+                fputs(U->diagnostics.c_str(), stderr);
+        }
+    }
+    if (!ok)
+        return false;
+
+    for (auto &U : Order) {
+        S.CompiledImports[U->file] = U->interface;
+        for (auto &[name, Proto] : U->S->FunctionProtos)
+            S.FunctionProtos[name] = std::make_unique<PrototypeAST>(*Proto);
+    }
+    return true;
+}
@@ -0,0 +1,37 @@
+#include "../include/Instrument.h"
+
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/DebugInfoMetadata.h"
+
+int PROFILE = 0;
+
+void instrumentFunction(Function *F) {
+    Module *M = F->getParent();
+    LLVMContext &Ctx = M->getContext();
+
+    FunctionType *HookTy = FunctionType::get(Type::getVoidTy(Ctx), 
+                                             {PointerType::getUnqual(Ctx)}, false);
+    FunctionCallee Enter = M->getOrInsertFunction("lemon_prof_enter", HookTy);
+    FunctionCallee Exit = M->getOrInsertFunction("lemon_prof_exit", HookTy);
+
+    // Collect first, inserting while iterating would visit the new calls.
+    std::vector<ReturnInst *> Returns;
+    for (auto &BB : *F)
+        for (auto &I : BB)
+            if (auto *Ret = dyn_cast<ReturnInst>(&I))
+                Returns.push_back(Ret);
+
+    BasicBlock &Entry = F->getEntryBlock();
+    IRBuilder<> TmpBuilder(&Entry, Entry.getFirstInsertionPt());
+    if (DISubprogram *SP = F->getSubprogram())
+        TmpBuilder.SetCurrentDebugLocation(DILocation::get(Ctx, SP->getLine(), 0, SP));
+    Value *Name = TmpBuilder.CreateGlobalString(F->getName(), F->getName() + ".prof_name");
+    TmpBuilder.CreateCall(Enter, {Name});
+
+    for (auto *Ret : Returns) {
+        TmpBuilder.SetInsertPoint(Ret);
+        TmpBuilder.CreateCall(Exit, {Name});
+    }
+}
@@ -0,0 +1,656 @@
+#include "../include/Interp.h"
+#include "../include/CompilerSession.h"
+
+#include "llvm/Support/DynamicLibrary.h"
+
+#include <cmath>
+
+int INTERP = INTERP_AUTO;
+
+// ============================================================================
+//                                 Compiler
+// ============================================================================
+// Same scoping as codegen: locals are flat per function (an if/for body
+// doesn't open a scope), the top level only has for iterators as locals,
+// global initializers only see globals. Names are resolved while compiling,
+// in program order, like codegen does.
+
+enum BytecodeBuiltin {
+    builtin_sqrt, builtin_exp, builtin_log, builtin_sin, builtin_cos, builtin_tanh,
+    builtin_pow, builtin_fma, builtin_abs, builtin_min, builtin_max
+};
+
+// Same names and arities as Builtins.cc.
+static const std::map<std::string, std::pair<BytecodeBuiltin, unsigned>> BytecodeBuiltins = {
+    {"sqrt", {builtin_sqrt, 1}},
+    {"exp",  {builtin_exp, 1}},
+    {"log",  {builtin_log, 1}},
+    {"sin",  {builtin_sin, 1}},
+    {"cos",  {builtin_cos, 1}},
+    {"tanh", {builtin_tanh, 1}},
+    {"pow",  {builtin_pow, 2}},
+    {"fma",  {builtin_fma, 3}},
+    {"abs",  {builtin_abs, 1}},
+    {"min",  {builtin_min, 2}},
+    {"max",  {builtin_max, 2}},
+};
+
+size_t BytecodeProgram::size() const {
+    size_t instrs = 0;
+    for (auto &F : Functions)
+        instrs += F.code.size();
+    return instrs;
+}
+
+bool BytecodeProgram::loops() const {
+    std::vector<bool> seen(Functions.size());
+    std::vector<unsigned> work = {0};
+    seen[0] = true;
+    while (!work.empty()) {
+        const BytecodeFunction &F = Functions[work.back()];
+        work.pop_back();
+        for (auto &I : F.code) {
+            if (I.op == op_forloop)
+                return true;
+            if (I.op == op_call && !seen[I.b]) {
+                seen[I.b] = true;
+                work.push_back(I.b);
+            }
+        }
+    }
+    return false;
+}
+
+size_t BytecodeCompiler::emit(BytecodeOp op, uint32_t a, uint32_t b, uint32_t c) {
+    function().code.push_back({op, a, b, c});
+    return function().code.size() - 1;
+}
+
+unsigned BytecodeCompiler::newRegister() {
+    unsigned reg = Top++;
+    function().numRegs = std::max(function().numRegs, Top);
+    return reg;
+}
+
+unsigned BytecodeCompiler::newLocalRegister() {
+    Top = function().numRegs;
+    return newRegister();
+}
+
+int BytecodeCompiler::lookupLocal(const std::string &name) {
+    if (HideLocals)
+        return -1;
+    auto It = Locals.find(name);
+    return It == Locals.end() ? -1 : (int)It->second;
+}
+
+int BytecodeCompiler::constant(double val) {
+    P.Constants.push_back(val);
+    return P.Constants.size() - 1;
+}
+
+// Temporaries of one statement, freed when it's done. Never held across a
+// nested statement list, the locals declared in there stay reserved.
+struct TempScope {
+    BytecodeCompiler &C;
+    unsigned mark;
+    TempScope(BytecodeCompiler &C) : C(C), mark(C.Top) {}
+    ~TempScope() { C.Top = mark; }
+};
+
+static bool emitStatements(BytecodeCompiler &C, std::vector<std::unique_ptr<StmtAST>> &statements) {
+    for (auto &statement : statements) {
+        if (!statement->emitBytecode(C))
+            return false;
+    }
+    return true;
+}
+
+static void emitMove(BytecodeCompiler &C, unsigned dest, unsigned src) {
+    if (dest != src)
+        C.emit(op_move, dest, src);
+}
+
+bool LemonAST::emitBytecode(BytecodeCompiler &C) {
+    C.Fn = 0;
+    if (!emitStatements(C, statements))
+        return false;
+    unsigned zero = C.newRegister();
+    C.emit(op_loadk, zero, C.constant(0.0));
+    C.emit(op_ret, zero);
+    return true;
+}
+
+int BinaryExprAST::emitBytecode(BytecodeCompiler &C) {
+    BytecodeOp bop;
+    switch (op) {
+    case tok_add: bop = op_add; break;
+    case tok_sub: bop = op_sub; break;
+    case tok_mul: bop = op_mul; break;
+    case tok_div: bop = op_div; break;
+    case tok_lt:  bop = op_lt; break;
+    case tok_gt:  bop = op_gt; break;
+    case tok_le:  bop = op_le; break;
+    case tok_ge:  bop = op_ge; break;
+    case tok_eq:  bop = op_eq; break;
+    case tok_neq: bop = op_neq; break;
+    default:
+        return -1;
+    }
+
+    unsigned mark = C.Top;
+    int L = LHS->emitBytecode(C);
+    int R = L < 0 ? -1 : RHS->emitBytecode(C);
+    if (R < 0)
+        return -1;
+
+    // May reuse L's or R's register, they're read before it's written.
+    C.Top = mark;
+    unsigned dest = C.newRegister();
+    C.emit(bop, dest, L, R);
+    return dest;
+}
+
+int UnaryExprAST::emitBytecode(BytecodeCompiler &C) {
+    if (op != tok_sub && op != tok_not)
+        return -1;
+
+    unsigned mark = C.Top;
+    int V = operand->emitBytecode(C);
+    if (V < 0)
+        return -1;
+
+    C.Top = mark;
+    unsigned dest = C.newRegister();
+    C.emit(op == tok_sub ? op_neg : op_not, dest, V);
+    return dest;
+}
+
+int NumberExprAST::emitBytecode(BytecodeCompiler &C) {
+    unsigned dest = C.newRegister();
+    C.emit(op_loadk, dest, C.constant(val));
+    return dest;
+}
+
+int VariableExprAST::emitBytecode(BytecodeCompiler &C) {
+    // Locals are read in place, no copy.
+    int local = C.lookupLocal(varName);
+    if (local >= 0)
+        return local;
+
+    auto It = C.P.GlobalSlots.find(varName);
+    if (It == C.P.GlobalSlots.end())
+        return -1;
+
+    unsigned dest = C.newRegister();
+    C.emit(op_getg, dest, It->second);
+    return dest;
+}
+
+int IndexExprAST::emitBytecode(BytecodeCompiler &C) {
+    return -1;  // Tensors: JIT only
+}
+
+int CallExprAST::emitBytecode(BytecodeCompiler &C) {
+    // User functions and externs first, then builtins, like codegen. dim()
+    // is tensors, JIT only.
+    auto Fn = C.FunctionIds.find(callee);
+    auto Builtin = BytecodeBuiltins.find(callee);
+    if (Fn != C.FunctionIds.end()) {
+        if (C.P.Functions[Fn->second].numArgs != args.size())
+            return -1;
+    } else if (Builtin == BytecodeBuiltins.end() || Builtin->second.second != args.size()) {
+        return -1;
+    }
+
+    // Args go into consecutive registers, the callee's frame copies them.
+    unsigned base = C.Top;
+    for (size_t i = 0; i < args.size(); ++i)
+        C.newRegister();
+
+    for (size_t i = 0; i < args.size(); ++i) {
+        TempScope T(C);
+        int arg = args[i]->emitBytecode(C);
+        if (arg < 0)
+            return -1;
+        emitMove(C, base + i, arg);
+    }
+
+    C.Top = base;
+    unsigned dest = C.newRegister();
+    if (Fn != C.FunctionIds.end())
+        C.emit(op_call, dest, Fn->second, base);
+    else
+        C.emit(op_builtin, dest, Builtin->second.first, base);
+    return dest;
+}
+
+bool VariableDeclStmt::emitBytecode(BytecodeCompiler &C) {
+    // Top level: a global, initialized where it's declared. Without an
+    // initializer codegen doesn't register it either.
+    if (C.Fn == 0) {
+        if (!defBody)
+            return true;
+
+        TempScope T(C);
+        C.HideLocals = true;
+        int val = defBody->emitBytecode(C);
+        C.HideLocals = false;
+        if (val < 0)
+            return false;
+
+        unsigned slot = C.P.Globals.size();
+        C.P.Globals.push_back(0.0);
+        C.emit(op_setg, slot, val);
+
+        if (C.P.GlobalSlots.count(varName))
+            C.P.redeclaredGlobals = true;
+        C.P.GlobalSlots[varName] = slot;
+        return true;
+    }
+
+    unsigned reg = C.newLocalRegister();
+    {
+        TempScope T(C);
+        if (defBody) {
+            int val = defBody->emitBytecode(C);
+            if (val < 0)
+                return false;
+            emitMove(C, reg, val);
+        } else {
+            C.emit(op_loadk, reg, C.constant(0.0));
+        }
+    }
+    // After the initializer, `var x = x + 1;` reads the old x.
+    C.Locals[varName] = reg;
+    return true;
+}
+
+bool AssignmentStmt::emitBytecode(BytecodeCompiler &C) {
+    TempScope T(C);
+    int val = defBody->emitBytecode(C);
+    if (val < 0)
+        return false;
+
+    int local = C.lookupLocal(varName);
+    if (local >= 0) {
+        emitMove(C, local, val);
+        return true;
+    }
+
+    auto It = C.P.GlobalSlots.find(varName);
+    if (It == C.P.GlobalSlots.end())
+        return false;
+    C.emit(op_setg, It->second, val);
+    return true;
+}
+
+bool IndexAssignStmt::emitBytecode(BytecodeCompiler &C) {
+    return false;   // Tensors: JIT only
+}
+
+bool ReturnStmtAST::emitBytecode(BytecodeCompiler &C) {
+    TempScope T(C);
+    int val = retBody->emitBytecode(C);
+    if (val < 0)
+        return false;
+    if (C.Fn != 0 && C.Depth == 0)  // Nested ones only evaluate, like FunctionAST::codegen
+        C.emit(op_ret, val);
+    return true;
+}
+
+bool FunctionAST::emitBytecode(BytecodeCompiler &C) {
+    const std::string &name = proto->getName();
+    unsigned numArgs = proto->getArgs().size();
+    if (proto->getArgTypes().find(type_tensor) != std::string::npos)
+        return false;
+
+    // Declared by an extern before: same function, now with a body.
+    unsigned id;
+    auto It = C.FunctionIds.find(name);
+    if (It != C.FunctionIds.end()) {
+        id = It->second;
+        if (C.P.Functions[id].defined || C.P.Functions[id].numArgs != numArgs)
+            return false;
+    } else {
+        id = C.P.Functions.size();
+        C.P.Functions.emplace_back();
+        C.P.Functions[id].name = name;
+        C.P.Functions[id].numArgs = numArgs;
+        C.FunctionIds[name] = id;
+    }
+    C.P.Functions[id].defined = true;   // Before the body, it may call itself
+
+    // The top level's state, functions are defined in between its statements.
+    unsigned savedFn = C.Fn, savedTop = C.Top, savedDepth = C.Depth;
+    auto savedLocals = std::move(C.Locals);
+
+    C.Fn = id;
+    C.Top = 0;
+    C.Locals.clear();
+    C.Depth = 0;
+    for (auto &arg : proto->getArgs())
+        C.Locals[arg] = C.newRegister();
+
+    bool ok = emitStatements(C, functionBody);
+    if (ok) {
+        // No return at the top of the body: 0, like codegen.
+        TempScope T(C);
+        unsigned zero = C.newRegister();
+        C.emit(op_loadk, zero, C.constant(0.0));
+        C.emit(op_ret, zero);
+    }
+
+    C.Fn = savedFn;
+    C.Top = savedTop;
+    C.Locals = std::move(savedLocals);
+    C.Depth = savedDepth;
+    return ok;
+}
+
+bool ExternAST::emitBytecode(BytecodeCompiler &C) {
+    const std::string &name = proto->getName();
+    unsigned numArgs = proto->getArgs().size();
+    if (proto->getArgTypes().find(type_tensor) != std::string::npos)
+        return false;
+
+    auto It = C.FunctionIds.find(name);
+    if (It != C.FunctionIds.end())
+        return C.P.Functions[It->second].numArgs == numArgs;
+
+    C.FunctionIds[name] = C.P.Functions.size();
+    C.P.Functions.emplace_back();
+    C.P.Functions.back().name = name;
+    C.P.Functions.back().numArgs = numArgs;
+    return true;
+}
+
+bool ImportStmtAST::emitBytecode(BytecodeCompiler &C) {
+    return false;   // Imported files are compiled to objects, JIT only
+}
+
+bool ExpressionStmtAST::emitBytecode(BytecodeCompiler &C) {
+    TempScope T(C);
+    return expr->emitBytecode(C) >= 0;
+}
+
+bool IfStmtAST::emitBytecode(BytecodeCompiler &C) {
+    size_t jz;
+    {
+        TempScope T(C);
+        int condV = cond->emitBytecode(C);
+        if (condV < 0)
+            return false;
+        jz = C.emit(op_jz, condV);
+    }
+
+    C.Depth++;
+    bool ok = emitStatements(C, thenBody);
+    size_t jmp = elseBody.empty() ? 0 : C.emit(op_jmp);
+    C.function().code[jz].b = C.here();
+    if (!elseBody.empty()) {
+        ok = ok && emitStatements(C, elseBody);
+        C.function().code[jmp].b = C.here();
+    }
+    C.Depth--;
+    return ok;
+}
+
+bool ForStmtAST::emitBytecode(BytecodeCompiler &C) {
+    // Reserved for the whole loop (and function): iterator, step, end.
+    unsigned it = C.newRegister();
+    unsigned stepReg = C.newRegister();
+    unsigned endReg = C.newRegister();
+
+    // Same order as codegen: start (the old binding of the iterator is
+    // still visible), bind the iterator, step, end. Step and end are only
+    // evaluated once.
+    {
+        TempScope T(C);
+        int startV = start->emitBytecode(C);
+        if (startV < 0)
+            return false;
+        emitMove(C, it, startV);
+        C.Locals[iterator] = it;
+
+        int stepV = step->emitBytecode(C);
+        if (stepV < 0)
+            return false;
+        emitMove(C, stepReg, stepV);
+
+        int endV = end->emitBytecode(C);
+        if (endV < 0)
+            return false;
+        emitMove(C, endReg, endV);
+    }
+
+    size_t prep = C.emit(op_forprep, it, 0, stepReg);
+    size_t body = C.here();
+
+    C.Depth++;
+    bool ok = emitStatements(C, forBody);
+    C.Depth--;
+
+    C.emit(op_forloop, it, body, stepReg);
+    C.function().code[prep].b = C.here();
+    return ok;
+}
+
+std::unique_ptr<BytecodeProgram> compileBytecode(LemonAST &Program, LemonJIT &(*StartJIT)()) {
+    auto P = std::make_unique<BytecodeProgram>(Program, StartJIT);
+    P->Functions.emplace_back();
+    P->Functions[0].name = "lemon_main";
+    P->Functions[0].defined = true;
+
+    BytecodeCompiler C(*P);
+    if (!Program.emitBytecode(C))
+        return nullptr;
+
+    // Externs: whatever the JIT would link them to, the process's symbols
+    // (its DynamicLibrarySearchGenerator), without starting the JIT for it.
+    auto Process = sys::DynamicLibrary::getPermanentLibrary(nullptr);
+    for (auto &F : P->Functions) {
+        if (F.defined)
+            continue;
+        if (F.numArgs > INTERP_MAX_NATIVE_ARGS)
+            return nullptr;
+
+        F.native = Process.getAddressOfSymbol(F.name.c_str());
+        if (!F.native)
+            return nullptr;
+    }
+    return P;
+}
+
+// ============================================================================
+//                               Interpreter
+// ============================================================================
+
+static double callNative(void *fn, unsigned numArgs, const double *a) {
+    switch (numArgs) {
+    case 0: return ((double (*)())fn)();
+    case 1: return ((double (*)(double))fn)(a[0]);
+    case 2: return ((double (*)(double, double))fn)(a[0], a[1]);
+    case 3: return ((double (*)(double, double, double))fn)(a[0], a[1], a[2]);
+    case 4: return ((double (*)(double, double, double, double))fn)(a[0], a[1], a[2], a[3]);
+    case 5: return ((double (*)(double, double, double, double, double))fn)(a[0], a[1], a[2], a[3], a[4]);
+    case 6: return ((double (*)(double, double, double, double, double, double))fn)(a[0], a[1], a[2], a[3], a[4], a[5]);
+    }
+    return 0.0;   // Never, compileBytecode() checks
+}
+
+static double callBuiltin(uint32_t builtin, const double *a) {
+    switch (builtin) {
+    case builtin_sqrt: return std::sqrt(a[0]);
+    case builtin_exp:  return std::exp(a[0]);
+    case builtin_log:  return std::log(a[0]);
+    case builtin_sin:  return std::sin(a[0]);
+    case builtin_cos:  return std::cos(a[0]);
+    case builtin_tanh: return std::tanh(a[0]);
+    case builtin_pow:  return std::pow(a[0], a[1]);
+    case builtin_fma:  return std::fma(a[0], a[1], a[2]);
+    case builtin_abs:  return std::fabs(a[0]);
+    case builtin_min:  return std::fmin(a[0], a[1]);    // minnum/maxnum: NaN loses
+    case builtin_max:  return std::fmax(a[0], a[1]);
+    }
+    return 0.0;
+}
+
+namespace {
+
+class Interpreter {
+    BytecodeProgram &P;
+    std::vector<double> Stack;      // Every frame's registers, frames index into it (it moves)
+
+public:
+    Interpreter(BytecodeProgram &P) : P(P) {}
+
+    // Runs P.Functions[fn] with its args at Stack[argsAt...].
+    double call(unsigned fn, size_t argsAt);
+
+private:
+    void promote();
+};
+
+} // namespace
+
+double Interpreter::call(unsigned fn, size_t argsAt) {
+    BytecodeFunction &F = P.Functions[fn];
+    size_t base = Stack.size();
+    Stack.resize(base + F.numRegs);
+    double *R = Stack.data() + base;
+    for (unsigned i = 0; i < F.numArgs; ++i)
+        R[i] = Stack[argsAt + i];
+
+    const Instr *code = F.code.data();
+    const double *K = P.Constants.data();
+    double *G = P.Globals.data();
+    size_t pc = 0;
+
+    while (true) {
+        const Instr &I = code[pc++];
+        switch (I.op) {
+        case op_loadk: R[I.a] = K[I.b]; break;
+        case op_move:  R[I.a] = R[I.b]; break;
+        case op_getg:  R[I.a] = G[I.b]; break;
+        case op_setg:  G[I.a] = R[I.b]; break;
+
+        case op_add: R[I.a] = R[I.b] + R[I.c]; break;
+        case op_sub: R[I.a] = R[I.b] - R[I.c]; break;
+        case op_mul: R[I.a] = R[I.b] * R[I.c]; break;
+        case op_div: R[I.a] = R[I.b] / R[I.c]; break;
+
+        // Unordered or ..., written so NaN makes them true.
+        case op_lt:  R[I.a] = !(R[I.b] >= R[I.c]); break;
+        case op_gt:  R[I.a] = !(R[I.b] <= R[I.c]); break;
+        case op_le:  R[I.a] = !(R[I.b] > R[I.c]); break;
+        case op_ge:  R[I.a] = !(R[I.b] < R[I.c]); break;
+        case op_eq:  R[I.a] = !(R[I.b] < R[I.c] || R[I.b] > R[I.c]); break;
+        case op_neq: R[I.a] = R[I.b] != R[I.c]; break;
+
+        case op_neg: R[I.a] = -R[I.b]; break;
+        case op_not: R[I.a] = !(R[I.b] < 0.0 || R[I.b] > 0.0); break;
+
+        case op_jmp:
+            pc = I.b;
+            break;
+        case op_jz:
+            if (!(R[I.a] < 0.0 || R[I.a] > 0.0))
+                pc = I.b;
+            break;
+        case op_forprep:
+            if (R[I.a] >= R[I.c + 1])
+                pc = I.b;
+            break;
+        case op_forloop:
+            F.hotness++;
+            R[I.a] += R[I.c];
+            if (!(R[I.a] >= R[I.c + 1]))
+                pc = I.b;
+            break;
+
+        case op_call: {
+            BytecodeFunction &Callee = P.Functions[I.b];
+            if (!Callee.native && !P.promoted && ++Callee.hotness >= INTERP_HOT_THRESHOLD)
+                promote();
+
+            double val = Callee.native ? callNative(Callee.native, Callee.numArgs, R + I.c)
+                                       : call(I.b, base + I.c);
+            R = Stack.data() + base;    // The callee's frame may have moved the stack
+            R[I.a] = val;
+            break;
+        }
+        case op_builtin:
+            R[I.a] = callBuiltin(I.b, R + I.c);
+            break;
+
+        case op_ret: {
+            double val = R[I.a];
+            Stack.resize(base);
+            return val;
+        }
+        }
+    }
+}
+
+// Every function through the JIT, at once (they call each other). Globals
+// stay where they are: the module declares them, and they're defined as
+// absolute symbols at the interpreter's slots. Only tried once, if it
+// doesn't work the interpreter just keeps going.
+void Interpreter::promote() {
+    P.promoted = true;
+    if (P.redeclaredGlobals)
+        return;
+
+    LemonJIT &JIT = P.StartJIT();
+    auto Session = CompilerSession::Create(JIT);
+    if (!Session) {
+        consumeError(Session.takeError());
+        return;
+    }
+    CompilerSession &S = **Session;
+
+    for (auto &[name, slot] : P.GlobalSlots) {
+        S.GlobalVariables[name] = new GlobalVariable(*S.TheModule, Type::getDoubleTy(*S.TheContext), false,
+                                                     GlobalValue::ExternalLinkage, nullptr, name);
+    }
+
+    // Functions only, the top level keeps running in here.
+    for (auto &stmt : P.Program.getStatements()) {
+        if (dynamic_cast<FunctionAST *>(stmt.get()) || dynamic_cast<ExternAST *>(stmt.get()))
+            stmt->codegen(S, "_global");
+    }
+    if (!S.Diagnostics.empty())
+        return;
+
+    for (auto &[name, slot] : P.GlobalSlots) {
+        if (auto Err = JIT.defineAbsolute(name, &P.Globals[slot])) {
+            consumeError(std::move(Err));
+            return;
+        }
+    }
+
+    auto TSM = ThreadSafeModule(std::move(S.TheModule), std::move(S.TheContext));
+    if (auto Err = JIT.addModule(std::move(TSM))) {
+        consumeError(std::move(Err));
+        return;
+    }
+
+    for (size_t i = 1; i < P.Functions.size(); ++i) {
+        BytecodeFunction &F = P.Functions[i];
+        if (!F.defined || F.numArgs > INTERP_MAX_NATIVE_ARGS)
+            continue;
+
+        auto Sym = JIT.lookup(F.name);
+        if (!Sym) {
+            consumeError(Sym.takeError());
+            continue;
+        }
+        F.native = Sym->getAddress().toPtr<void *>();
+    }
+}
+
+double runBytecode(BytecodeProgram &P) {
+    Interpreter I(P);
+    return I.call(0, 0);
+}
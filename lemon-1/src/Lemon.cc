@@ -0,0 +1,147 @@
+#include "../include/Lemon.h"
+#include "../include/CompilerSession.h"
+#include "../include/Parser.h"
+#include "../include/Runtime.h"
+
+#include <atomic>
+#include <mutex>
+
+namespace lemon {
+
+// Codegen indexes the descriptor with this layout (see TENSOR_MAX_RANK).
+static_assert(TensorRef::MaxRank == TENSOR_MAX_RANK, "TensorRef out of sync with the compiler");
+static_assert(sizeof(TensorRef) == 8 * (2 + 2 * TENSOR_MAX_RANK), "TensorRef must not have padding");
+static_assert(type_double == 'd' && type_tensor == 't', "argKind() out of sync with ArgType");
+
+struct Program::State {
+    LemonJIT *JIT = nullptr;
+    JITDylib *JD = nullptr;                     // All of the program's code, null if it never got that far
+    std::map<std::string, std::string> Signatures;  // Functions the program defines or imports -> arg types ("dt")
+    void *Main = nullptr;                       // lemon_main
+    std::string Errors;
+};
+
+// One JIT for the whole process, every program gets its own JITDylib in it.
+// Never destroyed, a Program in a static could outlive it otherwise.
+static LemonJIT *getJIT(std::string &error) {
+    static std::once_flag Once;
+    static LemonJIT *JIT = nullptr;
+    static std::string InitError;
+
+    std::call_once(Once, [] {
+        InitializeNativeTarget();
+        InitializeNativeTargetAsmPrinter();
+        InitializeNativeTargetAsmParser();
+
+        auto J = LemonJIT::Create();
+        if (!J) {
+            InitError = "🍋 Failed to create the JIT: " + toString(J.takeError()) + "\n";
+            return;
+        }
+
+        // The host usually doesn't export the runtime (no -rdynamic), so
+        // the process symbol table can't find it.
+        for (auto [name, addr] : {std::pair<const char *, void *>{"putchard", (void *)&putchard},
+                                  std::pair<const char *, void *>{"printd", (void *)&printd}}) {
+            if (auto Err = (*J)->defineAbsolute(name, addr)) {
+                InitError = "🍋 Failed to define " + std::string(name) + ": " + toString(std::move(Err)) + "\n";
+                return;
+            }
+        }
+        JIT = J->release();
+    });
+
+    error = InitError;
+    return JIT;
+}
+
+Program::Program() : St(std::make_unique<State>()) {}
+Program::Program(Program &&) = default;
+Program &Program::operator=(Program &&) = default;
+
+Program::~Program() {
+    if (!St || !St->JD)
+        return;
+    if (auto Err = St->JIT->removeJITDylib(*St->JD))
+        St->JIT->getExecutionSession().reportError(std::move(Err));
+}
+
+Program::operator bool() const {
+    return St && St->Main;
+}
+
+const std::string &Program::getErrors() const {
+    return St->Errors;
+}
+
+void *Program::lookup(const std::string &name, const std::string &argKinds) const {
+    if (!St->Main)
+        return nullptr;
+
+    auto it = St->Signatures.find(name);
+    if (it == St->Signatures.end() || it->second != argKinds)
+        return nullptr;
+
+    auto Sym = St->JIT->lookup(*St->JD, name);
+    if (!Sym) {
+        consumeError(Sym.takeError());
+        return nullptr;
+    }
+    return Sym->getAddress().toPtr<void *>();
+}
+
+double Program::run() const {
+    if (!St->Main)
+        return 0;
+    return reinterpret_cast<double (*)()>(St->Main)();
+}
+
+Program compile(const std::string &source, const CompileOptions &Opts) {
+    static std::atomic<unsigned> NextProgram{0};
+
+    Program P;
+    Program::State &St = *P.St;
+
+    St.JIT = getJIT(St.Errors);
+    if (!St.JIT)
+        return P;
+
+    auto Session = CompilerSession::Create(*St.JIT);
+    if (!Session) {
+        St.Errors = "🍋 " + toString(Session.takeError()) + "\n";
+        return P;
+    }
+    CompilerSession &S = **Session;
+    S.DiagnosticLog = &St.Errors;
+
+    std::string error;
+    if (!S.setSource(Opts.Path, source.data(), source.data() + source.size(), error)) {
+        St.Errors = "🍋 " + error + "\n";
+        return P;
+    }
+    S.Lex.getNextToken();
+    auto AST = Parser(S).Parse();
+    if (S.printDiagnostics())
+        return P;
+
+    // From here on the program has code in the JIT, ~Program frees it.
+    S.createProgramJITDylib("<program " + std::to_string(NextProgram++) + ">");
+    St.JD = S.ProgramJD;
+
+    if (!S.compileProgram(*AST, Opts.Path))
+        return P;
+
+    for (auto &[name, proto] : S.FunctionProtos)
+        St.Signatures[name] = proto->getArgTypes();
+
+    // Compiles the whole module now, so get() is just a symbol lookup.
+    auto Main = S.loadProgram();
+    if (!Main) {
+        St.Errors = "🍋 " + toString(Main.takeError()) + "\n";
+        return P;
+    }
+    St.Main = reinterpret_cast<void *>(*Main);
+    return P;
+}
+
+}
@@ -1,39 +1,116 @@
 #include "../include/Lexer.h"
 
-std::string idStr;
-double numVal;
-int curTok;
-char curChar = ' ';
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <algorithm>
 
-int gettok() {
-    while(isspace(curChar)) curChar = getchar();
-
-    // Alpha-numeric identifiers (keywords or IDs)
-    if (isalpha(curChar)) {
-        idStr = curChar;
+void Lexer::setSource(const char *begin, const char *end) {
+    srcBegin = srcCur = begin;
+    srcEnd = end;
+    curChar = ' ';
+    curTok = 0;
+    LexOffset = 0;
+    CurRange = {};
+    PrevTokEnd = 0;
+    LineStarts.clear();
+}
 
-        while(isalnum(curChar = getchar())) {
-            idStr += curChar;
+LineCol Lexer::getLineCol(uint32_t offset) {
+    if (LineStarts.empty()) {
+        LineStarts.push_back(0);
+        for (const char *p = srcBegin; p && p < srcEnd; ++p) {
+            p = (const char *)memchr(p, '\n', srcEnd - p);
+            if (!p)
+                break;
+            LineStarts.push_back(p - srcBegin + 1);
         }
+    }
 
-        // Check for keywords
-        if (idStr == "func")    
-            return tok_func;
-        if (idStr == "var")
-            return tok_var;
-        if (idStr == "extern")
-            return tok_extern;
-        if (idStr == "return")
-            return tok_return;
-        if (idStr == "if")
+    // Last line starting at or before offset.
+    auto it = std::upper_bound(LineStarts.begin(), LineStarts.end(), offset) - 1;
+    return {(unsigned)(it - LineStarts.begin()) + 1, offset - *it + 1};
+}
+
+// Keywords are picked by length and first char, so an identifier is compared
+// against at most one keyword string (and most against none).
+// New keywords go in the case for their length.
+int lookupKeyword(std::string_view id) {
+    switch (id.size()) {
+    case 2:
+        if (id == "if")
             return tok_if;
-        if (idStr == "else")
-            return tok_else;
-        if (idStr == "for")
-            return tok_for;
+        break;
+    case 3:
+        switch (id[0]) {
+        case 'v':
+            if (id == "var")
+                return tok_var;
+            break;
+        case 'f':
+            if (id == "for")
+                return tok_for;
+            break;
+        }
+        break;
+    case 4:
+        switch (id[0]) {
+        case 'f':
+            if (id == "func")
+                return tok_func;
+            break;
+        case 'e':
+            if (id == "else")
+                return tok_else;
+            break;
+        }
+        break;
+    case 6:
+        switch (id[0]) {
+        case 'e':
+            if (id == "extern")
+                return tok_extern;
+            break;
+        case 'i':
+            if (id == "import")
+                return tok_import;
+            break;
+        case 'r':
+            if (id == "return")
+                return tok_return;
+            break;
+        }
+        break;
+    }
+
+    // Not keyword
+    return tok_id;
+}
+
+int Lexer::getNextChar() {
+    if (srcCur >= srcEnd) {
+        LexOffset = srcEnd - srcBegin;
+        return EOF;
+    }
+
+    LexOffset = srcCur - srcBegin;
+    return (unsigned char)*srcCur++;
+}
+
+int Lexer::lexToken() {
+    while(isspace(curChar)) curChar = getNextChar();
+
+    CurRange.Begin = LexOffset;
 
-        // Not keyword
-        return tok_id; 
+    // Alpha-numeric identifiers (keywords or IDs)
+    if (isalpha(curChar)) {
+        uint32_t idBegin = LexOffset;
+        while(isalnum(curChar = getNextChar()))
+            ;
+
+        // No copy, the identifier is just a view of the source.
+        idStr = std::string_view(srcBegin + idBegin, LexOffset - idBegin);
+        return lookupKeyword(idStr);
     }
 
     // Numerical values, standard parsing, doesn't check for xx.xx.xx
@@ -42,7 +119,7 @@ int gettok() {
         std::string numStr;
         do {
             numStr += curChar;
-            curChar = getchar();
+            curChar = getNextChar();
         } while (isdigit(curChar) || curChar == '.');
 
         numVal = strtod(numStr.c_str(), 0);
@@ -52,96 +129,124 @@ int gettok() {
     // Comments
 	if (curChar == '#') {
 		do 
-			curChar = getchar();
+			curChar = getNextChar();
         while(curChar != EOF && curChar != '\n' && curChar != '\r');
 
         if (curChar != EOF)
-            return gettok();
+            return lexToken();
 	}
 
     // Brace, parens 
     if (curChar == '{') {
-        curChar = getchar();
+        curChar = getNextChar();
         return tok_lbrace;
     }
     if (curChar == '}') {
-        curChar = getchar();
+        curChar = getNextChar();
         return tok_rbrace;
     }
     if (curChar == '(') {
-        curChar = getchar();
+        curChar = getNextChar();
         return tok_lparen;
     }
     if (curChar == ')') {
-        curChar = getchar();
+        curChar = getNextChar();
         return tok_rparen;
     }
+    if (curChar == '[') {
+        curChar = getNextChar();
+        return tok_lbracket;
+    }
+    if (curChar == ']') {
+        curChar = getNextChar();
+        return tok_rbracket;
+    }
     
     // Binary OPs
     if (curChar == '+') {
-        curChar = getchar();
+        curChar = getNextChar();
         return tok_add;
     }
     if (curChar == '-') {
-        curChar = getchar();
+        curChar = getNextChar();
         return tok_sub;
     }
     if (curChar == '*') {
-        curChar = getchar();
+        curChar = getNextChar();
         return tok_mul;
     }
     if (curChar == '/') {
-        curChar = getchar();
+        curChar = getNextChar();
         return tok_div;
     }
 
     // Comparison ops, need to peak next char.
     if (curChar == '<') {
-        char peakChar = getchar();
+        char peakChar = getNextChar();
         if (peakChar == '=') {
-            curChar = getchar();
+            curChar = getNextChar();
             return tok_le;
         }
         curChar = peakChar;
         return tok_lt;
     }
     if (curChar == '>') {
-        char peakChar = getchar();
+        char peakChar = getNextChar();
         if (peakChar == '=') {
-            curChar = getchar();
+            curChar = getNextChar();
             return tok_ge;
         }
         curChar = peakChar;
         return tok_gt;
     }
     if (curChar == '=') {
-        char peakChar = getchar();
+        char peakChar = getNextChar();
         if (peakChar == '=') {
-            curChar = getchar();
+            curChar = getNextChar();
             return tok_eq;
         }
         curChar = peakChar;
         return tok_assign;
     }
     if (curChar == '!') {
-        char peakChar = getchar();
+        char peakChar = getNextChar();
         if (peakChar == '=') {
-            curChar = getchar();
+            curChar = getNextChar();
             return tok_neq;
         }
-        // put it back because now '!' is undefined op (for now...)
-        ungetc(peakChar, stdin);
+        curChar = peakChar;
+        return tok_not;
+    }
+
+    // "string", only used for import paths. No escapes, can't span lines.
+    if (curChar == '"') {
+        uint32_t strBegin = LexOffset + 1;
+        do
+            curChar = getNextChar();
+        while (curChar != '"' && curChar != '\n' && curChar != EOF);
+
+        // Unterminated, hand the parser the bare quote.
+        if (curChar != '"')
+            return '"';
+
+        idStr = std::string_view(srcBegin + strBegin, LexOffset - strBegin);
+        curChar = getNextChar(); // Consume closing '"'
+        return tok_string;
     }
 
     // Special symbols
     if (curChar == ';') {
-        curChar = getchar();
+        curChar = getNextChar();
         return tok_semi;
     } 
     if (curChar == ',') {
-        curChar = getchar();
+        curChar = getNextChar();
         return tok_comma;
     }
+    if (curChar == ':') {
+        curChar = getNextChar();
+        return tok_colon;
+    }
 
     // EOF
     if (curChar == EOF)
@@ -149,35 +254,40 @@ int gettok() {
     
     // Anything else not supported.
     int unsupportedChar = curChar;
-    curChar = getchar();
+    curChar = getNextChar();
     return unsupportedChar;
 }
 
+int Lexer::gettok() {
+    int tok = lexToken();
+    CurRange.End = LexOffset;   // curChar is the first char after the token
+    return tok;
+}
+
 
-int getNextToken() {
+int Lexer::getNextToken() {
+    PrevTokEnd = CurRange.End;
     return curTok = gettok();
 }
 
-int peakNextToken() {
+int Lexer::peakNextToken() {
+    // Lex the next token, then rewind to where we were.
+    const char *savedCur = srcCur;
+    uint32_t savedLexOffset = LexOffset;
+    SourceRange savedRange = CurRange;
+    char savedChar = curChar;
+    std::string_view savedIdStr = idStr;
+    double savedNumVal = numVal;
+
     int nextTok = gettok(); // Gets token starting at curChar
-    std::string nextTokStr = tokenToString(nextTok);
-
-    // Put string back to input stream.
-    if (nextTok != tok_eof)  {
-        // put white space back first
-        // Put each character one by one back to input stream.
-        // Reverse order
-        // Put back curChar first.
-        if (ungetc(curChar, stdin) == EOF) {
-            fprintf(stderr, "🍋 (%c) Failed to ungetc curChar.", curChar);
-        }
-        for (auto it = nextTokStr.rbegin(); it != nextTokStr.rend(); ++it) {
-            if (ungetc(*it, stdin) == EOF) {
-                fprintf(stderr, "🍋 (%c) Failed to ungetc token char.", *it);
-            }
-        }
-        curChar = ' '; // reset curChar so parsing doesn't kill itself...
-    }
+
+    srcCur = savedCur;
+    LexOffset = savedLexOffset;
+    CurRange = savedRange;
+    curChar = savedChar;
+    idStr = savedIdStr;
+    numVal = savedNumVal;
+
     return nextTok;
 }
 
@@ -214,9 +324,9 @@ std::string tokenToString(int token) {
     case tok_var:
         return "var";
     case tok_id:
-        return idStr;
+        return "identifier";
     case tok_num:
-        return std::to_string(numVal);
+        return "number";
     case tok_extern:
         return "extern";
     case tok_if:
@@ -237,6 +347,18 @@ std::string tokenToString(int token) {
         return "!=";
     case tok_for:
         return "for";
+    case tok_not:
+        return "!";
+    case tok_import:
+        return "import";
+    case tok_string:
+        return "string";
+    case tok_lbracket:
+        return "[";
+    case tok_rbracket:
+        return "]";
+    case tok_colon:
+        return ":";
     default:
         return "Unknown Token";
     }
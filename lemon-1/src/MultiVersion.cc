@@ -0,0 +1,130 @@
+#include "../include/MultiVersion.h"
+#include "../include/AST.h"
+
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/TargetParser/Triple.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+
+int MULTIVERSION = 0;
+
+// Bits in __cpu_model.__cpu_features[0], same layout in libgcc and compiler-rt.
+enum CPUFeatureBit {
+    FEATURE_POPCNT   = 2,
+    FEATURE_SSE4_2   = 8,
+    FEATURE_AVX2     = 10,
+    FEATURE_FMA      = 14,
+    FEATURE_AVX512F  = 15,
+    FEATURE_BMI      = 16,
+    FEATURE_BMI2     = 17,
+    FEATURE_AVX512VL = 20,
+    FEATURE_AVX512BW = 21,
+    FEATURE_AVX512DQ = 22,
+    FEATURE_AVX512CD = 23,
+};
+
+struct ISAVariant {
+    const char *suffix;
+    const char *features;   // "target-features" for the clone
+    uint32_t cpuMask;       // Required __cpu_features bits
+};
+
+// Best first, the resolver picks the first one the CPU supports.
+static const ISAVariant Variants[] = {
+    {"avx512", "+avx512f,+avx512vl,+avx512bw,+avx512dq,+avx512cd,+avx2,+fma,+bmi,+bmi2,+popcnt",
+     (1u << FEATURE_AVX512F) | (1u << FEATURE_AVX512VL) | (1u << FEATURE_AVX512BW) | 
+     (1u << FEATURE_AVX512DQ) | (1u << FEATURE_AVX512CD) | (1u << FEATURE_AVX2) |
+     (1u << FEATURE_FMA) | (1u << FEATURE_BMI) | (1u << FEATURE_BMI2)},
+    {"avx2", "+avx2,+fma,+bmi,+bmi2,+popcnt",
+     (1u << FEATURE_AVX2) | (1u << FEATURE_FMA) | (1u << FEATURE_BMI) | (1u << FEATURE_BMI2)},
+    {"sse4.2", "+sse4.2,+popcnt",
+     (1u << FEATURE_SSE4_2) | (1u << FEATURE_POPCNT)},
+};
+
+static bool hasLoops(Function *F) {
+    DominatorTree DT(*F);
+    LoopInfo LI(DT);
+    return !LI.empty();
+}
+
+static Function *cloneVariant(Function *F, const std::string &suffix) {
+    ValueToValueMapTy VMap;
+    Function *Clone = CloneFunction(F, VMap);
+    Clone->setName(F->getName() + "." + suffix);
+    Clone->setLinkage(GlobalValue::InternalLinkage);
+    return Clone;
+}
+
+void multiVersionFunction(Function *F, FunctionPassManager &FPM, FunctionAnalysisManager &FAM) {
+    Module *M = F->getParent();
+
+    if (Triple(M->getTargetTriple()).getArch() != Triple::x86_64)
+        return;
+    
+    if (!hasLoops(F))
+        return;
+
+    LLVMContext &Ctx = M->getContext();
+    Type *PtrTy = PointerType::getUnqual(Ctx);
+
+    // 1. Clones, baseline first. Each one is optimized with its own features,
+    //    so the vectorizer picks the right vector width for it.
+    Function *Default = cloneVariant(F, "default");
+    FPM.run(*Default, FAM);
+
+    std::vector<Function *> Clones;
+    for (auto &variant : Variants) {
+        Function *Clone = cloneVariant(F, variant.suffix);
+        Clone->addFnAttr("target-features", variant.features);
+        FPM.run(*Clone, FAM);
+        Clones.push_back(Clone);
+    }
+
+    // 2. Resolver, runs once as a global constructor.
+    GlobalVariable *Resolved = new GlobalVariable(*M, PtrTy, false, 
+                                                  GlobalValue::InternalLinkage,
+                                                  ConstantPointerNull::get(cast<PointerType>(PtrTy)),
+                                                  F->getName() + ".resolved");
+    
+    StructType *CPUModelTy = StructType::get(Ctx, {
+        Type::getInt32Ty(Ctx), Type::getInt32Ty(Ctx), Type::getInt32Ty(Ctx),
+        ArrayType::get(Type::getInt32Ty(Ctx), 1)
+    });
+    auto *CPUModel = M->getOrInsertGlobal("__cpu_model", CPUModelTy);
+    FunctionCallee CPUInit = M->getOrInsertFunction("__cpu_indicator_init",     // int (void) in libgcc/compiler-rt
+                                                    FunctionType::get(Type::getInt32Ty(Ctx), false));
+
+    Function *Resolver = Function::Create(FunctionType::get(Type::getVoidTy(Ctx), false),
+                                          Function::InternalLinkage,
+                                          F->getName() + ".resolver", M);
+    IRBuilder<> TmpBuilder(BasicBlock::Create(Ctx, "entry", Resolver));
+    TmpBuilder.CreateCall(CPUInit, {});
+
+    Value *FeaturesPtr = TmpBuilder.CreateConstInBoundsGEP2_32(CPUModelTy, CPUModel, 0, 3);
+    Value *Features = TmpBuilder.CreateLoad(Type::getInt32Ty(Ctx), FeaturesPtr, "features");
+
+    // Walk from worst to best, so the best supported variant wins.
+    Value *Chosen = Default;
+    for (int i = Clones.size()-1; i >= 0; --i) {
+        Value *Mask = TmpBuilder.getInt32(Variants[i].cpuMask);
+        Value *Has = TmpBuilder.CreateICmpEQ(TmpBuilder.CreateAnd(Features, Mask), Mask);
+        Chosen = TmpBuilder.CreateSelect(Has, Clones[i], Chosen);
+    }
+    TmpBuilder.CreateStore(Chosen, Resolved);
+    TmpBuilder.CreateRetVoid();
+
+    appendToGlobalCtors(*M, Resolver, 65535);
+
+    // 3. F becomes the dispatcher, callers keep calling F.
+    F->deleteBody();
+    TmpBuilder.SetInsertPoint(BasicBlock::Create(Ctx, "entry", F));
+
+    std::vector<Value *> args;
+    for (auto &arg : F->args())
+        args.push_back(&arg);
+
+    Value *Target = TmpBuilder.CreateLoad(PtrTy, Resolved, "target");
+    CallInst *Call = TmpBuilder.CreateCall(F->getFunctionType(), Target, args, "dispatch");
+    Call->setTailCallKind(CallInst::TCK_MustTail);
+    TmpBuilder.CreateRet(Call);
+}
@@ -1,21 +1,45 @@
 #include "../include/Parser.h"
 #include "../include/Lexer.h"
 
+#include <algorithm>
+
 
 // ============================================================================
 //                                Variables
 // ============================================================================
-std::map<int, int> operatorPrecedence;
-
+// Binary operators, indexed by -tok (named tokens are negative, single chars
+// are never binary operators). Built at compile time, a lookup is one load.
+struct BinaryOpTable {
+    BinaryOpInfo ops[NumTokenKinds] = {};
+
+    constexpr BinaryOpTable() {
+        // comparison ops
+        ops[-tok_lt] = {10, false};
+        ops[-tok_gt] = {10, false};
+        ops[-tok_le] = {10, false};
+        ops[-tok_ge] = {10, false};
+        ops[-tok_eq] = {10, false};
+        ops[-tok_neq] = {10, false};
+
+        // expr ops
+        ops[-tok_add] = {20, false};
+        ops[-tok_sub] = {20, false};
+        ops[-tok_mul] = {40, false};
+        ops[-tok_div] = {40, false};
+    }
+};
 
-int getPrecedence(int tok) {
-    // All precedence is > 0
-    int precedence = operatorPrecedence[tok];
+constexpr BinaryOpTable BinaryOps;
 
-    if (precedence <= 0)
-        return -1;
+BinaryOpInfo getBinaryOp(int tok) {
+    if (tok >= 0 || -tok >= NumTokenKinds)
+        return {0, false};
+    return BinaryOps.ops[-tok];
+}
 
-    return precedence;
+// From the start of `start` to the end of the last consumed token.
+SourceRange Parser::rangeFrom(SourceRange start) {
+    return {start.Begin, Lex.PrevTokEnd};
 }
 
 
@@ -23,61 +47,110 @@ int getPrecedence(int tok) {
 //                               Error Helpers 
 // ============================================================================
 
-std::unique_ptr<ExprAST> LogError(const char *str) {
-    fprintf(stderr, "ERROR: %s\n", str);
+// Parse errors point at the token the parser choked on.
+std::unique_ptr<ExprAST> Parser::LogError(const char *str) {
+    S.reportError(Lex.CurRange, str);
     return nullptr;
 }
 
-std::unique_ptr<PrototypeAST> LogErrorP(const char *str) {
+std::unique_ptr<PrototypeAST> Parser::LogErrorP(const char *str) {
     LogError(str);
     return nullptr;
 }
 
-std::unique_ptr<StmtAST> LogErrorS(const char *str) {
-    fprintf(stderr, "ERROR: %s\n", str);
+std::unique_ptr<StmtAST> Parser::LogErrorS(const char *str) {
+    LogError(str);
     return nullptr;
 }
 
-std::unique_ptr<FunctionAST> LogErrorF(const char *str) {
-    fprintf(stderr, "ERROR: %s\n", str);
+std::unique_ptr<FunctionAST> Parser::LogErrorF(const char *str) {
+    LogError(str);
     return nullptr;
 }
 
-Value *LogErrorV(const char *Str) {
-  LogError(Str);
-  return nullptr;
-}
-
 // ============================================================================
 //                              Parsing Functions 
 // ============================================================================
 
-std::unique_ptr<LemonAST> Parse() {
+// Panic mode: skip the rest of a broken statement so parsing can go on and
+// report the next error too. Stops after a ';' or a whole '{ ... }' block, 
+// before a '}' closing the enclosing block, or before a keyword that starts 
+// a new statement.
+void Parser::synchronize() {
+    int depth = 0;
+    while (Lex.curTok != tok_eof) {
+        switch (Lex.curTok) {
+        case tok_semi:
+            Lex.getNextToken();
+            if (depth == 0)
+                return;
+            continue;
+        case tok_lbrace:
+            depth++;
+            break;
+        case tok_rbrace:
+            if (depth == 0)
+                return;
+            Lex.getNextToken();
+            if (--depth == 0)
+                return;
+            continue;
+        case tok_var:
+        case tok_func:
+        case tok_extern:
+        case tok_import:
+        case tok_return:
+        case tok_if:
+        case tok_for:
+            if (depth == 0)
+                return;
+            break;
+        }
+        Lex.getNextToken();
+    }
+}
+
+std::unique_ptr<LemonAST> Parser::Parse() {
     auto stmtList = ParseStatementList();
 
+    // Nothing to close at the top level, complain and keep going.
+    while (Lex.curTok == tok_rbrace) {
+        LogErrorS("Unmatched '}'.");
+        Lex.getNextToken();
+
+        auto rest = ParseStatementList();
+        for (auto &stmt : rest)
+            stmtList.push_back(std::move(stmt));
+    }
+
     return std::make_unique<LemonAST>(std::move(stmtList), 0);
 }
 
-std::vector<std::unique_ptr<StmtAST>> ParseStatementList() {
+std::vector<std::unique_ptr<StmtAST>> Parser::ParseStatementList() {
     std::vector<std::unique_ptr<StmtAST>> stmtList;
     
     while(true) {
-        if (curTok == tok_eof || curTok == tok_rbrace) 
+        if (Lex.curTok == tok_eof || Lex.curTok == tok_rbrace) 
             break;
 
-        stmtList.push_back(ParseStatement());
+        auto stmt = ParseStatement();
+        if (!stmt) {
+            synchronize();
+            continue;
+        }
+        stmtList.push_back(std::move(stmt));
     }
 
     return stmtList;
 }
 
-std::unique_ptr<StmtAST> ParseStatement() {
+std::unique_ptr<StmtAST> Parser::ParseStatement() {
     // Handles return, decl, assign. 
     //     - Functions defs and externs are handled at higher level (?)
 
     // Future: if/else, for, while.
 
-    switch (curTok) {
+    switch (Lex.curTok) {
         case tok_return:
             return ParseReturn();
         case tok_var:
@@ -90,103 +163,141 @@ std::unique_ptr<StmtAST> ParseStatement() {
             return ParseFunction();
         case tok_extern:
             return ParseExtern();
+        case tok_import:
+            return ParseImport();
         case tok_for:
             return ParseForStmt();
         
         default:
-            return nullptr;
-            // fprintf(stderr, "ERROR: Token '%d' is not defined.\n", curTok);
-            // return LogErrorS("Unknown token when parsing statement.");
+            return LogErrorS("Expected a statement.");
     }
 }
 
-std::unique_ptr<StmtAST> ParseReturn() {
+std::unique_ptr<StmtAST> Parser::ParseReturn() {
+    SourceRange loc = Lex.CurRange;
     // return EXPR;
-    getNextToken(); // Consume 'return' keyword
+    Lex.getNextToken(); // Consume 'return' keyword
 
     auto E = ParseExpression();
 
     if (!E)
         return LogErrorS("Expected expression in return statement.");
 
-    if (curTok != tok_semi)
+    if (Lex.curTok != tok_semi)
         return LogErrorS("Expected ';' after return statement.");
-    getNextToken();
+    Lex.getNextToken();
     
-    return std::make_unique<ReturnStmtAST>(std::move(E));
+    return std::make_unique<ReturnStmtAST>(rangeFrom(loc), std::move(E));
 }
 
-std::unique_ptr<StmtAST> ParseVariableDecl() {
+std::unique_ptr<StmtAST> Parser::ParseVariableDecl() {
+    SourceRange loc = Lex.CurRange;
     // var ID = EXPR;
     // Does not allow chaining (yet): var ID1, ID1, ID3, = EXPR1, EXPR2, EXPR3;
 
     std::string varName;
-    getNextToken(); // Consume 'var' kw
+    Lex.getNextToken(); // Consume 'var' kw
 
-    varName = idStr;
-    getNextToken(); // Consume ID
+    if (Lex.curTok != tok_id)
+        return LogErrorS("Expected identifier after 'var'.");
+    varName = Lex.idStr;
+    Lex.getNextToken(); // Consume ID
 
-    if (curTok != tok_assign)
+    if (Lex.curTok != tok_assign)
         return LogErrorS("Expected '=' in variable declaration statement.");
-    getNextToken(); // Consume '='
+    Lex.getNextToken(); // Consume '='
         
     auto E = ParseExpression();
     if (!E)
         return nullptr;
 
-    if (curTok != tok_semi)
+    if (Lex.curTok != tok_semi)
         return LogErrorS("Expected ';' after statement.");
-    getNextToken();
+    Lex.getNextToken();
     
-    return std::make_unique<VariableDeclStmt>(varName, std::move(E));
+    return std::make_unique<VariableDeclStmt>(rangeFrom(loc), varName, std::move(E));
 }
 
-std::unique_ptr<StmtAST> ParseVariableAssignOrFunctionCall() {
-    int peakedToken = peakNextToken();
+std::unique_ptr<StmtAST> Parser::ParseVariableAssignOrFunctionCall() {
+    SourceRange loc = Lex.CurRange;
+    int peakedToken = Lex.peakNextToken();
 
     if (peakedToken == tok_assign) {
         return ParseVariableAssign();
     }
+    else if (peakedToken == tok_lbracket) {
+        return ParseIndexAssign();
+    }
     else if (peakedToken == tok_lparen) {
         auto expr = ParseIdentifierExpr(); // should return a function call.
+        if (!expr)
+            return nullptr;
         
-        if (curTok != tok_semi)
+        if (Lex.curTok != tok_semi)
             return LogErrorS("Expected ';' after expression statement.");
-        getNextToken(); // Consume ';'
+        Lex.getNextToken(); // Consume ';'
 
-        return std::make_unique<ExpressionStmtAST>(std::move(expr));
+        return std::make_unique<ExpressionStmtAST>(rangeFrom(loc), std::move(expr));
     }
-    return nullptr; 
+    Lex.getNextToken(); // Consume ID, the error is about what follows it.
+    return LogErrorS("Expected '=', '[' or '(' after identifier."); 
 }
 
-std::unique_ptr<StmtAST> ParseVariableAssign() {
+std::unique_ptr<StmtAST> Parser::ParseVariableAssign() {
+    SourceRange loc = Lex.CurRange;
     // ID = EXPR;
     // Does not allow chaining.
-    std::string varName = idStr;
-    getNextToken(); // consume ID
+    std::string varName(Lex.idStr);
+    Lex.getNextToken(); // consume ID
 
-    if (curTok != tok_assign)
+    if (Lex.curTok != tok_assign)
         return LogErrorS("Expected '=' in variable assignment statement.");
-    getNextToken();
+    Lex.getNextToken();
 
     auto E = ParseExpression();
     if (!E)
         return nullptr;
 
-    if (curTok != tok_semi)
+    if (Lex.curTok != tok_semi)
         return LogErrorS("Expected ';' after statement.");
-    getNextToken();
+    Lex.getNextToken();
     
-    return std::make_unique<AssignmentStmt>(varName, std::move(E));
+    return std::make_unique<AssignmentStmt>(rangeFrom(loc), varName, std::move(E));
+}
+
+std::unique_ptr<StmtAST> Parser::ParseIndexAssign() {
+    SourceRange loc = Lex.CurRange;
+    // ID [ EXPR, ... ] = EXPR;
+    std::string tensorName(Lex.idStr);
+    Lex.getNextToken(); // consume ID
+
+    std::vector<std::unique_ptr<ExprAST>> indices;
+    if (!ParseIndexList(indices))
+        return nullptr;
+
+    if (Lex.curTok != tok_assign)
+        return LogErrorS("Expected '=' after tensor index.");
+    Lex.getNextToken();
+
+    auto E = ParseExpression();
+    if (!E)
+        return nullptr;
+
+    if (Lex.curTok != tok_semi)
+        return LogErrorS("Expected ';' after statement.");
+    Lex.getNextToken();
+
+    return std::make_unique<IndexAssignStmt>(rangeFrom(loc), tensorName, std::move(indices), std::move(E));
 }
 
 // ============================================================================
 // Function and Function signature (Prototype)
 // ============================================================================
 
-std::unique_ptr<FunctionAST> ParseFunction() {
+std::unique_ptr<FunctionAST> Parser::ParseFunction() {
+    SourceRange loc = Lex.CurRange;
     // func ID ( arg_list ) { STATEMENT LIST }
-    getNextToken(); // Consumes 'func' keyword
+    Lex.getNextToken(); // Consumes 'func' keyword
     
     auto proto = ParsePrototype();
 
@@ -195,142 +306,177 @@ std::unique_ptr<FunctionAST> ParseFunction() {
 
     // Now we only have { STATEMENT LIST } left to parse.
 
-    if (curTok != tok_lbrace)
+    if (Lex.curTok != tok_lbrace)
         return LogErrorF("Expected block '{' after function signature.");
-    getNextToken(); // Consume '{'
+    Lex.getNextToken(); // Consume '{'
 
     auto stmtList = ParseStatementList(); // Might need to change to support returns.
 
-    if (curTok != tok_rbrace)
+    if (Lex.curTok != tok_rbrace)
         return LogErrorF("Expected closing '}' after function body.");
-    getNextToken(); // Consume '}'
+    Lex.getNextToken(); // Consume '}'
 
 
-    return std::make_unique<FunctionAST>(std::move(proto), std::move(stmtList));
+    return std::make_unique<FunctionAST>(rangeFrom(loc), std::move(proto), std::move(stmtList));
 }
 
-std::unique_ptr<PrototypeAST> ParsePrototype() {
+std::unique_ptr<PrototypeAST> Parser::ParsePrototype() {
+    SourceRange loc = Lex.CurRange;
     // func ID ( arg_list ) 
     // Only consumes the above. Does not support forward declaration (yet)
     std::string fnName;
     std::vector<std::string> argList;
+    std::string argTypes;
 
-    if (curTok != tok_id) 
+    if (Lex.curTok != tok_id) 
         return LogErrorP("Function signature expected identifier.");
-    fnName = idStr;
-    getNextToken(); // Consume ID
+    fnName = Lex.idStr;
+    Lex.getNextToken(); // Consume ID
     
-    if (curTok != tok_lparen)
+    if (Lex.curTok != tok_lparen)
         return LogErrorP("Expected '(' in function signature.");
-    getNextToken(); // Consume '('
+    Lex.getNextToken(); // Consume '('
 
     // Arg list
-    if (curTok != tok_rparen) {
+    if (Lex.curTok != tok_rparen) {
         while(true) {
             // Args must be IDs or calls.
             //! NOTE: Be careful for externs. Not allowed to have function call expr in arg list.
 
-            if (curTok != tok_id) 
+            if (Lex.curTok != tok_id) 
                 return LogErrorP("Expected ID or ID() in function signature argument list.");
 
-            argList.push_back(idStr);
-            getNextToken();                
+            argList.emplace_back(Lex.idStr);
+            Lex.getNextToken();                
+
+            // Optional type, double if there is none: ID : tensor
+            argTypes += type_double;
+            if (Lex.curTok == tok_colon) {
+                Lex.getNextToken(); // Consume ':'
 
-            if (curTok == tok_rparen)
+                if (Lex.curTok != tok_id || Lex.idStr != "tensor")
+                    return LogErrorP("Unknown type in function signature, expected 'tensor'.");
+                argTypes.back() = type_tensor;
+                Lex.getNextToken(); // Consume type
+            }
+
+            if (Lex.curTok == tok_rparen)
                 break;
             
-            if (curTok != tok_comma) {
+            if (Lex.curTok != tok_comma) {
                 return LogErrorP("Expected ')' or ',' in function signature argument list.");
             }
             
-            getNextToken();
+            Lex.getNextToken();
         }
     }
-    getNextToken(); // Consumes ')'
+    Lex.getNextToken(); // Consumes ')'
 
-    return std::make_unique<PrototypeAST>(fnName, std::move(argList));    
+    return std::make_unique<PrototypeAST>(rangeFrom(loc), fnName, std::move(argList), std::move(argTypes));    
 }
 
 
-std::unique_ptr<StmtAST> ParseExtern() {
-    getNextToken(); // Consume 'extern' keyword
+std::unique_ptr<StmtAST> Parser::ParseExtern() {
+    SourceRange loc = Lex.CurRange;
+    Lex.getNextToken(); // Consume 'extern' keyword
 
     auto proto = ParsePrototype();
+    if (!proto)
+        return nullptr;
 
-    if (curTok != tok_semi) 
+    if (Lex.curTok != tok_semi) 
         return LogErrorS("Expected ';' after extern definition.");
-    getNextToken(); // Consume ';'
+    Lex.getNextToken(); // Consume ';'
     
-    return std::make_unique<ExternAST>(std::move(proto));
+    return std::make_unique<ExternAST>(rangeFrom(loc), std::move(proto));
+}
+
+std::unique_ptr<StmtAST> Parser::ParseImport() {
+    SourceRange loc = Lex.CurRange;
+    // import "path";
+    Lex.getNextToken(); // Consume 'import' keyword
+
+    if (Lex.curTok != tok_string)
+        return LogErrorS("Expected file name string after 'import'.");
+    std::string path(Lex.idStr);
+    Lex.getNextToken(); // Consume string
+
+    if (Lex.curTok != tok_semi)
+        return LogErrorS("Expected ';' after import.");
+    Lex.getNextToken(); // Consume ';'
+
+    return std::make_unique<ImportStmtAST>(rangeFrom(loc), path);
 }
 
-std::unique_ptr<StmtAST> ParseIfStmt() {
-    getNextToken(); // Consume 'if'
+std::unique_ptr<StmtAST> Parser::ParseIfStmt() {
+    SourceRange loc = Lex.CurRange;
+    Lex.getNextToken(); // Consume 'if'
         
-    if (curTok != tok_lparen)
+    if (Lex.curTok != tok_lparen)
         return LogErrorS("Expected '(' after 'if' keyword.");
-    getNextToken(); // Consume '('
+    Lex.getNextToken(); // Consume '('
 
     auto cond = ParseExpression();
     if (!cond)
         return LogErrorS("Expected expression after 'if'.");
     
-    if (curTok != tok_rparen)
+    if (Lex.curTok != tok_rparen)
         return LogErrorS("Expected ')' after 'if' condition.");
-    getNextToken(); // Consume ')'
+    Lex.getNextToken(); // Consume ')'
 
-    if (curTok != tok_lbrace)
+    if (Lex.curTok != tok_lbrace)
         return LogErrorS("Expected '{' after 'if' condition.");
-    getNextToken(); // Consume '{'
+    Lex.getNextToken(); // Consume '{'
 
     auto thenBody = ParseStatementList();
-    if (curTok != tok_rbrace)
+    if (Lex.curTok != tok_rbrace)
         return LogErrorS("Expected '}' after 'if' body.");
-    getNextToken(); // Consume '}'
+    Lex.getNextToken(); // Consume '}'
     
     // If no else statement, return if stmtAST with empty body
-    if (curTok != tok_else) 
-        return std::make_unique<IfStmtAST>(std::move(cond), std::move(thenBody), std::vector<std::unique_ptr<StmtAST>>());
+    if (Lex.curTok != tok_else) 
+        return std::make_unique<IfStmtAST>(rangeFrom(loc), std::move(cond), std::move(thenBody), std::vector<std::unique_ptr<StmtAST>>());
 
-    getNextToken(); // Consume 'else'
+    Lex.getNextToken(); // Consume 'else'
 
-    if (curTok != tok_lbrace)
+    if (Lex.curTok != tok_lbrace)
         return LogErrorS("Expected '{' after 'else' keyword.");
-    getNextToken(); // Consume '{'
+    Lex.getNextToken(); // Consume '{'
 
     auto elseBody = ParseStatementList();
-    if (curTok != tok_rbrace)
+    if (Lex.curTok != tok_rbrace)
         return LogErrorS("Expected '}' after 'else' body.");
-    getNextToken(); // Consume '}'
+    Lex.getNextToken(); // Consume '}'
 
-    return std::make_unique<IfStmtAST>(std::move(cond), std::move(thenBody), std::move(elseBody));
+    return std::make_unique<IfStmtAST>(rangeFrom(loc), std::move(cond), std::move(thenBody), std::move(elseBody));
 }
 
-std::unique_ptr<StmtAST> ParseForStmt() {
+std::unique_ptr<StmtAST> Parser::ParseForStmt() {
+    SourceRange loc = Lex.CurRange;
     // for (start, end, step) { stmt_list }
     std::string iterator = "";
-    getNextToken(); // Consume 'for';
+    Lex.getNextToken(); // Consume 'for';
 
-    if (curTok != tok_lparen)
+    if (Lex.curTok != tok_lparen)
         return LogErrorS("Expected '(' in for loop definition");
-    getNextToken(); // consume '('
+    Lex.getNextToken(); // consume '('
 
-    if (curTok != tok_id)
+    if (Lex.curTok != tok_id)
         return LogErrorS("Expected iterator ID in for loop definition.");
-    iterator = idStr;
-    getNextToken(); // Consume ID
+    iterator = Lex.idStr;
+    Lex.getNextToken(); // Consume ID
 
-    if (curTok != tok_assign)
+    if (Lex.curTok != tok_assign)
         return LogErrorS("Expected '=' in for loop start definition.");
-    getNextToken(); // consume '=';
+    Lex.getNextToken(); // consume '=';
     
     auto start = ParseExpression();
     if (!start)
         return nullptr;
     
-    if (curTok != tok_comma)    
+    if (Lex.curTok != tok_comma)    
         return LogErrorS("Expected separator ',' after for loop start definition.");
-    getNextToken(); // Consume ','
+    Lex.getNextToken(); // Consume ','
 
     auto end = ParseExpression(); 
     if (!end)
@@ -338,126 +484,137 @@ std::unique_ptr<StmtAST> ParseForStmt() {
     
     // Optional step value, default is 1.0
     std::unique_ptr<ExprAST> step;
-    if (curTok == tok_comma) {
-        getNextToken(); // consume ','
+    if (Lex.curTok == tok_comma) {
+        Lex.getNextToken(); // consume ','
         step = ParseExpression();
         if (!step)
             return nullptr;
     } else {
-        step = std::make_unique<NumberExprAST>(1.0);
+        step = std::make_unique<NumberExprAST>(loc, 1.0);
     }
 
-    if (curTok != tok_rparen) 
+    if (Lex.curTok != tok_rparen) 
         return LogErrorS("Expected ')' after for loop definition.");
-    getNextToken(); // consume ')';
+    Lex.getNextToken(); // consume ')';
 
-    if (curTok != tok_lbrace)
+    if (Lex.curTok != tok_lbrace)
         return LogErrorS("Expected '{' in for loop body definition.");
-    getNextToken();
+    Lex.getNextToken();
 
     auto forBody = ParseStatementList();
 
-    if (curTok != tok_rbrace)
+    if (Lex.curTok != tok_rbrace)
         return LogErrorS("Expected '}' closing brace in for loop body definition.");
-    getNextToken();
+    Lex.getNextToken();
         
-    return std::make_unique<ForStmtAST>(iterator, std::move(start), std::move(end), std::move(step), std::move(forBody));
+    return std::make_unique<ForStmtAST>(rangeFrom(loc), iterator, std::move(start), std::move(end), std::move(step), std::move(forBody));
 }
 
 // ============================================================================
-// Expression parsing (Precedence climbing)
+// Expression parsing (Pratt)
 // ============================================================================
 
-std::unique_ptr<ExprAST> ParseExpression() {
-    auto LHS = ParseFactor();
-
+std::unique_ptr<ExprAST> Parser::ParseExpression(int minPrecedence) {
+    // a - b * c < d
+    // Parse a, then keep folding in operators that bind tighter than 
+    // minPrecedence. The RHS of each operator is parsed with that operator's 
+    // precedence as the new minimum, so '*' is taken by b, but '<' stops it 
+    // and ends up at this level with (a - (b * c)) as its LHS.
+    auto LHS = ParseUnary();
     if (!LHS)
         return nullptr;
 
-    return ParseBinOpRHS(0, std::move(LHS));
-}
-
-std::unique_ptr<ExprAST> ParseBinOpRHS(int precedence, std::unique_ptr<ExprAST> LHS) {
-    // a+b*c
-    // ^ Start with a as LHS and prec = 0.
-    // Find '+' and compare '+' precedence against 0 first.
-    // If works, then parse b and peak next binOP '*'
-    // If next binOP '*' has higher precedence than '+', recurse.
-    // Otherwise, group (a+b) first.
-
     while (true) {
-        // Check next operator.
-        int nextOpPrecedence = getPrecedence(curTok);
-        
-        // If next character is binOP but less significant, don't include in current binop
-        // Or if next character is not binOP, getPrecedence() should return -1.
-        if (nextOpPrecedence < precedence)   
-            return LHS; 
+        BinaryOpInfo info = getBinaryOp(Lex.curTok);
+
+        // Not a binary op, or one that belongs to a caller up the stack.
+        // Stopping on equal precedence is what makes ops left associative.
+        if (info.precedence == 0 || info.precedence <= minPrecedence)
+            return LHS;
 
-        // RHS is binOP, and precedence is at least current.
-        int binOP = curTok;
-        getNextToken();  // Consume next binOP.
+        int binOP = Lex.curTok;
+        Lex.getNextToken(); // Consume binOP.
 
-        auto RHS = ParseFactor(); // Parse what ever is left on right side (FACTOR only)
+        auto RHS = ParseExpression(info.rightAssoc ? info.precedence - 1 : info.precedence);
         if (!RHS)
             return nullptr;
 
-        int opAfterRHSPrecedence = getPrecedence(curTok);
-        if (opAfterRHSPrecedence > nextOpPrecedence) {      // Decide: recurse
-            RHS = ParseBinOpRHS(nextOpPrecedence+1, std::move(RHS)); // +1 to prevent infinite (???)
-            if (!RHS) 
-                return nullptr;
-        }
-
-        LHS = std::make_unique<BinaryExprAST>(binOP, std::move(LHS), std::move(RHS));
+        SourceRange binRange = {LHS->getRange().Begin, RHS->getRange().End};
+        LHS = std::make_unique<BinaryExprAST>(binRange, binOP, std::move(LHS), std::move(RHS));
     }
 }
 
-std::unique_ptr<ExprAST> ParseFactor() {
-    // printf("Parsing Factor: curTok: %d\n", curTok);
+std::unique_ptr<ExprAST> Parser::ParseUnary() {
+    // -a, !a, - -a. Binds tighter than every binary op: -a * b is (-a) * b.
+    if (Lex.curTok != tok_sub && Lex.curTok != tok_not)
+        return ParseFactor();
+
+    SourceRange loc = Lex.CurRange;
+    int op = Lex.curTok;
+    Lex.getNextToken(); // Consume op
+
+    auto operand = ParseUnary();
+    if (!operand)
+        return nullptr;
+
+    return std::make_unique<UnaryExprAST>(rangeFrom(loc), op, std::move(operand));
+}
+
+std::unique_ptr<ExprAST> Parser::ParseFactor() {
+    // printf("Parsing Factor: Lex.curTok: %d\n", Lex.curTok);
 
-    if (curTok == tok_id) {
+    if (Lex.curTok == tok_id) {
         return ParseIdentifierExpr();       // ID or Func call.
     }
-    else if (curTok == tok_num) {
+    else if (Lex.curTok == tok_num) {
         return ParseNumberExpr();           // Number
     }
-    else if (curTok == tok_lparen) {        // '(' Expression ')'
-        getNextToken(); // consume '('
+    else if (Lex.curTok == tok_lparen) {        // '(' Expression ')'
+        Lex.getNextToken(); // consume '('
         auto E = ParseExpression();
 
-        if (curTok != tok_rparen) 
+        if (Lex.curTok != tok_rparen) 
             return LogError("Expected ')' after expression.");
-        getNextToken(); // Consume ')';
+        Lex.getNextToken(); // Consume ')';
         
         return std::move(E);
     }
-    return nullptr;
+    return LogError("Expected expression.");
 }
 
 
-std::unique_ptr<ExprAST> ParseNumberExpr() {
-    auto result = std::make_unique<NumberExprAST>(numVal);
-    getNextToken(); // Consume num token
+std::unique_ptr<ExprAST> Parser::ParseNumberExpr() {
+    SourceRange loc = Lex.CurRange;
+    auto result = std::make_unique<NumberExprAST>(loc, Lex.numVal);
+    Lex.getNextToken(); // Consume num token
     return std::move(result);
 }
 
-std::unique_ptr<ExprAST> ParseIdentifierExpr() {
-    std::string identifier = idStr;
-    getNextToken(); // Consume ID;
+std::unique_ptr<ExprAST> Parser::ParseIdentifierExpr() {
+    SourceRange loc = Lex.CurRange;
+    std::string identifier(Lex.idStr);
+    Lex.getNextToken(); // Consume ID;
+
+    // Tensor element
+    if (Lex.curTok == tok_lbracket) {
+        std::vector<std::unique_ptr<ExprAST>> indices;
+        if (!ParseIndexList(indices))
+            return nullptr;
+        return std::make_unique<IndexExprAST>(rangeFrom(loc), identifier, std::move(indices));
+    }
 
     // If just an ID
-    if (curTok != tok_lparen) {
-        return std::make_unique<VariableExprAST>(identifier);
+    if (Lex.curTok != tok_lparen) {
+        return std::make_unique<VariableExprAST>(rangeFrom(loc), identifier);
     }
 
     // If function call
     // printf("Parsing function call: %s\n", identifier.c_str());
     std::vector<std::unique_ptr<ExprAST>> argList;
-    getNextToken(); // consume '('
+    Lex.getNextToken(); // consume '('
 
     // Arg list
-    if (curTok != tok_rparen) {
+    if (Lex.curTok != tok_rparen) {
         while(true) {
             if (auto arg = ParseExpression()) {
                 argList.push_back(std::move(arg));
@@ -465,18 +622,47 @@ std::unique_ptr<ExprAST> ParseIdentifierExpr() {
                 return nullptr;
             }
 
-            if (curTok == tok_rparen)
+            if (Lex.curTok == tok_rparen)
                 break;
             
-            if (curTok != tok_comma) {
+            if (Lex.curTok != tok_comma) {
                 return LogError("Expected ')' or ',' in argument list.");
             }
             
-            getNextToken();
+            Lex.getNextToken();
         }
     }
     
-    getNextToken(); // Consume ')'
+    Lex.getNextToken(); // Consume ')'
     
-    return std::make_unique<CallExprAST>(identifier, std::move(argList));
+    return std::make_unique<CallExprAST>(rangeFrom(loc), identifier, std::move(argList));
+}
+
+// [ EXPR, ... ], up to TENSOR_MAX_RANK of them. false on errors.
+bool Parser::ParseIndexList(std::vector<std::unique_ptr<ExprAST>> &indices) {
+    Lex.getNextToken(); // consume '['
+
+    while (true) {
+        auto idx = ParseExpression();
+        if (!idx)
+            return false;
+        indices.push_back(std::move(idx));
+
+        if (Lex.curTok == tok_rbracket)
+            break;
+
+        if (Lex.curTok != tok_comma) {
+            LogError("Expected ']' or ',' in tensor index.");
+            return false;
+        }
+        Lex.getNextToken();
+    }
+
+    if (indices.size() > TENSOR_MAX_RANK) {
+        LogError("Too many indices, tensors have at most 4 dimensions.");
+        return false;
+    }
+
+    Lex.getNextToken(); // Consume ']'
+    return true;
 }
@@ -0,0 +1,55 @@
+#include "../include/PerfMapListener.h"
+
+#include "llvm/Object/SymbolSize.h"
+
+#include <unistd.h>
+
+using namespace llvm;
+using namespace llvm::orc;
+
+PerfMapListener::PerfMapListener() {
+    std::string path = "/tmp/perf-" + std::to_string(getpid()) + ".map";
+    MapFile = fopen(path.c_str(), "w");
+    if (!MapFile)
+        fprintf(stderr, "🍋 Failed to open perf map: %s\n", path.c_str());
+}
+
+PerfMapListener::~PerfMapListener() {
+    if (MapFile)
+        fclose(MapFile);
+}
+
+void PerfMapListener::notifyObjectLoaded(ObjectKey K, const object::ObjectFile &Obj,
+                                         const RuntimeDyld::LoadedObjectInfo &L) {
+    if (!MapFile)
+        return;
+
+    // The debug copy of the object has sections at their load addresses.
+    object::OwningBinary<object::ObjectFile> DebugObjOwner = L.getObjectForDebug(Obj);
+    const object::ObjectFile *DebugObj = DebugObjOwner.getBinary();
+    if (!DebugObj)
+        return;
+
+    std::lock_guard<std::mutex> Guard(Lock);
+
+    for (const auto &[Sym, Size] : object::computeSymbolSizes(*DebugObj)) {
+        auto Type = Sym.getType();
+        if (!Type || *Type != object::SymbolRef::ST_Function) {
+            consumeError(Type.takeError());
+            continue;
+        }
+
+        auto Name = Sym.getName();
+        auto Addr = Sym.getAddress();
+        if (!Name || !Addr) {
+            consumeError(Name.takeError());
+            consumeError(Addr.takeError());
+            continue;
+        }
+
+        fprintf(MapFile, "%llx %llx %s\n", (unsigned long long)*Addr, 
+                (unsigned long long)Size, Name->str().c_str());
+    }
+
+    fflush(MapFile);
+}
@@ -0,0 +1,200 @@
+#include "../include/Profiler.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#ifdef _WIN32
+#define DLLEXPORT __declspec(dllexport)
+#else
+#define DLLEXPORT
+#endif
+
+// ============================================================================
+//                                  Timer
+// ============================================================================
+
+static inline uint64_t readTicks() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#elif defined(__aarch64__)
+    uint64_t ticks;
+    asm volatile("mrs %0, cntvct_el0" : "=r"(ticks));
+    return ticks;
+#else
+    return std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+}
+
+// Ticks -> seconds, calibrated against steady_clock between the first 
+// lemon_prof_enter and the report.
+struct Calibration {
+    uint64_t startTicks = 0;
+    std::chrono::steady_clock::time_point startTime;
+    std::once_flag started;
+};
+static Calibration Calib;
+
+// ============================================================================
+//                          Per-thread profile data
+// ============================================================================
+
+struct FuncStats {
+    std::string name;
+    uint64_t calls = 0;
+    uint64_t selfTicks = 0;
+    uint64_t totalTicks = 0;
+    int active = 0;         // Recursion depth, total time only counts the outermost call.
+};
+
+struct EdgeStats {
+    uint64_t calls = 0;
+    uint64_t totalTicks = 0;
+};
+
+struct Frame {
+    int func;
+    uint64_t start;
+    uint64_t childTicks;
+};
+
+struct ThreadProfile {
+    std::unordered_map<const char *, int> ids;  // name pointer -> index in funcs
+    std::vector<FuncStats> funcs;
+    std::map<std::pair<int, int>, EdgeStats> edges;  // (caller, callee), caller -1 is the root
+    std::vector<Frame> stack;
+};
+
+static std::mutex ProfilesLock;
+static std::vector<std::unique_ptr<ThreadProfile>> Profiles;
+
+static ThreadProfile &getThreadProfile() {
+    thread_local ThreadProfile *TP = nullptr;
+    if (!TP) {
+        std::lock_guard<std::mutex> guard(ProfilesLock);
+        Profiles.push_back(std::make_unique<ThreadProfile>());
+        TP = Profiles.back().get();
+    }
+    return *TP;
+}
+
+static int getFuncId(ThreadProfile &TP, const char *name) {
+    auto it = TP.ids.find(name);
+    if (it != TP.ids.end())
+        return it->second;
+
+    // Copy the name, the JIT'd string constant goes away with its module.
+    int id = TP.funcs.size();
+    TP.funcs.emplace_back();
+    TP.funcs.back().name = name;
+    TP.ids[name] = id;
+    return id;
+}
+
+// ============================================================================
+//                              Instrumentation
+// ============================================================================
+
+extern "C" DLLEXPORT void lemon_prof_enter(const char *name) {
+    std::call_once(Calib.started, [] {
+        Calib.startTime = std::chrono::steady_clock::now();
+        Calib.startTicks = readTicks();
+    });
+
+    ThreadProfile &TP = getThreadProfile();
+    int id = getFuncId(TP, name);
+    TP.funcs[id].active++;
+    TP.stack.push_back({id, readTicks(), 0});
+}
+
+extern "C" DLLEXPORT void lemon_prof_exit(const char *name) {
+    uint64_t now = readTicks();
+    ThreadProfile &TP = getThreadProfile();
+    if (TP.stack.empty())
+        return;
+
+    Frame frame = TP.stack.back();
+    TP.stack.pop_back();
+
+    uint64_t elapsed = now - frame.start;
+    FuncStats &F = TP.funcs[frame.func];
+    F.calls++;
+    F.selfTicks += elapsed - frame.childTicks;
+    if (--F.active == 0)
+        F.totalTicks += elapsed;
+
+    int caller = TP.stack.empty() ? -1 : TP.stack.back().func;
+    EdgeStats &E = TP.edges[{caller, frame.func}];
+    E.calls++;
+    E.totalTicks += elapsed;
+
+    if (!TP.stack.empty())
+        TP.stack.back().childTicks += elapsed;
+}
+
+// ============================================================================
+//                                  Report
+// ============================================================================
+
+extern "C" DLLEXPORT void lemon_prof_report() {
+    std::lock_guard<std::mutex> guard(ProfilesLock);
+
+    uint64_t ticks = readTicks() - Calib.startTicks;
+    std::chrono::duration<double, std::milli> wall = std::chrono::steady_clock::now() - Calib.startTime;
+    double msPerTick = (ticks > 0) ? wall.count() / ticks : 0;
+
+    // Merge threads by function name.
+    std::map<std::string, FuncStats> funcs;
+    std::map<std::pair<std::string, std::string>, EdgeStats> edges;
+    for (auto &TP : Profiles) {
+        for (auto &F : TP->funcs) {
+            FuncStats &M = funcs[F.name];
+            M.name = F.name;
+            M.calls += F.calls;
+            M.selfTicks += F.selfTicks;
+            M.totalTicks += F.totalTicks;
+        }
+        for (auto &[key, E] : TP->edges) {
+            std::string caller = (key.first < 0) ? "<root>" : TP->funcs[key.first].name;
+            EdgeStats &M = edges[{caller, TP->funcs[key.second].name}];
+            M.calls += E.calls;
+            M.totalTicks += E.totalTicks;
+        }
+    }
+
+    std::vector<FuncStats> flat;
+    uint64_t totalSelf = 0;
+    for (auto &[name, F] : funcs) {
+        flat.push_back(F);
+        totalSelf += F.selfTicks;
+    }
+    std::sort(flat.begin(), flat.end(), [](const FuncStats &a, const FuncStats &b) {
+        return a.selfTicks > b.selfTicks;
+    });
+
+    fprintf(stderr, "\n🍋 Flat profile (%.3f ms profiled)\n", totalSelf * msPerTick);
+    fprintf(stderr, "%8s %12s %12s %12s  %s\n", "self %", "self ms", "total ms", "calls", "function");
+    for (auto &F : flat) {
+        double pct = totalSelf ? 100.0 * F.selfTicks / totalSelf : 0;
+        fprintf(stderr, "%7.2f%% %12.3f %12.3f %12llu  %s\n", pct, F.selfTicks * msPerTick, 
+                F.totalTicks * msPerTick, (unsigned long long)F.calls, F.name.c_str());
+    }
+
+    fprintf(stderr, "\n🍋 Call graph\n");
+    fprintf(stderr, "%12s %12s  %s\n", "calls", "total ms", "caller -> callee");
+    for (auto &[key, E] : edges) {
+        fprintf(stderr, "%12llu %12.3f  %s -> %s\n", (unsigned long long)E.calls, 
+                E.totalTicks * msPerTick, key.first.c_str(), key.second.c_str());
+    }
+}
@@ -0,0 +1,23 @@
+// ============================================================================
+//          Mock "library" functions to be "extern'd" in user code
+// ============================================================================
+// Linked into the lemon executable (found by the JIT through the process
+// symbol table), into liblemon (defined in the JIT by hand, see Lemon.cc) 
+// and built as liblemonrt for linking --emit-obj output.
+
+#include "../include/Runtime.h"
+
+#include <cstdio>
+
+/// putchard - putchar that takes a double and returns 0.
+extern "C" DLLEXPORT double putchard(double X) {
+    fputc((char)X, stderr);
+    return 0;
+}
+
+/// printd - printf that takes a double prints it as "%f\n", returning 0.
+extern "C" DLLEXPORT double printd(double X) {
+    fprintf(stderr, "Print: ");
+    fprintf(stderr, "%f\n", X);
+    return 0;
+}
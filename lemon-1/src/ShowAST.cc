@@ -11,14 +11,17 @@ void LemonAST::showAST() {
 void BinaryExprAST::showAST() {
     printf("BinaryExpr(");
     LHS->showAST();
-    if (op == tok_add) printf(" + ");
-    if (op == tok_sub) printf(" - ");
-    if (op == tok_mul) printf(" * ");
-    if (op == tok_div) printf(" / ");
+    printf(" %s ", tokenToString(op).c_str());
     RHS->showAST();
     printf(")");
 }
 
+void UnaryExprAST::showAST() {
+    printf("UnaryExpr(%s", tokenToString(op).c_str());
+    operand->showAST();
+    printf(")");
+}
+
 void NumberExprAST::showAST() {
     printf("Num(%f)", val);
 }
@@ -27,6 +30,15 @@ void VariableExprAST::showAST() {
     printf("Var(%s)", varName.c_str());
 }
 
+void IndexExprAST::showAST() {
+    printf("Index: %s[", tensorName.c_str());
+    for (auto &item : indices) {
+        item->showAST();
+        printf(", ");
+    }
+    printf("]");
+}
+
 void CallExprAST::showAST() {
     printf("CallExpr: %s(", callee.c_str());
     for (auto &item : args) {
@@ -37,8 +49,8 @@ void CallExprAST::showAST() {
 
 void PrototypeAST::showAST() {
     printf("Signature: %s(", name.c_str());
-    for (auto &item : args) {
-        printf("%s, ", item.c_str());
+    for (size_t i = 0; i < args.size(); ++i) {
+        printf("%s%s, ", args[i].c_str(), argTypes[i] == type_tensor ? ": tensor" : "");
         // item->showAST();
     }
     printf(")\n");
@@ -56,6 +68,17 @@ void AssignmentStmt::showAST() {
     printf(";\n");
 }
 
+void IndexAssignStmt::showAST() {
+    printf("IndexAssign: %s[", tensorName.c_str());
+    for (auto &item : indices) {
+        item->showAST();
+        printf(", ");
+    }
+    printf("] = ");
+    defBody->showAST();
+    printf(";\n");
+}
+
 void ReturnStmtAST::showAST() {
     printf("return: ");
     retBody->showAST();
@@ -78,6 +101,10 @@ void ExternAST::showAST() {
     printf("\n");
 }
 
+void ImportStmtAST::showAST() {
+    printf("Import: \"%s\"\n", path.c_str());
+}
+
 void ExpressionStmtAST::showAST() {
     printf("Expression Statement: ");
     expr->showAST();
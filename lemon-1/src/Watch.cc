@@ -0,0 +1,316 @@
+#include "../include/Watch.h"
+#include "../include/Parser.h"
+#include "../include/Import.h"
+#include "../include/CompilerSession.h"
+
+#include <chrono>
+#include <thread>
+
+struct LoadedFunction {
+    uint64_t hash;
+    ResourceTrackerSP RT;   // Current code behind the stub
+};
+
+struct WatchState {
+    LemonJIT &JIT;
+    std::string file;
+
+    std::unique_ptr<MemoryBuffer> Source;       // The lexer (diagnostics) points into it
+    std::unique_ptr<CompilerSession> S;         // Kept between reloads, has the prototypes
+    JITDylib *JD = nullptr;                     // null: nothing loaded
+    std::unique_ptr<IndirectStubsManager> Stubs;
+
+    uint64_t restHash = 0;                      // Everything but the function bodies
+    std::map<std::string, LoadedFunction> Functions;
+    std::vector<std::string> Globals;           // Defined in the main module, declared in the others
+    double (*Main)() = nullptr;
+
+    unsigned generation = 0;                    // Unique names for JITDylibs and function versions
+
+    WatchState(LemonJIT &JIT, const std::string &file) : JIT(JIT), file(file) {}
+};
+
+static double msSince(std::chrono::steady_clock::time_point start) {
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    return std::chrono::duration<double, std::milli>(elapsed).count();
+}
+
+static void removeTracker(WatchState &W, ResourceTrackerSP RT) {
+    if (auto Err = RT->remove())
+        W.JIT.getExecutionSession().reportError(std::move(Err));
+}
+
+static void unloadAll(WatchState &W) {
+    if (!W.JD)
+        return;
+    if (auto Err = W.JIT.removeJITDylib(*W.JD))
+        W.JIT.getExecutionSession().reportError(std::move(Err));
+    W.JD = nullptr;
+    W.Stubs.reset();
+    W.Functions.clear();
+    W.Globals.clear();
+    W.Main = nullptr;
+}
+
+// The main module has everything but the function bodies, so its hash is
+// the program minus those. A function's prototype is in it: callers are
+// compiled against it.
+static uint64_t hashRest(LemonAST &Program) {
+    ASTHasher H;
+    for (auto &stmt : Program.getStatements()) {
+        if (auto *F = dynamic_cast<FunctionAST *>(stmt.get()))
+            PrototypeAST(F->getProto()).hash(H);
+        else
+            stmt->hash(H);
+    }
+    return H.finish();
+}
+
+// One function in its own module, behind its stub. Globals and the other
+// functions are declarations, they resolve to the main module and the stubs.
+static bool compileFunction(WatchState &W, FunctionAST &F, uint64_t hash) {
+    CompilerSession &S = *W.S;
+    std::string name = F.getProto().getName();
+
+    S.InitializeModule();
+    for (auto &global : W.Globals) {
+        S.GlobalVariables[global] = new GlobalVariable(*S.TheModule, Type::getDoubleTy(*S.TheContext), false,
+                                                       GlobalValue::ExternalLinkage, nullptr, global);
+    }
+
+    auto *Fn = cast_or_null<Function>(F.codegen(S));
+    if (!Fn || !S.Diagnostics.empty()) {
+        S.printDiagnostics();
+        return false;
+    }
+    S.finalizeDebugInfo();
+
+    // `name` is the stub, the code gets a new name every time.
+    std::string implName = name + ".v" + std::to_string(W.generation++);
+    Fn->setName(implName);
+
+    ResourceTrackerSP RT = W.JD->createResourceTracker();
+    auto TSM = ThreadSafeModule(std::move(S.TheModule), std::move(S.TheContext));
+    if (auto Err = W.JIT.addModule(std::move(TSM), RT)) {
+        fprintf(stderr, "🍋 %s: %s\n", name.c_str(), toString(std::move(Err)).c_str());
+        return false;
+    }
+
+    auto Impl = W.JIT.lookup(*W.JD, implName);
+    if (!Impl) {
+        fprintf(stderr, "🍋 %s: %s\n", name.c_str(), toString(Impl.takeError()).c_str());
+        removeTracker(W, RT);
+        return false;
+    }
+    if (auto Err = W.Stubs->updatePointer(name, Impl->getAddress())) {
+        fprintf(stderr, "🍋 %s: %s\n", name.c_str(), toString(std::move(Err)).c_str());
+        removeTracker(W, RT);
+        return false;
+    }
+
+    // Nothing calls the old code anymore.
+    LoadedFunction &Loaded = W.Functions[name];
+    if (Loaded.RT)
+        removeTracker(W, Loaded.RT);
+    Loaded = {hash, RT};
+    return true;
+}
+
+// W's loaded program is now New's, the old one is freed.
+static void takeOver(WatchState &W, WatchState &New) {
+    unloadAll(W);
+    W.Source = std::move(New.Source);
+    W.S = std::move(New.S);
+    W.JD = New.JD;
+    W.Stubs = std::move(New.Stubs);
+    W.restHash = New.restHash;
+    W.Functions = std::move(New.Functions);
+    W.Globals = std::move(New.Globals);
+    W.Main = New.Main;
+    New.JD = nullptr;
+}
+
+// Builds everything from Program into W, which has nothing loaded yet.
+static bool loadAll(WatchState &W, std::unique_ptr<CompilerSession> S, LemonAST &Program) {
+    W.S = std::move(S);
+    CompilerSession &Session = *W.S;
+
+    W.JD = &W.JIT.createJITDylib("<watch " + std::to_string(W.generation++) + ">");
+    Session.RT = W.JD->getDefaultResourceTracker();
+
+    auto Stubs = W.JIT.createIndirectStubsManager();
+    if (!Stubs) {
+        fprintf(stderr, "🍋 %s\n", toString(Stubs.takeError()).c_str());
+        return false;
+    }
+    W.Stubs = std::move(*Stubs);
+
+    // Functions become externs in the main module, their bodies are
+    // compiled on their own below.
+    std::vector<std::unique_ptr<StmtAST>> mainStatements;
+    std::vector<std::unique_ptr<FunctionAST>> functions;
+    for (auto &stmt : Program.takeStatements()) {
+        if (auto *F = dynamic_cast<FunctionAST *>(stmt.get())) {
+            mainStatements.push_back(std::make_unique<ExternAST>(
+                F->getRange(), std::make_unique<PrototypeAST>(F->getProto())));
+            functions.emplace_back(static_cast<FunctionAST *>(stmt.release()));
+        } else {
+            mainStatements.push_back(std::move(stmt));
+        }
+    }
+    LemonAST MainProgram(std::move(mainStatements), 0);
+
+    for (auto &F : functions) {
+        if (auto Err = W.JIT.defineStub(*W.JD, *W.Stubs, F->getProto().getName())) {
+            fprintf(stderr, "🍋 %s\n", toString(std::move(Err)).c_str());
+            return false;
+        }
+    }
+
+    if (!compileImports(Session, MainProgram, W.file) || !Session.codegenMain(MainProgram)) {
+        Session.printDiagnostics();
+        return false;
+    }
+    for (auto &[name, GV] : Session.GlobalVariables)
+        W.Globals.push_back(name);
+
+    auto TSM = ThreadSafeModule(std::move(Session.TheModule), std::move(Session.TheContext));
+    if (auto Err = W.JIT.addModule(std::move(TSM), Session.RT)) {
+        fprintf(stderr, "🍋 %s\n", toString(std::move(Err)).c_str());
+        return false;
+    }
+
+    // Hash before codegen, FunctionAST::codegen hands its prototype to the session.
+    for (auto &F : functions) {
+        ASTHasher H;
+        F->hash(H);
+        if (!compileFunction(W, *F, H.finish()))
+            return false;
+    }
+
+    auto Main = W.JIT.lookup(*W.JD, "lemon_main");
+    if (!Main) {
+        fprintf(stderr, "🍋 %s\n", toString(Main.takeError()).c_str());
+        return false;
+    }
+    W.Main = Main->getAddress().toPtr<double (*)()>();
+    return true;
+}
+
+// Recompiles the functions whose hash changed, names them in `reloaded`.
+static bool reloadChanged(WatchState &W, LemonAST &Program, std::string &reloaded) {
+    bool ok = true;
+    for (auto &stmt : Program.getStatements()) {
+        auto *F = dynamic_cast<FunctionAST *>(stmt.get());
+        if (!F)
+            continue;
+
+        ASTHasher H;
+        F->hash(H);
+        uint64_t hash = H.finish();
+        std::string name = F->getProto().getName();
+        if (W.Functions[name].hash == hash)
+            continue;
+
+        if (!compileFunction(W, *F, hash)) {
+            ok = false;
+            continue;
+        }
+        reloaded += (reloaded.empty() ? "" : ", ") + name;
+    }
+    return ok;
+}
+
+// Reads and parses the file, then loads whatever changed. False if nothing
+// new got loaded because of errors, the old code keeps running then.
+static bool reload(WatchState &W) {
+    auto start = std::chrono::steady_clock::now();
+
+    // Volatile: read it, don't mmap it, the editor may write it again any time.
+    auto Input = MemoryBuffer::getFile(W.file, /*IsText=*/false, /*RequiresNullTerminator=*/true, /*IsVolatile=*/true);
+    if (!Input) {
+        fprintf(stderr, "🍋 Can't read %s: %s\n", W.file.c_str(), Input.getError().message().c_str());
+        return false;
+    }
+
+    // Parsed in a new session, which replaces the old one if everything reloads.
+    auto S = CompilerSession::Create(W.JIT);
+    if (!S) {
+        fprintf(stderr, "🍋 %s\n", toString(S.takeError()).c_str());
+        return false;
+    }
+    std::string error;
+    if (!(*S)->setSource(W.file, (*Input)->getBufferStart(), (*Input)->getBufferEnd(), error)) {
+        fprintf(stderr, "🍋 %s\n", error.c_str());
+        return false;
+    }
+    (*S)->Lex.getNextToken();
+    auto Program = Parser(**S).Parse();
+    if ((*S)->printDiagnostics())
+        return false;
+
+    uint64_t restHash = hashRest(*Program);
+
+    // Built next to the old code, which keeps running if this fails.
+    if (!W.JD || restHash != W.restHash) {
+        WatchState New(W.JIT, W.file);
+        New.Source = std::move(*Input);
+        New.restHash = restHash;
+        New.generation = W.generation;
+        bool ok = loadAll(New, std::move(*S), *Program);
+        W.generation = New.generation;
+        if (!ok) {
+            unloadAll(New);
+            return false;
+        }
+        takeOver(W, New);
+        fprintf(stderr, "🍋 Loaded %s (%.1f ms)\n", W.file.c_str(), msSince(start));
+        return true;
+    }
+
+    // Same everything but some function bodies, the old session has the
+    // prototypes and imports. It just needs the new source for diagnostics.
+    W.Source = std::move(*Input);
+    W.S->Lex = std::move((*S)->Lex);
+
+    std::string reloaded;
+    bool ok = reloadChanged(W, *Program, reloaded);
+    if (reloaded.empty())
+        fprintf(stderr, "🍋 No functions changed\n");
+    else
+        fprintf(stderr, "🍋 Reloaded %s (%.1f ms)\n", reloaded.c_str(), msSince(start));
+    return ok;
+}
+
+int runWatch(LemonJIT &JIT, const std::string &file) {
+    WatchState W(JIT, file);
+
+    sys::fs::file_status Status;
+    if (auto EC = sys::fs::status(file, Status)) {
+        fprintf(stderr, "🍋 Can't read %s: %s\n", file.c_str(), EC.message().c_str());
+        return 1;
+    }
+    auto lastModified = Status.getLastModificationTime();
+    uint64_t lastSize = Status.getSize();
+
+    fprintf(stderr, "🍋 Watching %s, Ctrl-C to stop.\n", file.c_str());
+    reload(W);
+    if (W.Main)
+        W.Main();
+
+    while (true) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+        // Deleted/being replaced by the editor: wait for it to come back.
+        if (sys::fs::status(file, Status))
+            continue;
+        if (Status.getLastModificationTime() == lastModified && Status.getSize() == lastSize)
+            continue;
+        lastModified = Status.getLastModificationTime();
+        lastSize = Status.getSize();
+
+        reload(W);
+        if (W.Main)
+            W.Main();
+    }
+}
@@ -1,84 +1,89 @@
 #include "../include/Parser.h"
 #include "../include/AST.h"
 #include "../include/Lexer.h"
+#include "../include/AOT.h"
+#include "../include/MultiVersion.h"
+#include "../include/Instrument.h"
+#include "../include/Profiler.h"
+#include "../include/Import.h"
+#include "../include/FunctionCache.h"
+#include "../include/ASTBinary.h"
+#include "../include/CompilerSession.h"
+#include "../include/Watch.h"
+#include "../include/Interp.h"
+
+#include <set>
+#include <cstring>
+#include <chrono>
+#include <algorithm>
+#include <atomic>
+#include <thread>
 
 
 static ExitOnError ExitOnErr;
-// ============================================================================
-//          Mock "library" functions to be "extern'd" in user code
-// ============================================================================
-
-#ifdef _WIN32
-#define DLLEXPORT __declspec(dllexport)
-#else
-#define DLLEXPORT
-#endif
-
-/// putchard - putchar that takes a double and returns 0.
-extern "C" DLLEXPORT double putchard(double X) {
-    fputc((char)X, stderr);
-    return 0;
-}
-
-/// printd - printf that takes a double prints it as "%f\n", returning 0.
-extern "C" DLLEXPORT double printd(double X) {
-    fprintf(stderr, "Print: ");
-    fprintf(stderr, "%f\n", X);
-    return 0;
-}
 
 // ============================================================================
 //                                  Main
 // ============================================================================
 
 int REPL_MODE = 0;
+int WHOLE_PROGRAM = 0;                  // --whole-program
+std::set<std::string> ExportedSymbols;  // --export=<name>, kept external in whole-program mode
+std::string EMIT_OBJ;                   // --emit-obj=<path>, AOT compile instead of running
+std::string EMIT_AST_BIN;               // --emit-ast-bin=<path>, parse only and write the AST, see ASTBinary.h
+int TIME_PHASES = 0;                    // --time, prints phase timings as JSON to stdout
+std::string INPUT_FILE = "-";           // Source file, "-" (default) reads stdin
+std::vector<std::string> HOST_FILES;    // More than one source file: host mode, see runHost()
+unsigned JOBS = 0;                      // --jobs=<n>, host mode threads, 0: one per core
+int WATCH = 0;                          // --watch, hot reload on every change, see Watch.h
+
+LemonJITOptions JITOpts;                // --mcpu, --mattr, --perf-map, ...
+std::unique_ptr<LemonJIT> TheJIT;
+
+double msSince(std::chrono::steady_clock::time_point start) {
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    return std::chrono::duration<double, std::milli>(elapsed).count();
+}
+
+// The vector variants live in their own shared library, load it into the
+// process so DynamicLibrarySearchGenerator can resolve them for the JIT.
+void loadVectorLibrary() {
+    const char *path = nullptr;
+    if (VECTOR_LIB == "libmvec")
+        path = "libmvec.so.1";
+    else if (VECTOR_LIB == "sleef")
+        path = "libsleefgnuabi.so";
+    else if (VECTOR_LIB == "accelerate")
+        path = "/System/Library/Frameworks/Accelerate.framework/Accelerate";
+    
+    if (!path)
+        return;
+
+    std::string errMsg;
+    if (sys::DynamicLibrary::LoadLibraryPermanently(path, &errMsg)) {
+        fprintf(stderr, "🍋 Failed to load vector library (%s): %s\n", path, errMsg.c_str());
+        fprintf(stderr, "🍋 Falling back to --vector-lib=none\n");
+        VECTOR_LIB = "none";
+    }
+}
 
-void InitializeModule() {
-    // Open a new context and module.
-    TheContext = std::make_unique<LLVMContext>();
-    TheModule = std::make_unique<Module>("LEMON JIT", *TheContext);
-    TheModule->setDataLayout(TheJIT->getDataLayout());
-
-    // Create a new builder for the module.
-    Builder = std::make_unique<IRBuilder<>>(*TheContext);
-
-    // 3 insertion points.
-    GlobalVariableBuilder = std::make_unique<IRBuilder<>>(*TheContext);
-    MainBuilder = std::make_unique<IRBuilder<>>(*TheContext);
-    FunctionBuilder = std::make_unique<IRBuilder<>>(*TheContext);
-
-    // Optimizations
-    TheFPM = std::make_unique<FunctionPassManager>();
-    TheLAM = std::make_unique<LoopAnalysisManager>();
-    TheFAM = std::make_unique<FunctionAnalysisManager>();
-    TheCGAM = std::make_unique<CGSCCAnalysisManager>();
-    TheMAM = std::make_unique<ModuleAnalysisManager>();
-
-    ThePIC = std::make_unique<PassInstrumentationCallbacks>();
-    TheSI = std::make_unique<StandardInstrumentations>(*TheContext,
-                                                        /*DebugLogging*/ true);
-    TheSI->registerCallbacks(*ThePIC, TheMAM.get());
-
-    // Add transform passes.
-    // Eliminate Common SubExpressions.
-    TheFPM->addPass(GVNPass());
-    // Simplify the control flow graph (deleting unreachable blocks, etc).
-    TheFPM->addPass(SimplifyCFGPass());
-
-    // mem2reg passes
-    TheFPM->addPass(PromotePass());
-    TheFPM->addPass(InstCombinePass());
-    TheFPM->addPass(ReassociatePass());
-
-    // ADCE passes
-    TheFPM->addPass(ADCEPass());
-    TheFPM->addPass(DSEPass());
-
-    // Register analysis passes used in these transform passes.
-    PassBuilder PB;
-    PB.registerModuleAnalyses(*TheMAM);
-    PB.registerFunctionAnalyses(*TheFAM);
-    PB.crossRegisterProxies(*TheLAM, *TheFAM, *TheCGAM, *TheMAM);
+// Whole-program mode: nothing outside of this module calls into it except
+// through lemon_main (and whatever the user --export'ed), so everything else
+// can be internal. That lets GlobalOpt turn read-only globals into constants,
+// IPSCCP propagate constants through internal functions and GlobalDCE drop
+// functions that are never called.
+void internalizeModule(Module &M, ModuleAnalysisManager &MAM) {
+    auto mustPreserve = [](const GlobalValue &GV) {
+        return GV.getName() == "lemon_main" || 
+               ExportedSymbols.count(GV.getName().str());
+    };
+
+    ModulePassManager MPM;
+    MPM.addPass(InternalizePass(mustPreserve));
+    MPM.addPass(GlobalOptPass());
+    MPM.addPass(IPSCCPPass());
+    MPM.addPass(GlobalDCEPass());
+    MPM.run(M, MAM);
 }
 
 void runGlobalConstructors(std::vector<std::string> constructors) {
@@ -117,131 +122,445 @@ std::vector<std::string> findGlobalConstructors(GlobalVariable *GlobalCtors) {
     return constructors;    
 }
 
-void runLemon() {
-    getNextToken();
+// Target init and the JIT, the first time something needs them. Only
+// called from the main thread (host mode starts it before its threads).
+LemonJIT &startJIT() {
+    if (!TheJIT) {
+        InitializeNativeTarget();
+        InitializeNativeTargetAsmPrinter();
+        InitializeNativeTargetAsmParser();
+        TheJIT = ExitOnErr(LemonJIT::Create(JITOpts));
+    }
+    return *TheJIT;
+}
+
+// Session for the main file, taking over what parsed it.
+std::unique_ptr<CompilerSession> createSession(FrontEnd Front) {
+    LemonJIT &J = startJIT();
+    return ExitOnErr(EMIT_OBJ.empty() ? CompilerSession::Create(J, std::move(Front))
+                                      : CompilerSession::CreateForObject(J, EMIT_OBJ, "", std::move(Front)));
+}
+
+// `Loaded`: the program, if it came from an AST binary. The lexer is on
+// its source then, only for diagnostics.
+int runLemon(FrontEnd &Front, std::unique_ptr<LemonAST> Loaded, double loadMs) {
+    Front.Lex.getNextToken();
     while (true) {
-        switch (curTok) {
+        switch (Front.Lex.curTok) {
 
         case tok_eof:
-            return;
+            return 0;
 
         default:
-            auto result = Parse();
+            auto parseStart = std::chrono::steady_clock::now();
+            auto result = Loaded ? std::move(Loaded) : Parser(Front).Parse();
+            double parseMs = loadMs + msSince(parseStart);
+
+            // Every parse error in the file, not just the first one.
+            if (Front.printDiagnostics())
+                return 1;
+
+            // Small enough: interpreted, LLVM is never started (unless a
+            // function gets hot). Whatever the interpreter can't do goes on
+            // to the JIT, errors too.
+            if (INTERP != INTERP_OFF) {
+                auto interpStart = std::chrono::steady_clock::now();
+                auto Bytecode = compileBytecode(*result, startJIT);
+                if (Bytecode && (INTERP == INTERP_ON || (Bytecode->size() <= INTERP_MAX_INSTRS && !Bytecode->loops()))) {
+                    double compileMs = msSince(interpStart);
+
+                    auto execStart = std::chrono::steady_clock::now();
+                    runBytecode(*Bytecode);
+                    double execMs = msSince(execStart);
+
+                    if (TIME_PHASES)
+                        printf("{\"parse_ms\": %f, \"codegen_ms\": %f, \"jit_ms\": %f, \"exec_ms\": %f}\n",
+                               parseMs, compileMs, 0.0, execMs);
+                    return 0;
+                }
+            }
+
+            auto Session = createSession(std::move(Front));
+            CompilerSession &S = *Session;
+
+            auto codegenStart = std::chrono::steady_clock::now();
 
-            // Make main func.
-            FunctionType *FT = 
-                FunctionType::get(Type::getDoubleTy(*TheContext), false);        
-            
-            Function *F =
-                Function::Create(FT, Function::ExternalLinkage, "lemon_main", TheModule.get());
-            
-            BasicBlock *BB = BasicBlock::Create(*TheContext, "entry", F);
-            MainBuilder->SetInsertPoint(BB);
-            
             // result->showAST(); // Print AST for debugging.
-            result->codegen();
+            if (!S.compileProgram(*result, INPUT_FILE, !WHOLE_PROGRAM))
+                return 1;
             
             // Optimizations:
             // TheFPM->run(*F, *TheFAM);
+            if (WHOLE_PROGRAM)
+                internalizeModule(*S.TheModule, *S.TheMAM);
+            double codegenMs = msSince(codegenStart);
 
-            // Saving LLVM IR to a file.
+            // Saving LLVM IR to a file (JIT tier only, interpreted programs have none).
             std::error_code EC;
             raw_fd_ostream out("./output.ll", EC, sys::fs::OF_None);
             
             if (EC) {
                 errs() << "Error opening file: " << EC.message() << "\n";
-                return;
+                return 1;
             }
             
-            TheModule->print(out, nullptr);
+            S.TheModule->print(out, nullptr);
+
+            // AOT: write an object file instead of running it.
+            // Link with: cc prog.o -llemonrt -lm
+            if (!EMIT_OBJ.empty()) {
+                addMainWrapper(*S.TheModule);
+                if (!emitObjectFile(*S.TheModule, *S.TM, EMIT_OBJ)) {
+                    fprintf(stderr, "🍋 Failed to emit object file: %s\n", EMIT_OBJ.c_str());
+                    return 1;
+                }
+                return 0;
+            }
           
             // JIT Execution (using this as "AOT" compiler for now...)
             // fprintf(stderr, "🍋 Lemon Executing...\n");
             
             // Getting global variable constructors.
-            GlobalVariable *GlobalCtors = TheModule->getGlobalVariable("llvm.global_ctors");
+            GlobalVariable *GlobalCtors = S.TheModule->getGlobalVariable("llvm.global_ctors");
             std::vector<std::string> GlobalConstructorFunctions = findGlobalConstructors(GlobalCtors);
             
             // Creating resource tracker and loading context on to JIT
-            auto RT = TheJIT->getMainJITDylib().getDefaultResourceTracker();
-            auto TSM = ThreadSafeModule(std::move(TheModule), std::move(TheContext));
-            ExitOnErr(TheJIT->addModule(std::move(TSM), RT));
-            InitializeModule();
+            auto jitStart = std::chrono::steady_clock::now();
 
             // Run global constructors to initialize global variables, before lemon_main.
             // DEPRECATED, now calling inits() in lemon_main
             // runGlobalConstructors(GlobalConstructorFunctions);
 
+            double (*FP)() = ExitOnErr(S.loadProgram());
+            double jitMs = msSince(jitStart);
+
+            S.InitializeModule();
+
             // Executing main()
-            auto ExprSymbol = ExitOnErr(TheJIT->lookup("lemon_main"));
-            double (*FP)() = ExprSymbol.toPtr<double (*)()>();
+            auto execStart = std::chrono::steady_clock::now();
             FP();
+            double execMs = msSince(execStart);
+
+            if (PROFILE)
+                lemon_prof_report();
             // fprintf(stderr, "Evaluated to %f\n\n\n", FP());
+
+            // Program output goes to stderr, so stdout only has this line.
+            if (TIME_PHASES)
+                printf("{\"parse_ms\": %f, \"codegen_ms\": %f, \"jit_ms\": %f, \"exec_ms\": %f}\n",
+                       parseMs, codegenMs, jitMs, execMs);
             
             // Dumping JITDylib symbol table.
             // TheJIT->getMainJITDylib().dump(errs());
             
-            ExitOnErr(RT->remove());
+            ExitOnErr(TheJIT->getMainJITDylib().getDefaultResourceTracker()->remove());
             
-            return;
+            return 0;
         }
     }
 }
 
-void runLemonREPL() {
+void runLemonREPL(CompilerSession &S) {
     fprintf(stderr, "LEMON> ");
-    getNextToken();
+    S.Lex.getNextToken();
     while (true) {
-        switch (curTok) {
+        switch (S.Lex.curTok) {
         case tok_eof:
             break;
         
         default:
-            auto curLine = Parse();
+            auto curLine = Parser(S).Parse();
 
             // Make current block function
             FunctionType *FT =
-                FunctionType::get(Type::getDoubleTy(*TheContext), false);
+                FunctionType::get(Type::getDoubleTy(*S.TheContext), false);
             Function *F =
-                Function::Create(FT, Function::ExternalLinkage, "lemon_block", TheModule.get());
+                Function::Create(FT, Function::ExternalLinkage, "lemon_block", S.TheModule.get());
             
-            BasicBlock *BB = BasicBlock::Create(*TheContext, "entry", F);
+            BasicBlock *BB = BasicBlock::Create(*S.TheContext, "entry", F);
             
             // TBC
         }
     }
 }
 
+// ============================================================================
+//                                Host mode
+// ============================================================================
+// One warm process running many programs: `lemon a.lem b.lem c.lem ...`.
+// Every program is compiled in its own session into its own JITDylib, 
+// linked against the main one, which only has the runtime (and whatever the
+// process exports) in this mode. So programs can all define lemon_main and
+// the same function names, run on different threads at the same time, and
+// a program's code is freed through its ResourceTracker as soon as it's done.
+
+// Compiles, runs and unloads one program. Safe to call from several threads.
+int runHostedProgram(const std::string &file, unsigned id) {
+    auto Session = CompilerSession::Create(*TheJIT);
+    if (!Session) {
+        fprintf(stderr, "🍋 %s: %s\n", file.c_str(), toString(Session.takeError()).c_str());
+        return 1;
+    }
+    CompilerSession &S = **Session;
+
+    auto Input = MemoryBuffer::getFile(file);
+    if (!Input) {
+        fprintf(stderr, "🍋 Can't read %s: %s\n", file.c_str(), Input.getError().message().c_str());
+        return 1;
+    }
+
+    auto parseStart = std::chrono::steady_clock::now();
+    std::unique_ptr<LemonAST> Program;
+    if (isASTBinary((*Input)->getBuffer())) {
+        Program = loadASTBinary(S, **Input);
+        if (!Program)
+            return 1;
+    } else {
+        std::string error;
+        if (!S.setSource(file, (*Input)->getBufferStart(), (*Input)->getBufferEnd(), error)) {
+            fprintf(stderr, "🍋 %s\n", error.c_str());
+            return 1;
+        }
+        S.Lex.getNextToken();
+        Program = Parser(S).Parse();
+    }
+    double parseMs = msSince(parseStart);
+    if (S.printDiagnostics())
+        return 1;
+
+    // JITDylib names have to be unique, the same file can be run twice.
+    S.createProgramJITDylib("<" + file + " #" + std::to_string(id) + ">");
+
+    auto codegenStart = std::chrono::steady_clock::now();
+    if (!S.compileProgram(*Program, file, !WHOLE_PROGRAM)) {
+        S.removeProgramJITDylib();
+        return 1;
+    }
+    if (WHOLE_PROGRAM)
+        internalizeModule(*S.TheModule, *S.TheMAM);
+    double codegenMs = msSince(codegenStart);
+
+    auto jitStart = std::chrono::steady_clock::now();
+    auto Main = S.loadProgram();
+    if (!Main) {
+        fprintf(stderr, "🍋 %s: %s\n", file.c_str(), toString(Main.takeError()).c_str());
+        S.removeProgramJITDylib();
+        return 1;
+    }
+    double jitMs = msSince(jitStart);
+
+    auto execStart = std::chrono::steady_clock::now();
+    (*Main)();
+    double execMs = msSince(execStart);
+
+    S.removeProgramJITDylib();
+
+    if (TIME_PHASES)
+        printf("{\"file\": \"%s\", \"parse_ms\": %f, \"codegen_ms\": %f, \"jit_ms\": %f, \"exec_ms\": %f}\n",
+               file.c_str(), parseMs, codegenMs, jitMs, execMs);
+    return 0;
+}
+
+// Runs every file in HOST_FILES on JOBS threads, 1 if any of them failed.
+int runHost() {
+    unsigned numThreads = JOBS ? JOBS : std::max(1u, std::thread::hardware_concurrency());
+    numThreads = std::min<size_t>(numThreads, HOST_FILES.size());
+
+    std::atomic<unsigned> next{0};
+    std::atomic<int> failed{0};
+    auto worker = [&] {
+        for (unsigned i = next++; i < HOST_FILES.size(); i = next++) {
+            if (runHostedProgram(HOST_FILES[i], i))
+                failed = 1;
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (unsigned t = 0; t < numThreads; ++t)
+        threads.emplace_back(worker);
+    for (auto &thread : threads)
+        thread.join();
+
+    return failed;
+}
+
 int main(int argc, char **argv) {
-    InitializeNativeTarget();
-    InitializeNativeTargetAsmPrinter();
-    InitializeNativeTargetAsmParser();
-    
-    if (argc > 1 && *argv[1] == '1') {
-        REPL_MODE = 1;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+
+        if (arg == "1")
+            REPL_MODE = 1;
+        else if (arg == "--whole-program")
+            WHOLE_PROGRAM = 1;
+        else if (arg.rfind("--export=", 0) == 0)
+            ExportedSymbols.insert(arg.substr(strlen("--export=")));
+        else if (arg.rfind("--vector-lib=", 0) == 0)
+            VECTOR_LIB = arg.substr(strlen("--vector-lib="));
+        else if (arg.rfind("--mcpu=", 0) == 0)
+            JITOpts.CPU = arg.substr(strlen("--mcpu="));
+        else if (arg.rfind("--mattr=", 0) == 0)
+            JITOpts.Features = arg.substr(strlen("--mattr="));
+        else if (arg.rfind("--emit-obj=", 0) == 0)
+            EMIT_OBJ = arg.substr(strlen("--emit-obj="));
+        else if (arg.rfind("--emit-ast-bin=", 0) == 0)
+            EMIT_AST_BIN = arg.substr(strlen("--emit-ast-bin="));
+        else if (arg == "--multiversion")
+            MULTIVERSION = 1;
+        else if (arg == "--time")
+            TIME_PHASES = 1;
+        else if (arg == "--profile")
+            PROFILE = 1;
+        else if (arg == "--perf-map")
+            JITOpts.PerfMap = true;
+        else if (arg == "--jitdump")
+            JITOpts.JITDump = true;
+        else if (arg == "--gdb-jit")
+            JITOpts.GDBRegistration = true;
+        else if (arg.rfind("--cache-dir=", 0) == 0)
+            CACHE_DIR = arg.substr(strlen("--cache-dir="));
+        else if (arg == "-g")
+            DEBUG_INFO = DEBUG_INFO_FULL;
+        else if (arg == "-gline-tables-only")
+            DEBUG_INFO = DEBUG_INFO_LINES;
+        else if (arg == "--interp")
+            INTERP = INTERP_ON;
+        else if (arg == "--no-interp")
+            INTERP = INTERP_OFF;
+        else if (arg == "--watch")
+            WATCH = 1;
+        else if (arg.rfind("--jobs=", 0) == 0) {
+            // At least one thread, 0 is only the default.
+            if (StringRef(arg).substr(strlen("--jobs=")).getAsInteger(10, JOBS) || JOBS == 0) {
+                fprintf(stderr, "🍋 Invalid option: %s\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (arg == "-" || arg[0] != '-')
+            HOST_FILES.push_back(arg);
+        else {
+            fprintf(stderr, "🍋 Unknown option: %s\n", argv[i]);
+            return 1;
+        }
     }
     
-    // comparison ops
-    operatorPrecedence[tok_lt] = 10; 
-    operatorPrecedence[tok_gt] = 10; 
-    operatorPrecedence[tok_le] = 10; 
-    operatorPrecedence[tok_ge] = 10; 
-    operatorPrecedence[tok_eq] = 10;
-
-    // expr ops
-    operatorPrecedence[tok_add] = 20;
-    operatorPrecedence[tok_sub] = 30;
-    operatorPrecedence[tok_mul] = 40;
-    operatorPrecedence[tok_div] = 40;
-    
-    TheJIT = ExitOnErr(LemonJIT::Create());
-    
-    InitializeModule();
+    if (HOST_FILES.size() == 1)
+        INPUT_FILE = HOST_FILES[0];
+
+    // Host mode runs programs side by side and unloads them when they're 
+    // done, none of these fit that.
+    if (HOST_FILES.size() > 1) {
+        if (REPL_MODE || !EMIT_OBJ.empty() || std::count(HOST_FILES.begin(), HOST_FILES.end(), "-")) {
+            fprintf(stderr, "🍋 Several source files (host mode) don't work with the REPL, --emit-obj or stdin.\n");
+            return 1;
+        }
+        if (PROFILE) {
+            // The profile keeps pointers to names in the programs' code.
+            fprintf(stderr, "🍋 --profile only works with one source file, ignoring it.\n");
+            PROFILE = 0;
+        }
+    }
+
+    if (!EMIT_AST_BIN.empty() && (HOST_FILES.size() > 1 || WATCH || REPL_MODE || !EMIT_OBJ.empty())) {
+        fprintf(stderr, "🍋 --emit-ast-bin only parses one source file, no host mode, --watch, REPL or --emit-obj.\n");
+        return 1;
+    }
+
+    if (WATCH) {
+        if (HOST_FILES.size() != 1 || INPUT_FILE == "-" || REPL_MODE || !EMIT_OBJ.empty()) {
+            fprintf(stderr, "🍋 --watch needs exactly one source file, and no REPL or --emit-obj.\n");
+            return 1;
+        }
+        if (PROFILE || MULTIVERSION || WHOLE_PROGRAM) {
+            fprintf(stderr, "🍋 --watch compiles every function on its own, ignoring --profile, --multiversion and --whole-program.\n");
+            PROFILE = MULTIVERSION = WHOLE_PROGRAM = 0;
+        }
+    }
+
+    // Multi-versioned kernels are dispatched by a global constructor, 
+    // which only runs in AOT binaries.
+    if (MULTIVERSION && EMIT_OBJ.empty()) {
+        fprintf(stderr, "🍋 --multiversion needs --emit-obj, ignoring it.\n");
+        MULTIVERSION = 0;
+    }
+
+    // Nothing comes out of the interpreter but the program's output: no
+    // object, profile, debug info, perf map or cache, and the code
+    // generation flags have nothing to generate.
+    if (!EMIT_OBJ.empty() || PROFILE || DEBUG_INFO != DEBUG_INFO_NONE || WHOLE_PROGRAM ||
+        JITOpts.PerfMap || JITOpts.JITDump || JITOpts.GDBRegistration ||
+        !JITOpts.CPU.empty() || !JITOpts.Features.empty() || VECTOR_LIB != "none" || !CACHE_DIR.empty()) {
+        if (INTERP == INTERP_ON)
+            fprintf(stderr, "🍋 --interp doesn't work with --emit-obj, --profile, -g, --whole-program, --perf-map, "
+                            "--jitdump, --gdb-jit, --mcpu, --mattr, --vector-lib or --cache-dir, ignoring it.\n");
+        INTERP = INTERP_OFF;
+    }
+
+    // Objects are shipped to other machines, so default to the baseline 
+    // CPU instead of whatever this host has.
+    if (!EMIT_OBJ.empty() && JITOpts.CPU.empty())
+        JITOpts.CPU = "generic";
+
+    // Debugging JIT'd code needs the debugger to know about it.
+    if (DEBUG_INFO != DEBUG_INFO_NONE && EMIT_OBJ.empty())
+        JITOpts.GDBRegistration = true;
+
+    loadVectorLibrary();
+
+    if (HOST_FILES.size() > 1) {
+        startJIT();
+        return runHost();
+    }
+    if (WATCH)
+        return runWatch(startJIT(), INPUT_FILE);
+
+    // Parsed before anything else, the interpreter may run it without LLVM.
+    FrontEnd Front;
+
+    // Whole file in memory (mmap'd for big files), the lexer works on it directly.
+    auto Input = MemoryBuffer::getFileOrSTDIN(INPUT_FILE);
+    if (!Input) {
+        fprintf(stderr, "🍋 Can't read %s: %s\n", INPUT_FILE.c_str(), Input.getError().message().c_str());
+        return 1;
+    }
+
+    // Precompiled AST (--emit-ast-bin): no lexing or parsing, the lexer
+    // gets the source stored in it.
+    std::unique_ptr<LemonAST> Loaded;
+    double loadMs = 0;
+    if (isASTBinary((*Input)->getBuffer())) {
+        auto loadStart = std::chrono::steady_clock::now();
+        Loaded = loadASTBinary(Front, **Input);
+        if (!Loaded)
+            return 1;
+        loadMs = msSince(loadStart);
+    } else {
+        std::string error;
+        if (!Front.setSource(INPUT_FILE, (*Input)->getBufferStart(), (*Input)->getBufferEnd(), error)) {
+            fprintf(stderr, "🍋 %s\n", error.c_str());
+            return 1;
+        }
+    }
+
+    // Parse only, no codegen: a bad program is still an error here.
+    if (!EMIT_AST_BIN.empty()) {
+        if (!Loaded) {
+            Front.Lex.getNextToken();
+            Loaded = Parser(Front).Parse();
+            if (Front.printDiagnostics())
+                return 1;
+        }
+        if (!writeASTBinary(*Loaded, Front.Lex, EMIT_AST_BIN)) {
+            fprintf(stderr, "🍋 Can't write %s\n", EMIT_AST_BIN.c_str());
+            return 1;
+        }
+        return 0;
+    }
     
-    if (REPL_MODE)
-        runLemonREPL();
-    else
-        runLemon();
+    if (REPL_MODE) {
+        runLemonREPL(*createSession(std::move(Front)));
+        return 0;
+    }
 
-    return 0;
+    return runLemon(Front, std::move(Loaded), loadMs);
 }
@@ -0,0 +1,109 @@
+// ============================================================================
+// lemonc: thin client for lemond
+// ============================================================================
+//     lemonc prog.lem                     compile and run in the daemon
+//     lemonc --emit-obj=prog.o prog.lem   compile to an object file
+//     lemonc < prog.lem                   source from stdin
+//
+// Sends the source and its stdout/stderr to the daemon and exits with the
+// program's status. No LLVM in here, starting it is just a process start.
+
+#include "../include/Daemon.h"
+
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Paths are resolved by the daemon, which has its own working directory.
+static std::string absolutePath(const std::string &path) {
+    if (path.empty() || path[0] == '/')
+        return path;
+
+    char cwd[PATH_MAX];
+    if (!getcwd(cwd, sizeof(cwd)))
+        return path;
+    return std::string(cwd) + "/" + path;
+}
+
+static bool readSource(const std::string &path, std::string &source) {
+    FILE *f = path == "-" ? stdin : fopen(path.c_str(), "rb");
+    if (!f)
+        return false;
+
+    char buf[1 << 16];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+        source.append(buf, n);
+
+    bool ok = !ferror(f);
+    if (f != stdin)
+        fclose(f);
+    return ok;
+}
+
+int main(int argc, char **argv) {
+    std::string socketPath = defaultSocketPath();
+    std::string inputFile = "-";
+    std::string emitObj;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+
+        if (arg.rfind("--socket=", 0) == 0)
+            socketPath = arg.substr(strlen("--socket="));
+        else if (arg.rfind("--emit-obj=", 0) == 0)
+            emitObj = arg.substr(strlen("--emit-obj="));
+        else if (arg == "-" || arg[0] != '-')
+            inputFile = arg;
+        else {
+            fprintf(stderr, "🍋 Unknown option: %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    Request R;
+    R.kind = emitObj.empty() ? request_run : request_emit_obj;
+    R.path = inputFile == "-" ? "-" : absolutePath(inputFile);
+    R.objPath = absolutePath(emitObj);
+    R.outFd = STDOUT_FILENO;
+    R.errFd = STDERR_FILENO;
+
+    if (!readSource(inputFile, R.source)) {
+        fprintf(stderr, "🍋 Can't read %s: %s\n", inputFile.c_str(), strerror(errno));
+        return 1;
+    }
+
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (socketPath.size() >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "🍋 Socket path is too long: %s\n", socketPath.c_str());
+        return 1;
+    }
+    strcpy(addr.sun_path, socketPath.c_str());
+
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0 || connect(sock, (sockaddr *)&addr, sizeof(addr))) {
+        fprintf(stderr, "🍋 Can't connect to lemond on %s: %s (is lemond running?)\n",
+                socketPath.c_str(), strerror(errno));
+        return 1;
+    }
+
+    // Anyone can bind a socket where lemond would be, while it isn't running.
+    if (!peerIsSameUser(sock)) {
+        fprintf(stderr, "🍋 %s isn't a lemond of your own user, not sending it anything.\n", socketPath.c_str());
+        return 1;
+    }
+
+    int32_t status;
+    if (!sendRequest(sock, R) || !readAll(sock, &status, sizeof(status))) {
+        fprintf(stderr, "🍋 lemond dropped the request.\n");
+        return 1;
+    }
+    close(sock);
+    return status;
+}
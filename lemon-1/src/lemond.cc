@@ -0,0 +1,268 @@
+// ============================================================================
+// lemond: compile server
+// ============================================================================
+// Keeps LLVM initialized and one JIT warm, and compiles/runs whatever lemonc
+// sends over a Unix socket (see Daemon.h). A request only pays for its own
+// parse, codegen and JIT, not for process start, target init and JIT setup.
+//
+//     lemond &
+//     lemonc prog.lem
+//     lemonc --emit-obj=prog.o prog.lem
+//
+// Every request gets its own CompilerSession and JITDylib (like host mode in
+// lemon.cc), so requests compile in parallel and are unloaded when done.
+// Running is serialized: the client's stdout and stderr are dup'ed over the
+// daemon's own for the duration of the run, so output goes where it would
+// have gone without the daemon.
+
+#include "../include/Parser.h"
+#include "../include/AOT.h"
+#include "../include/Import.h"
+#include "../include/Daemon.h"
+#include "../include/Runtime.h"
+#include "../include/CompilerSession.h"
+
+#include <csignal>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static ExitOnError ExitOnErr;
+
+std::string SOCKET_PATH;    // --socket=<path>
+std::string OBJ_CPU;        // CPU for emit-obj requests, see main()
+
+std::unique_ptr<LemonJIT> TheJIT;
+std::mutex RunMutex;        // One program runs at a time, it owns fds 1 and 2 while it does
+
+static char SocketPathForSignal[sizeof(sockaddr_un::sun_path)];
+
+// Errors that aren't diagnostics go to the client too.
+static int fail(const Request &R, const std::string &msg) {
+    std::string line = "🍋 " + msg + "\n";
+    writeAll(R.errFd, line.data(), line.size());
+    return 1;
+}
+
+// Parse and codegen, up to a module in S.TheModule. 1 on errors, already
+// reported to the client.
+static int compileRequest(CompilerSession &S, const Request &R, std::string &diagnostics) {
+    std::string error;
+    if (!S.setSource(R.path, R.source.data(), R.source.data() + R.source.size(), error))
+        return fail(R, error);
+
+    S.DiagnosticLog = &diagnostics;
+    S.Lex.getNextToken();
+    auto Program = Parser(S).Parse();
+    if (S.printDiagnostics() || !S.compileProgram(*Program, R.path)) {
+        writeAll(R.errFd, diagnostics.data(), diagnostics.size());
+        return 1;
+    }
+    return 0;
+}
+
+static int runRequest(const Request &R, unsigned id) {
+    auto Session = CompilerSession::Create(*TheJIT);
+    if (!Session)
+        return fail(R, toString(Session.takeError()));
+    CompilerSession &S = **Session;
+
+    // Own JITDylib, so two requests can both define lemon_main.
+    S.createProgramJITDylib("<request " + std::to_string(id) + ">");
+
+    int status = 1;
+    std::string diagnostics;
+    if (compileRequest(S, R, diagnostics) == 0) {
+        if (auto Main = S.loadProgram(); !Main) {
+            fail(R, toString(Main.takeError()));
+        } else {
+            std::lock_guard<std::mutex> Lock(RunMutex);
+            fflush(stdout);
+            fflush(stderr);
+            int savedOut = dup(STDOUT_FILENO);
+            int savedErr = dup(STDERR_FILENO);
+            dup2(R.outFd, STDOUT_FILENO);
+            dup2(R.errFd, STDERR_FILENO);
+
+            (*Main)();
+
+            fflush(stdout);
+            fflush(stderr);
+            dup2(savedOut, STDOUT_FILENO);
+            dup2(savedErr, STDERR_FILENO);
+            close(savedOut);
+            close(savedErr);
+            status = 0;
+        }
+    }
+
+    S.removeProgramJITDylib();
+    return status;
+}
+
+static int emitObjRequest(const Request &R) {
+    auto Session = CompilerSession::CreateForObject(*TheJIT, R.objPath, OBJ_CPU);
+    if (!Session)
+        return fail(R, toString(Session.takeError()));
+    CompilerSession &S = **Session;
+
+    std::string diagnostics;
+    if (compileRequest(S, R, diagnostics))
+        return 1;
+
+    addMainWrapper(*S.TheModule);
+    if (!emitObjectFile(*S.TheModule, *S.TM, R.objPath))
+        return fail(R, "Failed to emit object file: " + R.objPath);
+    return 0;
+}
+
+static void handleClient(int sock, unsigned id) {
+    Request R;
+    if (recvRequest(sock, R)) {
+        int32_t status = R.kind == request_run ? runRequest(R, id) : emitObjRequest(R);
+        writeAll(sock, &status, sizeof(status));
+    }
+
+    if (R.outFd >= 0)
+        close(R.outFd);
+    if (R.errFd >= 0)
+        close(R.errFd);
+    close(sock);
+}
+
+static void removeSocketAndExit(int) {
+    unlink(SocketPathForSignal);
+    _exit(0);
+}
+
+// Listening socket at SOCKET_PATH, -1 on errors (already printed).
+static int listenOnSocket() {
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (SOCKET_PATH.size() >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "🍋 Socket path is too long: %s\n", SOCKET_PATH.c_str());
+        return -1;
+    }
+    strcpy(addr.sun_path, SOCKET_PATH.c_str());
+
+    std::string error;
+    if (!checkSocketDir(SOCKET_PATH, true, error)) {
+        fprintf(stderr, "🍋 Can't listen on %s: %s\n", SOCKET_PATH.c_str(), error.c_str());
+        return -1;
+    }
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        fprintf(stderr, "🍋 socket(): %s\n", strerror(errno));
+        return -1;
+    }
+
+    // A socket file nobody answers on is left over from a daemon that died.
+    if (connect(sock, (sockaddr *)&addr, sizeof(addr)) == 0) {
+        fprintf(stderr, "🍋 lemond is already running on %s\n", SOCKET_PATH.c_str());
+        close(sock);
+        return -1;
+    }
+    unlink(SOCKET_PATH.c_str());
+
+    // Only this user can connect, requests run arbitrary code.
+    mode_t oldMask = umask(0077);
+    int err = bind(sock, (sockaddr *)&addr, sizeof(addr));
+    umask(oldMask);
+    if (err || listen(sock, SOMAXCONN)) {
+        fprintf(stderr, "🍋 Can't listen on %s: %s\n", SOCKET_PATH.c_str(), strerror(errno));
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+int main(int argc, char **argv) {
+    LemonJITOptions JITOpts;
+    SOCKET_PATH = defaultSocketPath();
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+
+        if (arg.rfind("--socket=", 0) == 0)
+            SOCKET_PATH = arg.substr(strlen("--socket="));
+        else if (arg.rfind("--mcpu=", 0) == 0)
+            JITOpts.CPU = arg.substr(strlen("--mcpu="));
+        else if (arg.rfind("--mattr=", 0) == 0)
+            JITOpts.Features = arg.substr(strlen("--mattr="));
+        else if (arg.rfind("--cache-dir=", 0) == 0)
+            CACHE_DIR = arg.substr(strlen("--cache-dir="));
+        else if (arg == "--perf-map")
+            JITOpts.PerfMap = true;
+        else if (arg == "-g")
+            DEBUG_INFO = DEBUG_INFO_FULL;
+        else if (arg == "-gline-tables-only")
+            DEBUG_INFO = DEBUG_INFO_LINES;
+        else {
+            fprintf(stderr, "🍋 Unknown option: %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    // Like lemon --emit-obj: baseline CPU for objects unless --mcpu says otherwise.
+    if (JITOpts.CPU.empty())
+        OBJ_CPU = "generic";
+
+    // Debugging JIT'd code needs the debugger to know about it.
+    if (DEBUG_INFO != DEBUG_INFO_NONE)
+        JITOpts.GDBRegistration = true;
+
+    InitializeNativeTarget();
+    InitializeNativeTargetAsmPrinter();
+    InitializeNativeTargetAsmParser();
+
+    TheJIT = ExitOnErr(LemonJIT::Create(JITOpts));
+
+    // The daemon doesn't export its symbols, define the runtime by hand.
+    ExitOnErr(TheJIT->defineAbsolute("putchard", (void *)&putchard));
+    ExitOnErr(TheJIT->defineAbsolute("printd", (void *)&printd));
+
+    // Warm up: the first compile pays for lazy init (pass registration,
+    // target lookup, ...), get it out of the way before the first client.
+    {
+        auto S = ExitOnErr(CompilerSession::Create(*TheJIT));
+        std::string warmup = "func f(x) { return x * 2; } f(1);";
+        std::string error;
+        S->setSource("<warmup>", warmup.data(), warmup.data() + warmup.size(), error);
+        S->Lex.getNextToken();
+        auto Program = Parser(*S).Parse();
+        S->codegenMain(*Program);
+    }
+
+    int listenSock = listenOnSocket();
+    if (listenSock < 0)
+        return 1;
+
+    strncpy(SocketPathForSignal, SOCKET_PATH.c_str(), sizeof(SocketPathForSignal) - 1);
+    signal(SIGINT, removeSocketAndExit);
+    signal(SIGTERM, removeSocketAndExit);
+    signal(SIGPIPE, SIG_IGN);   // Clients that go away mid-request
+
+    fprintf(stderr, "🍋 lemond listening on %s\n", SOCKET_PATH.c_str());
+
+    unsigned nextId = 0;
+    while (true) {
+        int sock = accept4(listenSock, nullptr, nullptr, SOCK_CLOEXEC);
+        if (sock < 0) {
+            if (errno != EINTR)
+                fprintf(stderr, "🍋 accept(): %s\n", strerror(errno));
+            continue;
+        }
+        // On top of the socket and directory permissions.
+        if (!peerIsSameUser(sock)) {
+            fprintf(stderr, "🍋 Refused a connection from another user.\n");
+            close(sock);
+            continue;
+        }
+        std::thread(handleClient, sock, nextId++).detach();
+    }
+}